@@ -0,0 +1,265 @@
+#define _GNU_SOURCE
+
+#include "archive.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+#define TAR_BLOCK 512
+#define TAR_MAGIC_OFFSET 257
+
+static int has_tar_magic(const unsigned char *block, size_t len) {
+  return len >= TAR_MAGIC_OFFSET + 5 && memcmp(block + TAR_MAGIC_OFFSET, "ustar", 5) == 0;
+}
+
+static size_t read_full(int fd, unsigned char *buf, size_t size) {
+  size_t got = 0;
+
+  while (got < size) {
+    ssize_t n = read(fd, buf + got, size - got);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    got += (size_t)n;
+  }
+
+  return got;
+}
+
+/*
+ * Reads the first decompressed block of path through "<tool> -dc". The
+ * decompressor is killed once the block is in, so only the head of the file
+ * is ever decoded.
+ */
+static size_t peek_decompressed(const char *tool, const char *path, unsigned char *buf,
+                                size_t size) {
+  int fds[2];
+  pid_t pid;
+  size_t got;
+
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    return 0;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+  }
+
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+
+    dup2(fds[1], STDOUT_FILENO);
+    if (devnull >= 0) {
+      dup2(devnull, STDERR_FILENO);
+    }
+    execlp(tool, tool, "-dc", path, NULL);
+    _exit(127);
+  }
+
+  close(fds[1]);
+  got = read_full(fds[0], buf, size);
+  close(fds[0]);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  return got;
+}
+
+enum archive_kind archive_detect(const char *path) {
+  unsigned char block[TAR_BLOCK];
+  struct stat st;
+  size_t len;
+  int fd;
+
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return ARCHIVE_NONE;
+  }
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return ARCHIVE_NONE;
+  }
+  len = read_full(fd, block, sizeof(block));
+  close(fd);
+
+  if (len >= 2 && block[0] == 0x1f && block[1] == 0x8b) {
+    len = peek_decompressed("gzip", path, block, sizeof(block));
+    return has_tar_magic(block, len) ? ARCHIVE_TAR_GZ : ARCHIVE_NONE;
+  }
+
+  if (len >= 4 && block[0] == 0x28 && block[1] == 0xb5 && block[2] == 0x2f &&
+      block[3] == 0xfd) {
+    len = peek_decompressed("zstd", path, block, sizeof(block));
+    return has_tar_magic(block, len) ? ARCHIVE_TAR_ZST : ARCHIVE_NONE;
+  }
+
+  return has_tar_magic(block, len) ? ARCHIVE_TAR : ARCHIVE_NONE;
+}
+
+const char *archive_kind_name(enum archive_kind kind) {
+  switch (kind) {
+  case ARCHIVE_TAR:
+    return "tar";
+  case ARCHIVE_TAR_GZ:
+    return "tar.gz";
+  case ARCHIVE_TAR_ZST:
+    return "tar.zst";
+  case ARCHIVE_NONE:
+  default:
+    return "none";
+  }
+}
+
+static int run_tar(const char *path, enum archive_kind kind, const char *dest_dir) {
+  const char *argv[10];
+  int argc = 0;
+  pid_t pid;
+  int status;
+
+  argv[argc++] = "tar";
+  argv[argc++] = "-x";
+  if (kind == ARCHIVE_TAR_GZ) {
+    argv[argc++] = "-z";
+  } else if (kind == ARCHIVE_TAR_ZST) {
+    argv[argc++] = "--zstd";
+  } else if (kind != ARCHIVE_TAR) {
+    return 1;
+  }
+  argv[argc++] = "-f";
+  argv[argc++] = path;
+  argv[argc++] = "-C";
+  argv[argc++] = dest_dir;
+  argv[argc] = NULL;
+
+  pid = fork();
+  if (pid < 0) {
+    return 1;
+  }
+
+  if (pid == 0) {
+    execvp("tar", (char *const *)argv);
+    _exit(127);
+  }
+
+  if (waitpid(pid, &status, 0) < 0) {
+    return 1;
+  }
+
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/*
+ * Merges src into dst the way tar -x does: directories merge, and anything
+ * else (a symlink to a directory included) is replaced. Runs chrooted.
+ */
+static int move_entries(const char *src, const char *dst) {
+  struct dirent *ent;
+  DIR *dir;
+  int rc = 0;
+
+  dir = opendir(src);
+  if (dir == NULL) {
+    return 1;
+  }
+
+  while (rc == 0 && (ent = readdir(dir)) != NULL) {
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    struct stat from_st;
+    struct stat to_st;
+
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+
+    snprintf(from, sizeof(from), "%s/%s", src, ent->d_name);
+    snprintf(to, sizeof(to), "%s/%s", strcmp(dst, "/") == 0 ? "" : dst, ent->d_name);
+    if (lstat(from, &from_st) != 0) {
+      rc = 1;
+    } else if (lstat(to, &to_st) == 0 && S_ISDIR(from_st.st_mode) && S_ISDIR(to_st.st_mode)) {
+      rc = move_entries(from, to) != 0 || lchown(to, from_st.st_uid, from_st.st_gid) != 0 ||
+           chmod(to, from_st.st_mode & 07777) != 0;
+    } else if (remove_recursive(to) != 0 || rename(from, to) != 0) {
+      rc = 1;
+    }
+  }
+
+  closedir(dir);
+  return rc;
+}
+
+static int move_into_rootfs(const char *rootfs, const char *staging, const char *dest_dir) {
+  pid_t pid;
+  int status;
+
+  pid = fork();
+  if (pid < 0) {
+    return 1;
+  }
+
+  if (pid == 0) {
+    if (chroot(rootfs) != 0 || chdir("/") != 0) {
+      fprintf(stderr, "[ERR] Extract chroot failed: %s\n", strerror(errno));
+      _exit(1);
+    }
+    if ((ensure_parent_dirs(dest_dir, 0755) != 0 ||
+         (ensure_dir_exists(dest_dir, 0755) != 0 && !is_directory(dest_dir))) ||
+        move_entries(staging, dest_dir) != 0) {
+      fprintf(stderr, "[ERR] Failed to move extracted files to %s: %s\n", dest_dir,
+              strerror(errno));
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  if (waitpid(pid, &status, 0) < 0) {
+    return 1;
+  }
+
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+int archive_extract(const char *path, enum archive_kind kind, const char *rootfs,
+                    const char *dest_dir) {
+  char uuid[64];
+  char staging[128];
+  char staging_host[PATH_MAX];
+  int rc;
+
+  if (generate_uuid(uuid) != 0) {
+    return 1;
+  }
+
+  snprintf(staging, sizeof(staging), "/.zocker-extract-%s", uuid);
+  snprintf(staging_host, sizeof(staging_host), "%s%s", rootfs, staging);
+  if (mkdir(staging_host, 0700) != 0) {
+    return 1;
+  }
+
+  rc = run_tar(path, kind, staging_host) != 0 ||
+       move_into_rootfs(rootfs, staging, dest_dir) != 0;
+  remove_recursive(staging_host);
+
+  if (rc != 0) {
+    fprintf(stderr, "[ERR] Failed to extract %s into %s\n", path, dest_dir);
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+enum archive_kind {
+  ARCHIVE_NONE = 0,
+  ARCHIVE_TAR = 1,
+  ARCHIVE_TAR_GZ = 2,
+  ARCHIVE_TAR_ZST = 3,
+};
+
+/*
+ * Detects a tarball by its bytes, not its name: gzip and zstd magic select
+ * the decompressor, and the (decompressed) first block must carry the ustar
+ * magic. Anything else, including directories, is ARCHIVE_NONE.
+ */
+enum archive_kind archive_detect(const char *path);
+const char *archive_kind_name(enum archive_kind kind);
+
+/*
+ * Unpacks the archive into dest_dir, a path inside rootfs. The host's tar
+ * writes into a fresh staging directory under rootfs, and the entries are
+ * then renamed into place by a child chrooted into rootfs, so symlinks in the
+ * image resolve inside it rather than on the host. Nothing is copied.
+ */
+int archive_extract(const char *path, enum archive_kind kind, const char *rootfs,
+                    const char *dest_dir);
+
+#endif
@@ -2,174 +2,69 @@
 
 #include "build.h"
 
-#include <ctype.h>
 #include <errno.h>
+#include <glob.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "archive.h"
+#include "commit_queue.h"
+#include "download.h"
+#include "ignore.h"
 #include "image_store.h"
+#include "prefetch.h"
 #include "setup.h"
 #include "utils.h"
-
-#define MAX_STAGES 32
-#define MAX_LOCAL_ARGS 128
-
-struct arg_map {
-  struct build_arg items[MAX_LOCAL_ARGS];
-  int count;
-};
+#include "watch.h"
+#include "zockerfile.h"
 
 struct stage_ctx {
   char name[64];
   char base_chain[8192];
+  char base_layer[64];
   char top_layer[64];
   char state_hash[17];
   char workdir[512];
-  struct arg_map args;
   char cmd[1024];
-};
-
-static int arg_map_set(struct arg_map *map, const char *key, const char *value) {
-  int i;
-
-  if (map == NULL || key == NULL || value == NULL || key[0] == '\0') {
-    return 1;
-  }
-
-  for (i = 0; i < map->count; i++) {
-    if (strcmp(map->items[i].key, key) == 0) {
-      snprintf(map->items[i].value, sizeof(map->items[i].value), "%s", value);
-      return 0;
-    }
-  }
-
-  if (map->count >= MAX_LOCAL_ARGS) {
-    return 1;
-  }
-
-  snprintf(map->items[map->count].key, sizeof(map->items[map->count].key), "%s",
-           key);
-  snprintf(map->items[map->count].value,
-           sizeof(map->items[map->count].value), "%s", value);
-  map->count++;
-  return 0;
-}
-
-static const char *arg_map_get(const struct arg_map *map, const char *key) {
-  int i;
-
-  if (map == NULL || key == NULL) {
-    return NULL;
-  }
-
-  for (i = 0; i < map->count; i++) {
-    if (strcmp(map->items[i].key, key) == 0) {
-      return map->items[i].value;
-    }
-  }
-
-  return NULL;
-}
-
-static void arg_map_copy(struct arg_map *dst, const struct arg_map *src) {
-  if (dst == NULL || src == NULL) {
-    return;
-  }
-  memset(dst, 0, sizeof(*dst));
-  memcpy(dst, src, sizeof(*dst));
-}
 
-static int init_cli_args_map(const struct config *cfg, struct arg_map *map) {
-  int i;
-
-  memset(map, 0, sizeof(*map));
-  for (i = 0; i < cfg->build_arg_count; i++) {
-    if (arg_map_set(map, cfg->build_args[i].key, cfg->build_args[i].value) != 0) {
-      return 1;
-    }
-  }
-  return 0;
-}
-
-static int substitute_args(const char *input, const struct arg_map *args, char *out,
-                           size_t out_size) {
-  size_t i = 0;
-  size_t w = 0;
-
-  if (input == NULL || out == NULL || out_size == 0) {
-    return 1;
-  }
-
-  while (input[i] != '\0') {
-    if (input[i] == '$') {
-      char key[128] = {0};
-      size_t k = 0;
-      const char *value;
-      size_t value_len;
-
-      if (input[i + 1] == '$') {
-        if (w + 1 >= out_size) return 1;
-        out[w++] = '$';
-        i += 2;
-        continue;
-      }
-
-      if (input[i + 1] == '{') {
-        i += 2;
-        while (input[i] != '\0' && input[i] != '}' && k + 1 < sizeof(key)) {
-          key[k++] = input[i++];
-        }
-        if (input[i] == '}') {
-          i++;
-        }
-      } else {
-        i++;
-        while (input[i] != '\0' &&
-               (isalnum((unsigned char)input[i]) || input[i] == '_') &&
-               k + 1 < sizeof(key)) {
-          key[k++] = input[i++];
-        }
-
-        if (k == 0) {
-          if (w + 1 >= out_size) return 1;
-          out[w++] = '$';
-          continue;
-        }
-      }
+  /* Plan mode: a step in this stage missed, so later keys cannot be known. */
+  int plan_unknown;
+};
 
-      key[k] = '\0';
-      value = arg_map_get(args, key);
-      if (value == NULL) {
-        value = "";
-      }
+struct build_plan {
+  int steps;
+  int cached;
+  int rebuild;
+  int unestimated;
+  long estimate_ms;
+};
 
-      value_len = strlen(value);
-      if (w + value_len >= out_size) {
-        return 1;
-      }
+struct build_session {
+  int blob_pool;
+  int plan_only;
+  struct build_plan plan;
+  struct prefetch_pool *prefetch;
 
-      memcpy(out + w, value, value_len);
-      w += value_len;
-      continue;
-    }
+  /* ADD <url> fetches, started right after parsing; NULL in plan mode. */
+  struct prefetch_pool *downloads;
+  struct commit_queue *commits;
 
-    if (w + 1 >= out_size) {
-      return 1;
-    }
+  /* Context filter from .zockerignore; NULL when there are no rules. */
+  const struct path_filter *ignore;
+};
 
-    out[w++] = input[i++];
-  }
+static long monotonic_ms(void) {
+  struct timespec ts;
 
-  out[w] = '\0';
-  return 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long)ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
 }
 
 static int ensure_dir_path(const char *path, mode_t mode) {
@@ -210,6 +105,22 @@ static int compute_state_hash(const char *parent_hash, const char *descriptor,
   return hash_string(raw, out_hash);
 }
 
+/*
+ * The state that follows a committed layer is derived from the content of its
+ * diff rather than from the step's descriptor, so a step that re-runs but
+ * produces identical files leaves every following cache key unchanged.
+ */
+static int compute_content_state(const char *parent_hash, const char *diff_hash,
+                                 char out_hash[17]) {
+  char raw[256];
+
+  if (snprintf(raw, sizeof(raw), "%s|DIFF|%s", parent_hash, diff_hash) < 0) {
+    return 1;
+  }
+
+  return hash_string(raw, out_hash);
+}
+
 static int resolve_stage_chain(const struct stage_ctx *stage, char *out_chain,
                                size_t out_size) {
   if (stage == NULL || out_chain == NULL) {
@@ -290,8 +201,8 @@ static const char *basename_of(const char *path) {
 }
 
 static int copy_into_rootfs(const char *merged_root, const char *src_host_path,
-                            const char *dst_in_container,
-                            const char *current_workdir) {
+                            const char *dst_in_container, const char *current_workdir,
+                            const struct path_filter *filter) {
   char dst_abs[PATH_MAX];
   char dst_host[PATH_MAX];
   struct stat src_st;
@@ -319,10 +230,10 @@ static int copy_into_rootfs(const char *merged_root, const char *src_host_path,
       return 1;
     }
     snprintf(target, sizeof(target), "%s/%s", dst_host, basename_of(src_host_path));
-    return copy_path_recursive(src_host_path, target);
+    return copy_path_filtered(src_host_path, target, filter);
   }
 
-  return copy_path_recursive(src_host_path, dst_host);
+  return copy_path_filtered(src_host_path, dst_host, filter);
 }
 
 static int mount_overlay(const char *lower_chain, const char *upper, const char *work,
@@ -374,33 +285,11 @@ static int mount_overlay(const char *lower_chain, const char *upper, const char
   return mount("overlay", merged, "overlay", 0, mount_opts);
 }
 
-static int create_layer_dirs(const char *layer_id, const char *lower_chain,
-                             char *layer_root, size_t layer_root_size,
-                             char *diff_dir, size_t diff_dir_size,
-                             char *work_dir, size_t work_dir_size) {
+static int write_lower_file(const char *layer_root, const char *lower_chain) {
   char lower_path[PATH_MAX];
-  char link_path[PATH_MAX];
-  char short_id[64];
-  char symlink_path[PATH_MAX];
-  char symlink_target[PATH_MAX];
-  size_t i;
-  size_t w = 0;
   FILE *fp;
 
-  snprintf(layer_root, layer_root_size, "%s/%s", ZOCKER_LAYERS_DIR, layer_id);
-  snprintf(diff_dir, diff_dir_size, "%s/diff", layer_root);
-  snprintf(work_dir, work_dir_size, "%s/work", layer_root);
   snprintf(lower_path, sizeof(lower_path), "%s/lower", layer_root);
-  snprintf(link_path, sizeof(link_path), "%s/link", layer_root);
-
-  if (mkdir(layer_root, 0755) != 0) {
-    return 1;
-  }
-
-  if (mkdir(diff_dir, 0755) != 0 || mkdir(work_dir, 0755) != 0) {
-    return 1;
-  }
-
   fp = fopen(lower_path, "w");
   if (fp == NULL) {
     return 1;
@@ -408,30 +297,26 @@ static int create_layer_dirs(const char *layer_id, const char *lower_chain,
   fprintf(fp, "%s\n", lower_chain);
   fclose(fp);
 
-  for (i = 0; layer_id[i] != '\0' && w + 1 < sizeof(short_id); i++) {
-    if (layer_id[i] != '-') {
-      short_id[w++] = layer_id[i];
-      if (w >= 26) break;
-    }
-  }
-  short_id[w] = '\0';
+  return 0;
+}
 
-  fp = fopen(link_path, "w");
-  if (fp == NULL) {
+static int create_layer_dirs(const char *layer_id, const char *lower_chain,
+                             char *layer_root, size_t layer_root_size,
+                             char *diff_dir, size_t diff_dir_size,
+                             char *work_dir, size_t work_dir_size) {
+  snprintf(layer_root, layer_root_size, "%s/%s", ZOCKER_LAYERS_DIR, layer_id);
+  snprintf(diff_dir, diff_dir_size, "%s/diff", layer_root);
+  snprintf(work_dir, work_dir_size, "%s/work", layer_root);
+
+  if (mkdir(layer_root, 0755) != 0) {
     return 1;
   }
-  fprintf(fp, "%s\n", short_id);
-  fclose(fp);
 
-  snprintf(symlink_path, sizeof(symlink_path), "%s/%s", ZOCKER_LAYER_LINKS_DIR,
-           short_id);
-  snprintf(symlink_target, sizeof(symlink_target), "../%s/diff", layer_id);
-  unlink(symlink_path);
-  if (symlink(symlink_target, symlink_path) != 0) {
+  if (mkdir(diff_dir, 0755) != 0 || mkdir(work_dir, 0755) != 0) {
     return 1;
   }
 
-  return 0;
+  return write_lower_file(layer_root, lower_chain);
 }
 
 static int with_stage_snapshot(const struct stage_ctx *stage, char *merged_out,
@@ -490,20 +375,87 @@ static int apply_workdir_layer(const char *merged, void *ctx_ptr) {
 struct copy_apply_ctx {
   int from_stage;
   const struct stage_ctx *source_stage;
-  char source[PATH_MAX];
+  const struct zsource *sources;
+  int source_count;
   char destination[512];
   char workdir[512];
-  char context_dir[PATH_MAX];
+  const struct path_filter *filter;
 };
 
+static int cmp_str_ptr(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/*
+ * Copies COPY --from sources out of a mounted stage snapshot. Globs are
+ * expanded against the snapshot in strcmp order; the stage's state hash in
+ * the step key already pins what they can match.
+ */
+static int copy_stage_sources(const struct copy_apply_ctx *ctx, const char *snapshot,
+                              const char *merged) {
+  int dest_is_dir = ctx->destination[strlen(ctx->destination) - 1] == '/';
+  int copied = 0;
+  int i;
+
+  if (ctx->source_count > 1 && !dest_is_dir) {
+    fprintf(stderr, "[ERR] COPY of multiple files needs a destination ending in '/'\n");
+    return 1;
+  }
+
+  for (i = 0; i < ctx->source_count; i++) {
+    char source_abs[512];
+    char host_source[PATH_MAX];
+    glob_t matches;
+    size_t m;
+    int rc = 0;
+
+    if (normalize_container_path("/", ctx->sources[i].path, source_abs,
+                                 sizeof(source_abs)) != 0) {
+      return 1;
+    }
+
+    snprintf(host_source, sizeof(host_source), "%s%s", snapshot, source_abs);
+    if (strpbrk(ctx->sources[i].path, "*?[") == NULL) {
+      copied++;
+      if (copy_into_rootfs(merged, host_source, ctx->destination, ctx->workdir, NULL) != 0) {
+        return 1;
+      }
+      continue;
+    }
+
+    if (glob(host_source, GLOB_NOSORT, NULL, &matches) != 0 || matches.gl_pathc == 0) {
+      fprintf(stderr, "[ERR] COPY --from pattern matched no files: %s\n",
+              ctx->sources[i].path);
+      return 1;
+    }
+
+    qsort(matches.gl_pathv, matches.gl_pathc, sizeof(char *), cmp_str_ptr);
+    for (m = 0; m < matches.gl_pathc && rc == 0; m++) {
+      if (copied++ > 0 && !dest_is_dir) {
+        fprintf(stderr, "[ERR] COPY of multiple files needs a destination ending in '/'\n");
+        rc = 1;
+        break;
+      }
+      rc = copy_into_rootfs(merged, matches.gl_pathv[m], ctx->destination, ctx->workdir,
+                            NULL);
+    }
+    globfree(&matches);
+
+    if (rc != 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 static int apply_copy_layer(const char *merged, void *ctx_ptr) {
   struct copy_apply_ctx *ctx = (struct copy_apply_ctx *)ctx_ptr;
+  int i;
 
   if (ctx->from_stage) {
     char snapshot_merged[PATH_MAX];
     char snapshot_tmp[PATH_MAX];
-    char source_abs[512];
-    char host_source[PATH_MAX];
     int rc;
 
     if (with_stage_snapshot(ctx->source_stage, snapshot_merged, sizeof(snapshot_merged),
@@ -511,145 +463,219 @@ static int apply_copy_layer(const char *merged, void *ctx_ptr) {
       return 1;
     }
 
-    if (normalize_container_path("/", ctx->source, source_abs, sizeof(source_abs)) != 0) {
-      umount(snapshot_merged);
-      remove_recursive(snapshot_tmp);
-      return 1;
-    }
-
-    snprintf(host_source, sizeof(host_source), "%s%s", snapshot_merged, source_abs);
-    rc = copy_into_rootfs(merged, host_source, ctx->destination, ctx->workdir);
+    rc = copy_stage_sources(ctx, snapshot_merged, merged);
     umount(snapshot_merged);
     remove_recursive(snapshot_tmp);
     return rc;
   }
 
-  {
-    char src_host[PATH_MAX];
-
-    if (ctx->source[0] == '/') {
-      snprintf(src_host, sizeof(src_host), "%s", ctx->source);
-    } else {
-      snprintf(src_host, sizeof(src_host), "%s/%s", ctx->context_dir, ctx->source);
+  for (i = 0; i < ctx->source_count; i++) {
+    if (copy_into_rootfs(merged, ctx->sources[i].host, ctx->destination, ctx->workdir,
+                         ctx->filter) != 0) {
+      return 1;
     }
-
-    return copy_into_rootfs(merged, src_host, ctx->destination, ctx->workdir);
   }
+
+  return 0;
 }
 
 struct add_apply_ctx {
-  char source[PATH_MAX];
+  char source_host[PATH_MAX];
+  const struct zsource *sources;
+  int source_count;
   char destination[512];
   char workdir[512];
-  char context_dir[PATH_MAX];
-  int is_url;
+  const struct path_filter *filter;
 };
 
-static int download_url_to_file(const char *url, const char *dest) {
-  pid_t pid;
-  int status;
-
-  pid = fork();
-  if (pid < 0) {
-    return 1;
-  }
-
-  if (pid == 0) {
-    execlp("curl", "curl", "-fsSL", url, "-o", dest, NULL);
-    _exit(127);
-  }
+static int add_one_source(const char *merged, const struct add_apply_ctx *ctx,
+                          const char *host, enum archive_kind archive) {
+  char dst_abs[PATH_MAX];
 
-  if (waitpid(pid, &status, 0) < 0) {
-    return 1;
+  if (archive == ARCHIVE_NONE) {
+    return copy_into_rootfs(merged, host, ctx->destination, ctx->workdir, ctx->filter);
   }
 
-  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+  if (normalize_container_path(ctx->workdir, ctx->destination, dst_abs, sizeof(dst_abs)) !=
+      0) {
     return 1;
   }
 
-  return 0;
+  return archive_extract(host, archive, merged, dst_abs);
 }
 
+/*
+ * URL sources are copied from their download cache entry. Local tarballs are
+ * unpacked straight into the destination directory instead of being copied;
+ * every match of a glob source is added the same way.
+ */
 static int apply_add_layer(const char *merged, void *ctx_ptr) {
   struct add_apply_ctx *ctx = (struct add_apply_ctx *)ctx_ptr;
+  int i;
 
-  if (ctx->is_url) {
-    char tmp_dir[PATH_MAX];
-    char tmp_file[PATH_MAX];
-    int rc;
+  if (ctx->sources == NULL) {
+    return add_one_source(merged, ctx, ctx->source_host, ARCHIVE_NONE);
+  }
 
-    if (make_temp_dir("add", tmp_dir, sizeof(tmp_dir)) != 0) {
+  for (i = 0; i < ctx->source_count; i++) {
+    if (add_one_source(merged, ctx, ctx->sources[i].host,
+                       archive_detect(ctx->sources[i].host)) != 0) {
       return 1;
     }
+  }
+
+  return 0;
+}
+
+static int apply_noop_layer(const char *merged, void *ctx_ptr) {
+  (void)merged;
+  (void)ctx_ptr;
+  return 0;
+}
+
+/* Moves the stage onto a cached layer, preferring its content-derived state. */
+static int adopt_cached_layer(struct stage_ctx *stage, const char *cache_key,
+                              const char *cached_layer_id) {
+  struct layer_meta cached;
+  char next_state[17];
 
-    snprintf(tmp_file, sizeof(tmp_file), "%s/download.bin", tmp_dir);
-    if (download_url_to_file(ctx->source, tmp_file) != 0) {
-      remove_recursive(tmp_dir);
+  if (read_layer_metadata(cached_layer_id, &cached) == 0 && cached.diff_hash[0] != '\0') {
+    if (compute_content_state(stage->state_hash, cached.diff_hash, next_state) != 0) {
       return 1;
     }
+  } else {
+    snprintf(next_state, sizeof(next_state), "%s", cache_key);
+  }
 
-    rc = copy_into_rootfs(merged, tmp_file, ctx->destination, ctx->workdir);
-    remove_recursive(tmp_dir);
-    return rc;
+  snprintf(stage->top_layer, sizeof(stage->top_layer), "%s", cached_layer_id);
+  snprintf(stage->state_hash, sizeof(stage->state_hash), "%s", next_state);
+  return 0;
+}
+
+static void format_duration(long ms, char *out, size_t out_size) {
+  if (ms < 0) {
+    snprintf(out, out_size, "?");
+  } else if (ms < 1000) {
+    snprintf(out, out_size, "%ldms", ms);
+  } else {
+    snprintf(out, out_size, "%ld.%lds", ms / 1000, (ms % 1000) / 100);
   }
+}
 
-  {
-    char src_host[PATH_MAX];
+/*
+ * Plan mode counterpart of create_layer. Keys go through the same
+ * compute_state_hash/lookup_layer_cache path as a real build. Once a step
+ * misses, the stage's next state depends on a diff that does not exist yet, so
+ * every later step of the stage is predicted to rebuild.
+ */
+static int plan_layer(struct build_session *session, struct stage_ctx *stage,
+                      const char *descriptor, const char *instruction_text) {
+  char new_hash[17];
+  char step_key[17];
+  char cached_layer_id[64];
+  char estimate[32];
+  long duration_ms = -1;
 
-    if (ctx->source[0] == '/') {
-      snprintf(src_host, sizeof(src_host), "%s", ctx->source);
-    } else {
-      snprintf(src_host, sizeof(src_host), "%s/%s", ctx->context_dir, ctx->source);
+  session->plan.steps++;
+
+  if (!stage->plan_unknown) {
+    if (compute_state_hash(stage->state_hash, descriptor, new_hash) != 0) {
+      return 1;
+    }
+
+    if (lookup_layer_cache(new_hash, cached_layer_id, sizeof(cached_layer_id)) == 0) {
+      if (adopt_cached_layer(stage, new_hash, cached_layer_id) != 0) {
+        return 1;
+      }
+      session->plan.cached++;
+      printf("%-5d %-8s %-8s %s\n", session->plan.steps, "CACHED", "-", instruction_text);
+      return 0;
     }
+  }
 
-    return copy_into_rootfs(merged, src_host, ctx->destination, ctx->workdir);
+  if (hash_string(descriptor, step_key) != 0) {
+    return 1;
   }
-}
 
-static int apply_noop_layer(const char *merged, void *ctx_ptr) {
-  (void)merged;
-  (void)ctx_ptr;
+  if (lookup_step_duration(step_key, &duration_ms) == 0) {
+    session->plan.estimate_ms += duration_ms;
+  } else {
+    duration_ms = -1;
+    session->plan.unestimated++;
+  }
+
+  format_duration(duration_ms, estimate, sizeof(estimate));
+  printf("%-5d %-8s %-8s %s%s\n", session->plan.steps, "REBUILD", estimate,
+         instruction_text, stage->plan_unknown ? " (after upstream rebuild)" : "");
+
+  session->plan.rebuild++;
+  stage->plan_unknown = 1;
   return 0;
 }
 
-static int create_layer(struct stage_ctx *stage, const char *descriptor,
+/*
+ * Pooling swaps files for hardlinks, so it runs on the staged diff before the
+ * layer is published; once published, the diff may already be a lowerdir of
+ * the next step's overlay.
+ */
+static void pool_staged_diff(const struct build_session *session, const char *diff_dir) {
+  if (session->blob_pool && pool_layer_files(diff_dir) != 0) {
+    fprintf(stderr, "[WARN] Failed to pool some files of %s\n", diff_dir);
+  }
+}
+
+static int create_layer(struct build_session *session, struct stage_ctx *stage,
+                        const char *descriptor,
                         const char *instruction_text,
                         int (*apply_fn)(const char *, void *), void *apply_ctx) {
   char new_hash[17];
+  char diff_hash[17];
+  char diff_digest[65];
+  char next_state[17];
   char cached_layer_id[64];
   char parent_chain[8192];
   char old_top[64];
+  char staging_id[64];
   char layer_id[64];
   char layer_root[PATH_MAX];
   char diff_dir[PATH_MAX];
   char work_dir[PATH_MAX];
   char tmp_dir[PATH_MAX];
   char merged[PATH_MAX];
-  struct layer_meta meta;
+  struct commit_job job;
+  long started_ms;
+  int collapsed = 0;
   int rc = 0;
 
+  if (session->plan_only) {
+    return plan_layer(session, stage, descriptor, instruction_text);
+  }
+
   if (compute_state_hash(stage->state_hash, descriptor, new_hash) != 0) {
     return 1;
   }
 
   if (lookup_layer_cache(new_hash, cached_layer_id, sizeof(cached_layer_id)) == 0) {
-    snprintf(stage->top_layer, sizeof(stage->top_layer), "%s", cached_layer_id);
-    snprintf(stage->state_hash, sizeof(stage->state_hash), "%s", new_hash);
+    if (adopt_cached_layer(stage, new_hash, cached_layer_id) != 0) {
+      return 1;
+    }
     printf("[CACHE HIT] %s\n", instruction_text);
     return 0;
   }
 
+  started_ms = monotonic_ms();
+
   snprintf(old_top, sizeof(old_top), "%s", stage->top_layer);
 
   if (resolve_stage_chain(stage, parent_chain, sizeof(parent_chain)) != 0) {
     return 1;
   }
 
-  if (generate_uuid(layer_id) != 0) {
+  if (generate_uuid(staging_id) != 0) {
     return 1;
   }
 
-  if (create_layer_dirs(layer_id, parent_chain, layer_root, sizeof(layer_root), diff_dir,
+  if (create_layer_dirs(staging_id, parent_chain, layer_root, sizeof(layer_root), diff_dir,
                         sizeof(diff_dir), work_dir, sizeof(work_dir)) != 0) {
     fprintf(stderr, "[ERR] Failed to create layer layout\n");
     remove_recursive(layer_root);
@@ -682,653 +708,618 @@ static int create_layer(struct stage_ctx *stage, const char *descriptor,
     fprintf(stderr, "[WARN] Failed to unmount merged path %s: %s\n", merged,
             strerror(errno));
   }
-  remove_recursive(tmp_dir);
 
   if (rc != 0) {
+    remove_recursive(tmp_dir);
     remove_recursive(layer_root);
     return 1;
   }
 
-  memset(&meta, 0, sizeof(meta));
-  snprintf(meta.id, sizeof(meta.id), "%s", layer_id);
-  if (old_top[0] == '\0') {
-    snprintf(meta.parent, sizeof(meta.parent), "-");
-  } else {
-    snprintf(meta.parent, sizeof(meta.parent), "%s", old_top);
+  if (digest_path_recursive(diff_dir, diff_hash, diff_digest) != 0) {
+    fprintf(stderr, "[ERR] Failed to hash layer diff: %s\n", diff_dir);
+    remove_recursive(tmp_dir);
+    remove_recursive(layer_root);
+    return 1;
   }
-  snprintf(meta.hash, sizeof(meta.hash), "%s", new_hash);
-  meta.created_at = (long)time(NULL);
-  meta.size = dir_size_bytes(diff_dir);
-  snprintf(meta.instruction, sizeof(meta.instruction), "%s", instruction_text);
-  snprintf(meta.workdir, sizeof(meta.workdir), "%s", stage->workdir);
 
-  if (write_layer_metadata(&meta) != 0) {
+  if (compute_content_state(stage->state_hash, diff_hash, next_state) != 0 ||
+      compute_layer_digest(parent_chain, diff_digest, layer_id) != 0) {
+    remove_recursive(tmp_dir);
     remove_recursive(layer_root);
     return 1;
   }
 
-  if (register_layer_cache(new_hash, layer_id) != 0) {
+  pool_staged_diff(session, diff_dir);
+  if (commit_layer_dir(layer_root, layer_id, &collapsed) != 0) {
+    remove_recursive(tmp_dir);
     remove_recursive(layer_root);
     return 1;
   }
 
+  memset(&job, 0, sizeof(job));
+  job.meta.duration_ms = monotonic_ms() - started_ms;
+  if (hash_string(descriptor, job.step_key) != 0) {
+    job.step_key[0] = '\0';
+  }
+  snprintf(job.cache_key, sizeof(job.cache_key), "%s", new_hash);
+  snprintf(job.tmp_dir, sizeof(job.tmp_dir), "%s", tmp_dir);
+  snprintf(job.diff_dir, sizeof(job.diff_dir), "%s/%s/diff", ZOCKER_LAYERS_DIR, layer_id);
+  snprintf(job.meta.id, sizeof(job.meta.id), "%s", layer_id);
+
+  if (!collapsed) {
+    job.write_meta = 1;
+    if (old_top[0] == '\0') {
+      snprintf(job.meta.parent, sizeof(job.meta.parent), "-");
+    } else {
+      snprintf(job.meta.parent, sizeof(job.meta.parent), "%s", old_top);
+    }
+    snprintf(job.meta.hash, sizeof(job.meta.hash), "%s", new_hash);
+    snprintf(job.meta.diff_hash, sizeof(job.meta.diff_hash), "%s", diff_hash);
+    snprintf(job.meta.diff_digest, sizeof(job.meta.diff_digest), "%s", diff_digest);
+    job.meta.created_at = (long)time(NULL);
+    snprintf(job.meta.instruction, sizeof(job.meta.instruction), "%s", instruction_text);
+    snprintf(job.meta.workdir, sizeof(job.meta.workdir), "%s", stage->workdir);
+  }
+
+  if (commit_queue_push(session->commits, &job) != 0) {
+    return 1;
+  }
+
   snprintf(stage->top_layer, sizeof(stage->top_layer), "%s", layer_id);
-  snprintf(stage->state_hash, sizeof(stage->state_hash), "%s", new_hash);
+  snprintf(stage->state_hash, sizeof(stage->state_hash), "%s", next_state);
+
+  if (collapsed) {
+    printf("[BUILT] %s (matches existing layer %s)\n", instruction_text, layer_id);
+    return 0;
+  }
 
   printf("[BUILT] %s\n", instruction_text);
   return 0;
 }
 
-static int parse_two_tokens(const char *input, char *first, size_t first_size,
-                            char *second, size_t second_size) {
-  char tmp[2048];
-  char *saveptr = NULL;
-  char *t1;
-  char *t2;
-
-  snprintf(tmp, sizeof(tmp), "%s", input);
-  t1 = strtok_r(tmp, " \t", &saveptr);
-  t2 = strtok_r(NULL, " \t", &saveptr);
+/* Finds a committed standalone COPY --link layer by its parent-free key. */
+static int find_linked_layer(const char *link_key, char *layer_id, size_t layer_id_size,
+                             char diff_hash[17], char diff_digest[65]) {
+  struct layer_meta meta;
 
-  if (t1 == NULL || t2 == NULL) {
+  if (lookup_layer_cache(link_key, layer_id, layer_id_size) != 0 ||
+      read_layer_metadata(layer_id, &meta) != 0 || strlen(meta.diff_hash) != 16 ||
+      strlen(meta.diff_digest) != 64) {
     return 1;
   }
 
-  snprintf(first, first_size, "%s", t1);
-  snprintf(second, second_size, "%s", t2);
+  snprintf(diff_hash, 17, "%.16s", meta.diff_hash);
+  snprintf(diff_digest, 65, "%.64s", meta.diff_digest);
   return 0;
 }
 
-static int parse_copy_tokens(const char *input, char *from_stage, size_t from_stage_size,
-                             char *src, size_t src_size, char *dst, size_t dst_size) {
-  char tmp[2048];
-  char *saveptr = NULL;
-  char *tok;
+/*
+ * Builds the standalone half of a COPY --link. The sources are copied straight
+ * into a fresh diff with an empty lower chain, without an overlay mount, so
+ * nothing below the step can influence its bytes or its id. As with Docker,
+ * the destination is treated as not existing: name a directory with a
+ * trailing '/'.
+ */
+static int build_linked_diff(struct build_session *session, const char *link_key,
+                             const char *instruction_text, struct copy_apply_ctx *copy_ctx,
+                             char *layer_id, char diff_hash[17], char diff_digest[65]) {
+  char staging_id[64];
+  char layer_root[PATH_MAX];
+  char diff_dir[PATH_MAX];
+  char work_dir[PATH_MAX];
+  struct commit_job job;
+  long started_ms = monotonic_ms();
+  int collapsed = 0;
 
-  from_stage[0] = '\0';
-  snprintf(tmp, sizeof(tmp), "%s", input);
+  if (generate_uuid(staging_id) != 0) {
+    return 1;
+  }
 
-  tok = strtok_r(tmp, " \t", &saveptr);
-  if (tok == NULL) {
+  if (create_layer_dirs(staging_id, "", layer_root, sizeof(layer_root), diff_dir,
+                        sizeof(diff_dir), work_dir, sizeof(work_dir)) != 0) {
+    fprintf(stderr, "[ERR] Failed to create layer layout\n");
+    remove_recursive(layer_root);
     return 1;
   }
 
-  if (starts_with(tok, "--from=")) {
-    snprintf(from_stage, from_stage_size, "%s", tok + 7);
-    tok = strtok_r(NULL, " \t", &saveptr);
-    if (tok == NULL) return 1;
+  if (apply_copy_layer(diff_dir, copy_ctx) != 0 ||
+      digest_path_recursive(diff_dir, diff_hash, diff_digest) != 0 ||
+      compute_layer_digest("", diff_digest, layer_id) != 0) {
+    remove_recursive(layer_root);
+    return 1;
   }
 
-  snprintf(src, src_size, "%s", tok);
-  tok = strtok_r(NULL, " \t", &saveptr);
-  if (tok == NULL) {
+  pool_staged_diff(session, diff_dir);
+  if (commit_layer_dir(layer_root, layer_id, &collapsed) != 0) {
+    remove_recursive(layer_root);
     return 1;
   }
 
-  snprintf(dst, dst_size, "%s", tok);
-  return 0;
-}
+  memset(&job, 0, sizeof(job));
+  snprintf(job.cache_key, sizeof(job.cache_key), "%s", link_key);
+  snprintf(job.diff_dir, sizeof(job.diff_dir), "%s/%s/diff", ZOCKER_LAYERS_DIR, layer_id);
+  snprintf(job.meta.id, sizeof(job.meta.id), "%s", layer_id);
 
-static int parse_base_and_alias(const char *input, char *base, size_t base_size,
-                                char *alias, size_t alias_size) {
-  char tmp[2048];
-  char *saveptr = NULL;
-  char *t1;
-  char *t2;
-  char *t3;
+  if (!collapsed) {
+    job.write_meta = 1;
+    snprintf(job.meta.parent, sizeof(job.meta.parent), "-");
+    snprintf(job.meta.hash, sizeof(job.meta.hash), "%s", link_key);
+    snprintf(job.meta.diff_hash, sizeof(job.meta.diff_hash), "%s", diff_hash);
+    snprintf(job.meta.diff_digest, sizeof(job.meta.diff_digest), "%s", diff_digest);
+    job.meta.created_at = (long)time(NULL);
+    job.meta.duration_ms = monotonic_ms() - started_ms;
+    snprintf(job.meta.instruction, sizeof(job.meta.instruction), "%s", instruction_text);
+    snprintf(job.meta.workdir, sizeof(job.meta.workdir), "%s", copy_ctx->workdir);
+  }
 
-  alias[0] = '\0';
-  snprintf(tmp, sizeof(tmp), "%s", input);
-  t1 = strtok_r(tmp, " \t", &saveptr);
+  return commit_queue_push(session->commits, &job);
+}
 
-  if (t1 == NULL) {
+/* Splices a standalone linked layer onto the stage as a new record. */
+static int splice_linked_layer(struct build_session *session, struct stage_ctx *stage,
+                               const char *key, const char *linked_id,
+                               const char *diff_hash, const char *diff_digest,
+                               const char *instruction_text) {
+  char parent_chain[8192];
+  char layer_id[LAYER_DIGEST_HEX + 1];
+  char next_state[17];
+  struct commit_job job;
+  int collapsed = 0;
+
+  if (resolve_stage_chain(stage, parent_chain, sizeof(parent_chain)) != 0 ||
+      compute_content_state(stage->state_hash, diff_hash, next_state) != 0 ||
+      create_splice_layer(parent_chain, linked_id, diff_digest, layer_id, &collapsed) != 0) {
     return 1;
   }
 
-  snprintf(base, base_size, "%s", t1);
+  memset(&job, 0, sizeof(job));
+  snprintf(job.cache_key, sizeof(job.cache_key), "%s", key);
+  snprintf(job.diff_dir, sizeof(job.diff_dir), "%s/%s/diff", ZOCKER_LAYERS_DIR, linked_id);
+  snprintf(job.meta.id, sizeof(job.meta.id), "%s", layer_id);
 
-  t2 = strtok_r(NULL, " \t", &saveptr);
-  t3 = strtok_r(NULL, " \t", &saveptr);
+  if (!collapsed) {
+    job.write_meta = 1;
+    if (stage->top_layer[0] == '\0') {
+      snprintf(job.meta.parent, sizeof(job.meta.parent), "-");
+    } else {
+      snprintf(job.meta.parent, sizeof(job.meta.parent), "%s", stage->top_layer);
+    }
+    snprintf(job.meta.hash, sizeof(job.meta.hash), "%s", key);
+    snprintf(job.meta.diff_hash, sizeof(job.meta.diff_hash), "%s", diff_hash);
+    snprintf(job.meta.diff_digest, sizeof(job.meta.diff_digest), "%s", diff_digest);
+    snprintf(job.meta.diff_layer, sizeof(job.meta.diff_layer), "%s", linked_id);
+    job.meta.created_at = (long)time(NULL);
+    snprintf(job.meta.instruction, sizeof(job.meta.instruction), "%s", instruction_text);
+    snprintf(job.meta.workdir, sizeof(job.meta.workdir), "%s", stage->workdir);
+  }
 
-  if (t2 != NULL && t3 != NULL && strcasecmp(t2, "AS") == 0) {
-    snprintf(alias, alias_size, "%s", t3);
+  if (commit_queue_push(session->commits, &job) != 0) {
+    return 1;
   }
 
+  snprintf(stage->top_layer, sizeof(stage->top_layer), "%s", layer_id);
+  snprintf(stage->state_hash, sizeof(stage->state_hash), "%s", next_state);
   return 0;
 }
 
-static int stage_index_by_name(struct stage_ctx stages[MAX_STAGES], int stage_count,
-                               const char *name_or_index) {
-  int i;
-
-  if (name_or_index == NULL || name_or_index[0] == '\0') {
-    return -1;
+/*
+ * COPY --link. The step's usual key (parent state + descriptor) still finds
+ * the spliced record for this parent; a second key without the parent finds
+ * the standalone layer, so after a base change only the splice is redone.
+ */
+static int create_linked_layer(struct build_session *session, struct stage_ctx *stage,
+                               const char *descriptor, const char *instruction_text,
+                               struct copy_apply_ctx *copy_ctx) {
+  char linked_descriptor[8300];
+  char key[17];
+  char link_key[17];
+  char cached_layer_id[64];
+  char linked_id[64];
+  char diff_hash[17];
+  char diff_digest[65];
+  int reused;
+
+  snprintf(linked_descriptor, sizeof(linked_descriptor), "LINK|%s", descriptor);
+  if (compute_state_hash(stage->state_hash, linked_descriptor, key) != 0 ||
+      compute_state_hash("-", linked_descriptor, link_key) != 0) {
+    return 1;
   }
 
-  {
-    int all_digits = 1;
-    for (i = 0; name_or_index[i] != '\0'; i++) {
-      if (!isdigit((unsigned char)name_or_index[i])) {
-        all_digits = 0;
-        break;
-      }
+  if (session->plan_only) {
+    if (stage->plan_unknown || lookup_layer_cache(key, cached_layer_id,
+                                                  sizeof(cached_layer_id)) == 0 ||
+        find_linked_layer(link_key, linked_id, sizeof(linked_id), diff_hash, diff_digest) != 0) {
+      return plan_layer(session, stage, linked_descriptor, instruction_text);
     }
 
-    if (all_digits) {
-      int idx = atoi(name_or_index);
-      if (idx >= 0 && idx < stage_count) {
-        return idx;
-      }
-    }
+    session->plan.steps++;
+    session->plan.cached++;
+    printf("%-5d %-8s %-8s %s\n", session->plan.steps, "SPLICE", "-", instruction_text);
+    return compute_content_state(stage->state_hash, diff_hash, stage->state_hash);
   }
 
-  for (i = 0; i < stage_count; i++) {
-    if (strcmp(stages[i].name, name_or_index) == 0) {
-      return i;
+  if (lookup_layer_cache(key, cached_layer_id, sizeof(cached_layer_id)) == 0) {
+    if (adopt_cached_layer(stage, key, cached_layer_id) != 0) {
+      return 1;
     }
+    printf("[CACHE HIT] %s\n", instruction_text);
+    return 0;
   }
 
-  return -1;
-}
-
-static int parse_arg_kv(const char *raw, char *key, size_t key_size, char *value,
-                        size_t value_size, int *has_default) {
-  const char *eq;
-  size_t key_len;
-
-  if (raw == NULL || key == NULL || value == NULL || has_default == NULL) {
+  reused = find_linked_layer(link_key, linked_id, sizeof(linked_id), diff_hash, diff_digest) == 0;
+  if (!reused && build_linked_diff(session, link_key, instruction_text, copy_ctx, linked_id,
+                                   diff_hash, diff_digest) != 0) {
     return 1;
   }
 
-  eq = strchr(raw, '=');
-  if (eq == NULL) {
-    snprintf(key, key_size, "%s", raw);
-    value[0] = '\0';
-    *has_default = 0;
-    return 0;
-  }
-
-  key_len = (size_t)(eq - raw);
-  if (key_len == 0 || key_len >= key_size) {
+  if (splice_linked_layer(session, stage, key, linked_id, diff_hash, diff_digest,
+                          instruction_text) != 0) {
     return 1;
   }
 
-  memcpy(key, raw, key_len);
-  key[key_len] = '\0';
-  snprintf(value, value_size, "%s", eq + 1);
-  *has_default = 1;
+  if (reused) {
+    printf("[SPLICED] %s (linked layer %s)\n", instruction_text, linked_id);
+  } else {
+    printf("[BUILT] %s\n", instruction_text);
+  }
   return 0;
 }
 
-static int ensure_final_stage_has_layer(struct stage_ctx *stage) {
+static int ensure_final_stage_has_layer(struct build_session *session,
+                                        struct stage_ctx *stage) {
   if (stage->top_layer[0] != '\0') {
     return 0;
   }
-  return create_layer(stage, "NOOP|final-stage", "NOOP", apply_noop_layer, NULL);
+  return create_layer(session, stage, "NOOP|final-stage", "NOOP", apply_noop_layer, NULL);
 }
 
-static int get_context_dir(const char *zockerfile_path, char *out, size_t out_size) {
-  char tmp[PATH_MAX];
-  char *slash;
+static void prefetch_context_sources(const struct zockerfile *zf,
+                                     struct prefetch_pool *pool,
+                                     const struct path_filter *ignore) {
+  int i;
 
-  snprintf(tmp, sizeof(tmp), "%s", zockerfile_path);
-  slash = strrchr(tmp, '/');
-  if (slash == NULL) {
-    return snprintf(out, out_size, ".") < 0 ? 1 : 0;
-  }
+  for (i = 0; i < zf->count; i++) {
+    const struct zinstr *in = &zf->instrs[i];
+    int j;
 
-  if (slash == tmp) {
-    return snprintf(out, out_size, "/") < 0 ? 1 : 0;
-  }
+    if ((in->kind != ZI_COPY && in->kind != ZI_ADD) || !zf->stages[in->stage].needed) {
+      continue;
+    }
 
-  *slash = '\0';
-  return snprintf(out, out_size, "%s", tmp) < 0 ? 1 : 0;
+    for (j = 0; j < in->source_count; j++) {
+      if (in->sources[j].host[0] != '\0') {
+        prefetch_hash_path(pool, in->sources[j].host, ignore);
+      }
+    }
+  }
 }
 
-int build_image_from_config(const struct config *cfg) {
-  FILE *fp;
-  char line[4096];
-  int line_no = 0;
-  char context_dir[PATH_MAX];
-  struct stage_ctx stages[MAX_STAGES];
-  int stage_count = 0;
-  int current_stage = -1;
-  struct arg_map cli_args;
-  struct arg_map global_args;
-
-  memset(stages, 0, sizeof(stages));
-  memset(&global_args, 0, sizeof(global_args));
+/*
+ * Queues every ADD <url> of the needed stages. With forget set, results of an
+ * earlier build are dropped first so each URL is revalidated again.
+ */
+static void prefetch_url_sources(const struct zockerfile *zf, struct prefetch_pool *pool,
+                                 int forget) {
+  int i;
 
-  if (init_cli_args_map(cfg, &cli_args) != 0) {
-    return 1;
+  if (pool == NULL) {
+    return;
   }
-  arg_map_copy(&global_args, &cli_args);
 
-  if (get_context_dir(cfg->zockerfile, context_dir, sizeof(context_dir)) != 0) {
-    return 1;
-  }
+  for (i = 0; i < zf->count; i++) {
+    const struct zinstr *in = &zf->instrs[i];
 
-  fp = fopen(cfg->zockerfile, "r");
-  if (fp == NULL) {
-    fprintf(stderr, "[ERR] Failed to open Zockerfile: %s\n", cfg->zockerfile);
-    return 1;
+    if (in->kind != ZI_ADD || !in->is_url || !zf->stages[in->stage].needed) {
+      continue;
+    }
+
+    if (forget) {
+      prefetch_invalidate(pool, in->source);
+    }
+    prefetch_download(pool, in->source, in->checksum);
   }
+}
 
-  while (fgets(line, sizeof(line), fp) != NULL) {
-    char original[4096];
-    char *trimmed;
-    char cmd[32];
-    char *rest;
-    int i;
+/*
+ * Hashes the build context sources of a COPY/ADD. A single source keeps its
+ * own hash; several are folded, with their paths, into one combined hash.
+ */
+static int hash_instr_sources(const struct build_session *session, const struct zinstr *in,
+                              const char *cmd, char out_hex[17]) {
+  uint64_t combined = fnv1a_init();
+  int i;
 
-    line_no++;
-    snprintf(original, sizeof(original), "%s", line);
+  for (i = 0; i < in->source_count; i++) {
+    const char *host = in->sources[i].host;
+    char src_hash[17];
 
-    trimmed = trim_whitespace(line);
-    if (trimmed[0] == '\0' || trimmed[0] == '#') {
-      continue;
+    if (prefetch_wait_hash(session->prefetch, host, session->ignore, src_hash) != 0) {
+      fprintf(stderr, "[ERR] %s source not found/unreadable at line %d: %s\n", cmd,
+              in->line_no, host);
+      return 1;
     }
 
-    for (i = 0; trimmed[i] != '\0' && !isspace((unsigned char)trimmed[i]) &&
-                i < (int)sizeof(cmd) - 1;
-         i++) {
-      cmd[i] = (char)toupper((unsigned char)trimmed[i]);
+    if (in->source_count == 1) {
+      snprintf(out_hex, 17, "%s", src_hash);
+      return 0;
     }
-    cmd[i] = '\0';
-
-    rest = trimmed + i;
-    rest = trim_whitespace(rest);
-
-    if (strcmp(cmd, "ARG") == 0) {
-      char key[64];
-      char default_val[256];
-      char resolved_default[256];
-      int has_default = 0;
-      const char *cli_val;
-      const char *current_val;
-      const char *final_val;
-
-      if (parse_arg_kv(rest, key, sizeof(key), default_val, sizeof(default_val),
-                       &has_default) != 0) {
-        fprintf(stderr, "[ERR] Invalid ARG at line %d\n", line_no);
-        fclose(fp);
-        return 1;
-      }
 
-      if (has_default) {
-        if (current_stage >= 0) {
-          if (substitute_args(default_val, &stages[current_stage].args, resolved_default,
-                              sizeof(resolved_default)) != 0) {
-            fclose(fp);
-            return 1;
-          }
-        } else {
-          if (substitute_args(default_val, &global_args, resolved_default,
-                              sizeof(resolved_default)) != 0) {
-            fclose(fp);
-            return 1;
-          }
-        }
-      } else {
-        resolved_default[0] = '\0';
-      }
+    combined = fnv1a_update(combined, host, strlen(host) + 1);
+    combined = fnv1a_update(combined, src_hash, strlen(src_hash) + 1);
+  }
 
-      cli_val = arg_map_get(&cli_args, key);
-      if (cli_val != NULL) {
-        final_val = cli_val;
-      } else {
-        if (current_stage >= 0) {
-          current_val = arg_map_get(&stages[current_stage].args, key);
-        } else {
-          current_val = arg_map_get(&global_args, key);
-        }
+  fnv1a_hex(combined, out_hex);
+  return 0;
+}
 
-        if (has_default) {
-          final_val = resolved_default;
-        } else if (current_val != NULL) {
-          final_val = current_val;
-        } else {
-          final_val = "";
-        }
-      }
+/* Resolves every needed stage's base before any layer is mounted or built. */
+static int resolve_stage_bases(const struct zockerfile *zf, struct stage_ctx *stages) {
+  int s;
 
-      if (current_stage >= 0) {
-        if (arg_map_set(&stages[current_stage].args, key, final_val) != 0) {
-          fclose(fp);
-          return 1;
-        }
-      } else {
-        if (arg_map_set(&global_args, key, final_val) != 0) {
-          fclose(fp);
-          return 1;
-        }
-      }
+  for (s = 0; s < zf->stage_count; s++) {
+    const struct zstage *zs = &zf->stages[s];
+    struct stage_ctx *stage = &stages[s];
+    char seed[9000];
+
+    memset(stage, 0, sizeof(*stage));
+    snprintf(stage->name, sizeof(stage->name), "%s", zs->name);
+    snprintf(stage->workdir, sizeof(stage->workdir), "/");
 
+    if (!zs->needed) {
       continue;
     }
 
-    if (strcmp(cmd, "FROM") == 0 || strcmp(cmd, "BASEDIR") == 0) {
-      struct stage_ctx *stage;
-      char base_raw[1024];
-      char base_value[1024];
-      char alias[64];
-      char seed[9000];
+    snprintf(stage->base_layer, sizeof(stage->base_layer), "-");
+    if (zs->is_basedir) {
+      snprintf(stage->base_chain, sizeof(stage->base_chain), "%s", zs->base);
+    } else if (resolve_base_chain(zs->base, stage->base_chain, sizeof(stage->base_chain)) !=
+               0) {
+      fprintf(stderr, "[ERR] Failed to resolve FROM at line %d: %s\n", zs->line_no,
+              zs->base);
+      return 1;
+    } else {
+      struct image_meta base;
 
-      if (stage_count >= MAX_STAGES) {
-        fprintf(stderr, "[ERR] Too many stages\n");
-        fclose(fp);
-        return 1;
+      if (load_image_meta(zs->base, &base) == 0 && base.top_layer[0] != '\0') {
+        snprintf(stage->base_layer, sizeof(stage->base_layer), "%s", base.top_layer);
       }
+    }
 
-      if (parse_base_and_alias(rest, base_raw, sizeof(base_raw), alias,
-                               sizeof(alias)) != 0) {
-        fprintf(stderr, "[ERR] Invalid %s at line %d\n", cmd, line_no);
-        fclose(fp);
-        return 1;
-      }
+    snprintf(seed, sizeof(seed), "BASE|%s", stage->base_chain);
+    if (hash_string(seed, stage->state_hash) != 0) {
+      return 1;
+    }
+  }
 
-      if (substitute_args(base_raw, &global_args, base_value, sizeof(base_value)) != 0) {
-        fclose(fp);
-        return 1;
-      }
+  return 0;
+}
 
-      stage = &stages[stage_count];
-      memset(stage, 0, sizeof(*stage));
-      arg_map_copy(&stage->args, &global_args);
-      snprintf(stage->workdir, sizeof(stage->workdir), "/");
+static int execute_instr(struct build_session *session, struct stage_ctx *stages,
+                         const struct zinstr *in) {
+  struct stage_ctx *stage = &stages[in->stage];
 
-      if (alias[0] != '\0') {
-        snprintf(stage->name, sizeof(stage->name), "%s", alias);
-      } else {
-        snprintf(stage->name, sizeof(stage->name), "%d", stage_count);
-      }
+  switch (in->kind) {
+  case ZI_FROM:
+  case ZI_BASEDIR:
+    return 0;
 
-      if (strcmp(cmd, "FROM") == 0) {
-        if (resolve_base_chain(base_value, stage->base_chain, sizeof(stage->base_chain)) !=
-            0) {
-          fprintf(stderr, "[ERR] Failed to resolve FROM at line %d: %s\n", line_no,
-                  base_value);
-          fclose(fp);
-          return 1;
-        }
-      } else {
-        char resolved_base[PATH_MAX];
+  case ZI_CMD:
+    snprintf(stage->cmd, sizeof(stage->cmd), "%s", in->value);
+    return 0;
 
-        if (base_value[0] == '/') {
-          snprintf(resolved_base, sizeof(resolved_base), "%s", base_value);
-        } else {
-          snprintf(resolved_base, sizeof(resolved_base), "%s/%s", context_dir,
-                   base_value);
-        }
+  case ZI_RUN: {
+    struct run_apply_ctx run_ctx;
+    char descriptor[4096];
+    char instruction[1200];
 
-        if (!is_directory(resolved_base)) {
-          fprintf(stderr, "[ERR] BASEDIR path is not a directory (line %d): %s\n",
-                  line_no, resolved_base);
-          fclose(fp);
-          return 1;
-        }
+    snprintf(descriptor, sizeof(descriptor), "RUN|wd=%s|cmd=%s", stage->workdir, in->value);
+    snprintf(instruction, sizeof(instruction), "RUN %s", in->value);
+    snprintf(run_ctx.command, sizeof(run_ctx.command), "%s", in->value);
+    snprintf(run_ctx.workdir, sizeof(run_ctx.workdir), "%s", stage->workdir);
 
-        snprintf(stage->base_chain, sizeof(stage->base_chain), "%s", resolved_base);
-      }
+    return create_layer(session, stage, descriptor, instruction, apply_run_layer, &run_ctx);
+  }
 
-      snprintf(seed, sizeof(seed), "BASE|%s", stage->base_chain);
-      if (hash_string(seed, stage->state_hash) != 0) {
-        fclose(fp);
-        return 1;
-      }
+  case ZI_WORKDIR: {
+    struct workdir_apply_ctx wd_ctx;
+    char descriptor[2048];
+    char instruction[768];
 
-      current_stage = stage_count;
-      stage_count++;
-      continue;
-    }
+    snprintf(descriptor, sizeof(descriptor), "WORKDIR|path=%s", in->value);
+    snprintf(instruction, sizeof(instruction), "WORKDIR %s", in->value);
+    snprintf(wd_ctx.path, sizeof(wd_ctx.path), "%s", in->value);
 
-    if (current_stage < 0) {
-      fprintf(stderr, "[ERR] %s used before FROM/BASEDIR at line %d\n", cmd, line_no);
-      fclose(fp);
+    if (create_layer(session, stage, descriptor, instruction, apply_workdir_layer,
+                     &wd_ctx) != 0) {
       return 1;
     }
 
-    {
-      struct stage_ctx *stage = &stages[current_stage];
-
-      if (strcmp(cmd, "RUN") == 0) {
-        struct run_apply_ctx run_ctx;
-        char command[1024];
-        char descriptor[4096];
-        char instruction[1200];
-
-        if (substitute_args(rest, &stage->args, command, sizeof(command)) != 0) {
-          fclose(fp);
-          return 1;
-        }
-
-        snprintf(descriptor, sizeof(descriptor), "RUN|wd=%s|cmd=%s", stage->workdir,
-                 command);
-        snprintf(instruction, sizeof(instruction), "RUN %s", command);
+    snprintf(stage->workdir, sizeof(stage->workdir), "%s", in->value);
+    return 0;
+  }
 
-        snprintf(run_ctx.command, sizeof(run_ctx.command), "%s", command);
-        snprintf(run_ctx.workdir, sizeof(run_ctx.workdir), "%s", stage->workdir);
+  case ZI_COPY: {
+    struct copy_apply_ctx copy_ctx;
+    char descriptor[8192];
+    char instruction[2300];
 
-        if (create_layer(stage, descriptor, instruction, apply_run_layer, &run_ctx) != 0) {
-          fprintf(stderr, "[ERR] Failed at line %d: %s", line_no, original);
-          fclose(fp);
-          return 1;
-        }
+    memset(&copy_ctx, 0, sizeof(copy_ctx));
 
-        continue;
+    if (in->from_stage >= 0) {
+      if (stages[in->from_stage].plan_unknown) {
+        stage->plan_unknown = 1;
       }
 
-      if (strcmp(cmd, "WORKDIR") == 0) {
-        struct workdir_apply_ctx wd_ctx;
-        char path_arg[512];
-        char new_workdir[512];
-        char descriptor[2048];
-        char instruction[768];
+      copy_ctx.from_stage = 1;
+      copy_ctx.source_stage = &stages[in->from_stage];
 
-        if (substitute_args(rest, &stage->args, path_arg, sizeof(path_arg)) != 0) {
-          fclose(fp);
-          return 1;
-        }
-
-        if (normalize_container_path(stage->workdir, path_arg, new_workdir,
-                                     sizeof(new_workdir)) != 0) {
-          fclose(fp);
-          return 1;
-        }
-
-        snprintf(descriptor, sizeof(descriptor), "WORKDIR|path=%s", new_workdir);
-        snprintf(instruction, sizeof(instruction), "WORKDIR %s", new_workdir);
-        snprintf(wd_ctx.path, sizeof(wd_ctx.path), "%s", new_workdir);
-
-        if (create_layer(stage, descriptor, instruction, apply_workdir_layer, &wd_ctx) !=
-            0) {
-          fprintf(stderr, "[ERR] Failed at line %d: %s", line_no, original);
-          fclose(fp);
-          return 1;
-        }
+      snprintf(descriptor, sizeof(descriptor), "COPY|from=%s|src=%s|src_state=%s|dst=%s",
+               in->from_name, in->source, stages[in->from_stage].state_hash,
+               in->destination_abs);
+      snprintf(instruction, sizeof(instruction), "COPY %s--from=%s %s %s",
+               in->link ? "--link " : "", in->from_name, in->source, in->destination);
+    } else {
+      char src_hash[17];
 
-        snprintf(stage->workdir, sizeof(stage->workdir), "%s", new_workdir);
-        continue;
+      if (hash_instr_sources(session, in, "COPY", src_hash) != 0) {
+        return 1;
       }
 
-      if (strcmp(cmd, "COPY") == 0) {
-        struct copy_apply_ctx copy_ctx;
-        char substituted[2048];
-        char from_stage[64];
-        char src[PATH_MAX];
-        char dst[512];
-        char dst_abs[512];
-        char descriptor[8192];
-        char instruction[2300];
+      if (in->source_count == 1) {
+        snprintf(descriptor, sizeof(descriptor), "COPY|src=%s|src_hash=%s|dst=%s",
+                 in->sources[0].host, src_hash, in->destination_abs);
+      } else {
+        snprintf(descriptor, sizeof(descriptor), "COPY|srcs=%d|src_hash=%s|dst=%s",
+                 in->source_count, src_hash, in->destination_abs);
+      }
+      snprintf(instruction, sizeof(instruction), "COPY %s%s %s", in->link ? "--link " : "",
+               in->source, in->destination);
+    }
 
-        memset(&copy_ctx, 0, sizeof(copy_ctx));
+    copy_ctx.sources = in->sources;
+    copy_ctx.source_count = in->source_count;
+    snprintf(copy_ctx.destination, sizeof(copy_ctx.destination), "%s", in->destination);
+    snprintf(copy_ctx.workdir, sizeof(copy_ctx.workdir), "%s", stage->workdir);
+    copy_ctx.filter = session->ignore;
 
-        if (substitute_args(rest, &stage->args, substituted, sizeof(substituted)) != 0) {
-          fclose(fp);
-          return 1;
-        }
+    if (in->link) {
+      return create_linked_layer(session, stage, descriptor, instruction, &copy_ctx);
+    }
 
-        if (parse_copy_tokens(substituted, from_stage, sizeof(from_stage), src,
-                              sizeof(src), dst, sizeof(dst)) != 0) {
-          fprintf(stderr, "[ERR] Invalid COPY at line %d\n", line_no);
-          fclose(fp);
-          return 1;
-        }
+    return create_layer(session, stage, descriptor, instruction, apply_copy_layer,
+                        &copy_ctx);
+  }
 
-        if (normalize_container_path(stage->workdir, dst, dst_abs, sizeof(dst_abs)) != 0) {
-          fclose(fp);
-          return 1;
-        }
+  case ZI_ADD: {
+    struct add_apply_ctx add_ctx;
+    char descriptor[8192];
+    char instruction[2300];
 
-        if (from_stage[0] != '\0') {
-          int from_idx = stage_index_by_name(stages, stage_count, from_stage);
-          if (from_idx < 0) {
-            fprintf(stderr, "[ERR] COPY --from stage not found at line %d: %s\n", line_no,
-                    from_stage);
-            fclose(fp);
-            return 1;
-          }
-
-          copy_ctx.from_stage = 1;
-          copy_ctx.source_stage = &stages[from_idx];
-
-          snprintf(descriptor, sizeof(descriptor),
-                   "COPY|from=%s|src=%s|src_state=%s|dst=%s", from_stage, src,
-                   stages[from_idx].state_hash, dst_abs);
-          snprintf(instruction, sizeof(instruction), "COPY --from=%s %s %s", from_stage,
-                   src, dst);
-        } else {
-          char src_host[PATH_MAX];
-          char src_hash[17];
-
-          if (src[0] == '/') {
-            snprintf(src_host, sizeof(src_host), "%s", src);
-          } else {
-            snprintf(src_host, sizeof(src_host), "%s/%s", context_dir, src);
-          }
-
-          if (hash_path_recursive(src_host, src_hash) != 0) {
-            fprintf(stderr, "[ERR] COPY source not found/unreadable at line %d: %s\n",
-                    line_no, src_host);
-            fclose(fp);
-            return 1;
-          }
-
-          snprintf(descriptor, sizeof(descriptor), "COPY|src=%s|src_hash=%s|dst=%s",
-                   src_host, src_hash, dst_abs);
-          snprintf(instruction, sizeof(instruction), "COPY %s %s", src, dst);
-        }
+    memset(&add_ctx, 0, sizeof(add_ctx));
 
-        snprintf(copy_ctx.source, sizeof(copy_ctx.source), "%s", src);
-        snprintf(copy_ctx.destination, sizeof(copy_ctx.destination), "%s", dst);
-        snprintf(copy_ctx.workdir, sizeof(copy_ctx.workdir), "%s", stage->workdir);
-        snprintf(copy_ctx.context_dir, sizeof(copy_ctx.context_dir), "%s", context_dir);
+    if (in->is_url) {
+      struct download dl;
 
-        if (create_layer(stage, descriptor, instruction, apply_copy_layer, &copy_ctx) != 0) {
-          fprintf(stderr, "[ERR] Failed at line %d: %s", line_no, original);
-          fclose(fp);
+      /*
+       * The key follows the downloaded bytes rather than the URL alone. Plan
+       * mode stays offline and trusts whatever the cache last saw.
+       */
+      if (session->plan_only ? download_fetch(in->source, in->checksum, 1, &dl)
+                             : prefetch_wait_download(session->downloads, in->source,
+                                                      in->checksum, &dl)) {
+        if (!session->plan_only) {
           return 1;
         }
-
-        continue;
+        snprintf(dl.sha256, sizeof(dl.sha256), "?");
       }
 
-      if (strcmp(cmd, "ADD") == 0) {
-        struct add_apply_ctx add_ctx;
-        char substituted[2048];
-        char src[PATH_MAX];
-        char dst[512];
-        char dst_abs[512];
-        char descriptor[8192];
-        char instruction[2300];
+      snprintf(descriptor, sizeof(descriptor), "ADD|url=%s|sha256=%s|dst=%s", in->source,
+               dl.sha256, in->destination_abs);
+      snprintf(add_ctx.source_host, sizeof(add_ctx.source_host), "%s", dl.path);
+    } else {
+      char src_hash[17];
+      enum archive_kind archive = archive_detect(in->sources[0].host);
 
-        memset(&add_ctx, 0, sizeof(add_ctx));
+      if (hash_instr_sources(session, in, "ADD", src_hash) != 0) {
+        return 1;
+      }
 
-        if (substitute_args(rest, &stage->args, substituted, sizeof(substituted)) != 0) {
-          fclose(fp);
-          return 1;
-        }
+      add_ctx.sources = in->sources;
+      add_ctx.source_count = in->source_count;
+
+      /* src_hash covers every match, and with it whether each one unpacks. */
+      if (in->source_count > 1) {
+        snprintf(descriptor, sizeof(descriptor), "ADD|src=%s|src_hash=%s|dst=%s",
+                 in->source, src_hash, in->destination_abs);
+      } else if (archive != ARCHIVE_NONE) {
+        snprintf(descriptor, sizeof(descriptor), "ADD|src=%s|src_hash=%s|extract=%s|dst=%s",
+                 in->sources[0].host, src_hash, archive_kind_name(archive),
+                 in->destination_abs);
+      } else {
+        snprintf(descriptor, sizeof(descriptor), "ADD|src=%s|src_hash=%s|dst=%s",
+                 in->sources[0].host, src_hash, in->destination_abs);
+      }
+      add_ctx.filter = session->ignore;
+    }
 
-        if (parse_two_tokens(substituted, src, sizeof(src), dst, sizeof(dst)) != 0) {
-          fprintf(stderr, "[ERR] Invalid ADD at line %d\n", line_no);
-          fclose(fp);
-          return 1;
-        }
+    if (in->checksum[0] != '\0') {
+      snprintf(instruction, sizeof(instruction), "ADD --checksum=%s %s %s", in->checksum,
+               in->source, in->destination);
+    } else {
+      snprintf(instruction, sizeof(instruction), "ADD %s %s", in->source, in->destination);
+    }
+    snprintf(add_ctx.destination, sizeof(add_ctx.destination), "%s", in->destination);
+    snprintf(add_ctx.workdir, sizeof(add_ctx.workdir), "%s", stage->workdir);
 
-        if (normalize_container_path(stage->workdir, dst, dst_abs, sizeof(dst_abs)) != 0) {
-          fclose(fp);
-          return 1;
-        }
+    return create_layer(session, stage, descriptor, instruction, apply_add_layer, &add_ctx);
+  }
+  }
 
-        add_ctx.is_url = starts_with(src, "http://") || starts_with(src, "https://");
-
-        if (add_ctx.is_url) {
-          snprintf(descriptor, sizeof(descriptor), "ADD|url=%s|dst=%s", src, dst_abs);
-        } else {
-          char src_host[PATH_MAX];
-          char src_hash[17];
-
-          if (src[0] == '/') {
-            snprintf(src_host, sizeof(src_host), "%s", src);
-          } else {
-            snprintf(src_host, sizeof(src_host), "%s/%s", context_dir, src);
-          }
-
-          if (hash_path_recursive(src_host, src_hash) != 0) {
-            fprintf(stderr, "[ERR] ADD source not found/unreadable at line %d: %s\n",
-                    line_no, src_host);
-            fclose(fp);
-            return 1;
-          }
-
-          snprintf(descriptor, sizeof(descriptor), "ADD|src=%s|src_hash=%s|dst=%s",
-                   src_host, src_hash, dst_abs);
-        }
+  return 1;
+}
+
+static int execute_zockerfile(const struct config *cfg, const struct zockerfile *zf,
+                              struct build_session *session) {
+  struct stage_ctx stages[MAX_STAGES];
+  int s;
+  int i;
 
-        snprintf(instruction, sizeof(instruction), "ADD %s %s", src, dst);
+  if (resolve_stage_bases(zf, stages) != 0) {
+    return 1;
+  }
 
-        snprintf(add_ctx.source, sizeof(add_ctx.source), "%s", src);
-        snprintf(add_ctx.destination, sizeof(add_ctx.destination), "%s", dst);
-        snprintf(add_ctx.workdir, sizeof(add_ctx.workdir), "%s", stage->workdir);
-        snprintf(add_ctx.context_dir, sizeof(add_ctx.context_dir), "%s", context_dir);
+  for (s = 0; s < zf->stage_count; s++) {
+    if (!zf->stages[s].needed) {
+      printf("[SKIP] Stage %s is not needed by the final stage\n", zf->stages[s].name);
+    }
+  }
 
-        if (create_layer(stage, descriptor, instruction, apply_add_layer, &add_ctx) != 0) {
-          fprintf(stderr, "[ERR] Failed at line %d: %s", line_no, original);
-          fclose(fp);
-          return 1;
-        }
+  if (session->plan_only) {
+    printf("%-5s %-8s %-8s %s\n", "STEP", "STATUS", "EST", "INSTRUCTION");
+  }
 
-        continue;
-      }
+  for (i = 0; i < zf->count; i++) {
+    const struct zinstr *in = &zf->instrs[i];
 
-      if (strcmp(cmd, "CMD") == 0) {
-        char cmd_value[1024];
-        if (substitute_args(rest, &stage->args, cmd_value, sizeof(cmd_value)) != 0) {
-          fclose(fp);
-          return 1;
-        }
-        snprintf(stage->cmd, sizeof(stage->cmd), "%s", cmd_value);
-        continue;
-      }
+    if (!zf->stages[in->stage].needed) {
+      continue;
+    }
 
-      fprintf(stderr, "[ERR] Unsupported instruction at line %d: %s\n", line_no, cmd);
-      fclose(fp);
+    if (execute_instr(session, stages, in) != 0) {
+      fprintf(stderr, "[ERR] Failed at line %d: %s\n", in->line_no, in->text);
       return 1;
     }
   }
 
-  fclose(fp);
+  if (session->plan_only) {
+    const struct build_plan *plan = &session->plan;
+    char estimate[32];
 
-  if (stage_count == 0) {
-    fprintf(stderr, "[ERR] Zockerfile has no FROM/BASEDIR\n");
-    return 1;
+    if (plan->rebuild == 0) {
+      printf("Plan: fully cached (%d steps)\n", plan->steps);
+      return 0;
+    }
+
+    format_duration(plan->estimate_ms, estimate, sizeof(estimate));
+    printf("Plan: %d of %d steps cached, %d to rebuild, estimated %s", plan->cached,
+           plan->steps, plan->rebuild, estimate);
+    if (plan->unestimated > 0) {
+      printf(" (+%d without history)", plan->unestimated);
+    }
+    printf("\n");
+    return 0;
   }
 
   {
-    struct stage_ctx *final_stage = &stages[stage_count - 1];
+    struct stage_ctx *final_stage = &stages[zf->stage_count - 1];
     struct image_meta image;
 
-    if (ensure_final_stage_has_layer(final_stage) != 0) {
+    if (ensure_final_stage_has_layer(session, final_stage) != 0) {
+      return 1;
+    }
+
+    if (commit_queue_drain(session->commits) != 0) {
+      fprintf(stderr, "[ERR] Failed to commit layer metadata\n");
       return 1;
     }
 
@@ -1341,6 +1332,7 @@ int build_image_from_config(const struct config *cfg) {
 
     snprintf(image.ref, sizeof(image.ref), "%s:%s", image.name, image.tag);
     snprintf(image.top_layer, sizeof(image.top_layer), "%s", final_stage->top_layer);
+    snprintf(image.base_layer, sizeof(image.base_layer), "%s", final_stage->base_layer);
     snprintf(image.cmd, sizeof(image.cmd), "%s", final_stage->cmd);
 
     if (save_image_meta(&image) != 0) {
@@ -1354,3 +1346,328 @@ int build_image_from_config(const struct config *cfg) {
 
   return 0;
 }
+
+/* reparse marks the directory a context glob expands in; host is then empty. */
+struct watch_source {
+  char host[PATH_MAX];
+  char real[PATH_MAX];
+  int reparse;
+};
+
+/*
+ * What watch mode keeps between rebuilds besides the parsed Zockerfile: the
+ * real paths of every local COPY/ADD source, matched against changed paths to
+ * drop just their entries from the prefetch pool's hash index. A change where
+ * a glob expands re-parses instead, since the match list may differ.
+ */
+struct watch_state {
+  char zockerfile_real[PATH_MAX];
+  char ignore_real[PATH_MAX];
+  struct watch_source *sources;
+  int source_count;
+  struct prefetch_pool *prefetch;
+  int relevant;
+  int zockerfile_changed;
+  int ignore_changed;
+};
+
+static void real_or_given(const char *path, char *out, size_t out_size) {
+  char real[PATH_MAX];
+
+  if (realpath(path, real) != NULL) {
+    snprintf(out, out_size, "%s", real);
+  } else {
+    snprintf(out, out_size, "%s", path);
+  }
+}
+
+/* True if a and b are the same path or one lies below the other. */
+static int paths_related(const char *a, const char *b) {
+  size_t na = strlen(a);
+  size_t nb = strlen(b);
+
+  if (na <= nb) {
+    return strncmp(a, b, na) == 0 && (b[na] == '\0' || b[na] == '/');
+  }
+  return strncmp(a, b, nb) == 0 && a[nb] == '/';
+}
+
+static int add_watch_source(struct watch_state *state, const char *host, const char *path,
+                            int reparse) {
+  struct watch_source *sources =
+      realloc(state->sources, sizeof(*sources) * (state->source_count + 1));
+
+  if (sources == NULL) {
+    return 1;
+  }
+
+  state->sources = sources;
+  snprintf(sources[state->source_count].host, sizeof(sources[0].host), "%s", host);
+  real_or_given(path, sources[state->source_count].real, sizeof(sources[0].real));
+  sources[state->source_count].reparse = reparse;
+  state->source_count++;
+  return 0;
+}
+
+/* Adds the deepest glob-free directory of every wildcard source token. */
+static int add_glob_dirs(const struct zockerfile *zf, const struct zinstr *in,
+                         struct watch_state *state) {
+  char tokens[PATH_MAX];
+  char *saveptr = NULL;
+  char *tok;
+
+  snprintf(tokens, sizeof(tokens), "%s", in->source);
+  for (tok = strtok_r(tokens, " ", &saveptr); tok != NULL;
+       tok = strtok_r(NULL, " ", &saveptr)) {
+    char dir[PATH_MAX];
+    char *wild;
+    char *slash;
+
+    if (strpbrk(tok, "*?[") == NULL) {
+      continue;
+    }
+
+    if (tok[0] == '/') {
+      snprintf(dir, sizeof(dir), "%s", tok);
+    } else {
+      snprintf(dir, sizeof(dir), "%s/%s", zf->context_dir, tok);
+    }
+
+    wild = strpbrk(dir, "*?[");
+    *wild = '\0';
+    slash = strrchr(dir, '/');
+    if (slash != NULL) {
+      *slash = '\0';
+    }
+
+    if (add_watch_source(state, "", dir[0] == '\0' ? "/" : dir, 1) != 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static int collect_watch_sources(const struct zockerfile *zf, struct watch_state *state) {
+  char ignore_path[PATH_MAX];
+  int i;
+
+  free(state->sources);
+  state->sources = NULL;
+  state->source_count = 0;
+
+  real_or_given(zf->path, state->zockerfile_real, sizeof(state->zockerfile_real));
+  snprintf(ignore_path, sizeof(ignore_path), "%s/%s", zf->context_dir, ZOCKER_IGNORE_FILE);
+  real_or_given(ignore_path, state->ignore_real, sizeof(state->ignore_real));
+
+  for (i = 0; i < zf->count; i++) {
+    const struct zinstr *in = &zf->instrs[i];
+    int j;
+
+    if ((in->kind != ZI_COPY && in->kind != ZI_ADD) || in->from_stage >= 0 || in->is_url ||
+        !zf->stages[in->stage].needed) {
+      continue;
+    }
+
+    for (j = 0; j < in->source_count; j++) {
+      if (add_watch_source(state, in->sources[j].host, in->sources[j].host, 0) != 0) {
+        return 1;
+      }
+    }
+
+    if (in->has_glob && add_glob_dirs(zf, in, state) != 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void invalidate_all_sources(struct watch_state *state) {
+  int i;
+
+  for (i = 0; i < state->source_count; i++) {
+    if (!state->sources[i].reparse) {
+      prefetch_invalidate(state->prefetch, state->sources[i].host);
+    }
+  }
+}
+
+static void on_context_change(const char *path, void *ctx) {
+  struct watch_state *state = (struct watch_state *)ctx;
+  int i;
+
+  if (paths_related(path, state->zockerfile_real)) {
+    state->zockerfile_changed = 1;
+    state->relevant = 1;
+  }
+
+  if (paths_related(path, state->ignore_real)) {
+    state->ignore_changed = 1;
+    state->relevant = 1;
+  }
+
+  for (i = 0; i < state->source_count; i++) {
+    if (!paths_related(path, state->sources[i].real)) {
+      continue;
+    }
+
+    if (state->sources[i].reparse) {
+      state->zockerfile_changed = 1;
+    } else {
+      prefetch_invalidate(state->prefetch, state->sources[i].host);
+    }
+    state->relevant = 1;
+  }
+}
+
+/*
+ * Rebuilds after every debounced batch of context changes. Only the hashes of
+ * touched sources are recomputed, and the Zockerfile is re-parsed only when it
+ * changed itself; every step before the first affected one is a cache hit.
+ */
+static int watch_and_rebuild(const struct config *cfg, struct zockerfile *zf,
+                             struct ignore_rules *ignore, struct build_session *session) {
+  struct watch_state state;
+  struct context_watch *watch;
+  int rc = 0;
+
+  memset(&state, 0, sizeof(state));
+  state.prefetch = session->prefetch;
+
+  if (collect_watch_sources(zf, &state) != 0) {
+    return 1;
+  }
+
+  watch = watch_open(zf->context_dir, &ignore->filter);
+  if (watch == NULL) {
+    fprintf(stderr, "[ERR] Failed to watch build context %s\n", zf->context_dir);
+    free(state.sources);
+    return 1;
+  }
+
+  printf("[WATCH] Watching %s for changes (Ctrl-C to stop)\n", zf->context_dir);
+  fflush(stdout);
+
+  while (1) {
+    long started_ms;
+
+    state.relevant = 0;
+    state.zockerfile_changed = 0;
+    state.ignore_changed = 0;
+
+    if (watch_next_batch(watch, WATCH_DEBOUNCE_MS, on_context_change, &state) != 0) {
+      fprintf(stderr, "[ERR] Failed to read context changes: %s\n", strerror(errno));
+      rc = 1;
+      break;
+    }
+
+    if (!state.relevant) {
+      continue;
+    }
+
+    if (state.ignore_changed) {
+      ignore_free(ignore);
+      if (ignore_load(zf->context_dir, ignore) != 0) {
+        fprintf(stderr, "[ERR] Failed to read %s\n", state.ignore_real);
+        rc = 1;
+        break;
+      }
+      session->ignore = ignore->count > 0 ? &ignore->filter : NULL;
+      invalidate_all_sources(&state);
+
+      /* Directories that are no longer ignored need watches of their own. */
+      watch_close(watch);
+      watch = watch_open(zf->context_dir, &ignore->filter);
+      if (watch == NULL) {
+        fprintf(stderr, "[ERR] Failed to watch build context %s\n", zf->context_dir);
+        free(state.sources);
+        return 1;
+      }
+    }
+
+    if (state.zockerfile_changed) {
+      struct zockerfile next;
+
+      if (zockerfile_parse(cfg->zockerfile, cfg->build_args, cfg->build_arg_count, &next) !=
+          0) {
+        printf("[WATCH] Waiting for the Zockerfile to be fixed\n");
+        fflush(stdout);
+        continue;
+      }
+
+      zockerfile_free(zf);
+      *zf = next;
+      if (collect_watch_sources(zf, &state) != 0) {
+        rc = 1;
+        break;
+      }
+    }
+
+    printf("[WATCH] Change detected, rebuilding\n");
+    started_ms = monotonic_ms();
+    prefetch_url_sources(zf, session->downloads, 1);
+    prefetch_context_sources(zf, session->prefetch, session->ignore);
+
+    if (execute_zockerfile(cfg, zf, session) != 0) {
+      printf("[WATCH] Build failed; waiting for the next change\n");
+    } else {
+      printf("[WATCH] Rebuilt in %ldms\n", monotonic_ms() - started_ms);
+    }
+    fflush(stdout);
+  }
+
+  watch_close(watch);
+  free(state.sources);
+  return rc;
+}
+
+int build_image_from_config(const struct config *cfg) {
+  struct build_session session;
+  struct ignore_rules ignore;
+  struct zockerfile zf;
+  int rc;
+
+  if (zockerfile_parse(cfg->zockerfile, cfg->build_args, cfg->build_arg_count, &zf) != 0) {
+    return 1;
+  }
+
+  if (ignore_load(zf.context_dir, &ignore) != 0) {
+    fprintf(stderr, "[ERR] Failed to read %s/%s\n", zf.context_dir, ZOCKER_IGNORE_FILE);
+    zockerfile_free(&zf);
+    return 1;
+  }
+
+  memset(&session, 0, sizeof(session));
+  session.blob_pool = cfg->blob_pool;
+  session.plan_only = cfg->plan;
+  session.ignore = ignore.count > 0 ? &ignore.filter : NULL;
+
+  if (!session.plan_only) {
+    session.downloads = prefetch_start(PREFETCH_DOWNLOADS);
+    prefetch_url_sources(&zf, session.downloads, 0);
+  }
+
+  session.prefetch = prefetch_start(PREFETCH_WORKERS);
+  if (session.prefetch != NULL) {
+    prefetch_context_sources(&zf, session.prefetch, session.ignore);
+  }
+
+  if (!session.plan_only) {
+    session.commits = commit_queue_start();
+  }
+
+  rc = execute_zockerfile(cfg, &zf, &session);
+  if (cfg->watch && watch_and_rebuild(cfg, &zf, &ignore, &session) != 0) {
+    rc = 1;
+  }
+
+  if (commit_queue_stop(session.commits) != 0) {
+    rc = 1;
+  }
+  prefetch_stop(session.prefetch);
+  prefetch_stop(session.downloads);
+  ignore_free(&ignore);
+  zockerfile_free(&zf);
+  return rc;
+}
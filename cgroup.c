@@ -0,0 +1,336 @@
+#define _GNU_SOURCE
+
+#include "cgroup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CGROUP_RMDIR_ATTEMPTS 50
+
+static int cpuset_wanted(const struct cgroup_limits *l) {
+  return l->cpuset_cpus[0] != '\0' || l->cpuset_mems[0] != '\0';
+}
+
+int cgroup_limits_set(const struct cgroup_limits *l) {
+  return l->cpu_quota_us > 0 || l->cpu_weight > 0 || l->memory_max > 0 ||
+         l->memory_swap != 0 || l->pids_max > 0 || l->io_weight > 0 || l->io_max[0] != '\0' ||
+         cpuset_wanted(l);
+}
+
+int cgroup_parse_bytes(const char *s, long long *out) {
+  char *end;
+  long long value;
+
+  errno = 0;
+  value = strtoll(s, &end, 10);
+  if (errno != 0 || end == s || value < 0) {
+    return 1;
+  }
+
+  switch (*end) {
+  case 'k':
+  case 'K':
+    value <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    value <<= 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    value <<= 30;
+    end++;
+    break;
+  default:
+    break;
+  }
+
+  if (*end == 'b' || *end == 'B') {
+    end++;
+  }
+  if (*end != '\0') {
+    return 1;
+  }
+
+  *out = value;
+  return 0;
+}
+
+int cgroup_weight_from_shares(long long shares) {
+  if (shares < 2) {
+    shares = 2;
+  }
+  if (shares > 262144) {
+    shares = 262144;
+  }
+  return (int)(1 + ((shares - 2) * 9999) / 262142);
+}
+
+static int container_cgroup_path(const char *id, char *out, size_t out_size) {
+  int n = snprintf(out, out_size, "%s/%s/%s", ZOCKER_CGROUP_ROOT, ZOCKER_CGROUP_PARENT, id);
+
+  return n < 0 || (size_t)n >= out_size;
+}
+
+/* Like write_cgroup_file, without the error, for settings that are optional. */
+static int write_cgroup_file_quiet(const char *dir, const char *file, const char *value) {
+  char path[PATH_MAX];
+  ssize_t len = (ssize_t)strlen(value);
+  ssize_t n;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 1;
+  }
+  n = write(fd, value, (size_t)len);
+  close(fd);
+  return n != len;
+}
+
+static int write_cgroup_file(const char *dir, const char *file, const char *value) {
+  char path[PATH_MAX];
+  ssize_t len = (ssize_t)strlen(value);
+  ssize_t n;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "[ERR] Failed to open %s: %s\n", path, strerror(errno));
+    return 1;
+  }
+
+  n = write(fd, value, (size_t)len);
+  if (n != len) {
+    fprintf(stderr, "[ERR] Failed to write '%s' to %s: %s\n", value, path,
+            n < 0 ? strerror(errno) : "short write");
+    close(fd);
+    return 1;
+  }
+
+  close(fd);
+  return 0;
+}
+
+/* Reads a space-separated controller list as " a b c ", or " " if unreadable. */
+static void read_controller_list(const char *dir, const char *file, char *out, size_t out_size) {
+  char path[PATH_MAX];
+  char line[512];
+  FILE *fp;
+
+  line[0] = '\0';
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  fp = fopen(path, "r");
+  if (fp != NULL) {
+    if (fgets(line, sizeof(line), fp) == NULL) {
+      line[0] = '\0';
+    }
+    fclose(fp);
+  }
+
+  line[strcspn(line, "\n")] = '\0';
+  snprintf(out, out_size, " %s ", line);
+}
+
+static int controller_listed(const char *list, const char *name) {
+  char word[64];
+
+  snprintf(word, sizeof(word), " %s ", name);
+  return strstr(list, word) != NULL;
+}
+
+/* Controllers every container cgroup gets when available, for `zocker stats`. */
+static const char *accounting_controllers[] = {"cpu", "memory", "pids", "io"};
+
+static int controller_required(const char *name, const struct cgroup_limits *l) {
+  if (strcmp(name, "cpu") == 0) {
+    return l->cpu_quota_us > 0 || l->cpu_weight > 0;
+  }
+  if (strcmp(name, "memory") == 0) {
+    return l->memory_max > 0 || l->memory_swap != 0;
+  }
+  if (strcmp(name, "pids") == 0) {
+    return l->pids_max > 0;
+  }
+  return l->io_weight > 0 || l->io_max[0] != '\0';
+}
+
+/*
+ * Enables the accounting controllers for the children of dir. Those the
+ * limits need must be available; the rest are enabled where possible.
+ */
+static int enable_controllers(const char *dir, const struct cgroup_limits *l) {
+  char available[520];
+  char enabled[520];
+  char value[32];
+  int i;
+
+  read_controller_list(dir, "cgroup.controllers", available, sizeof(available));
+  read_controller_list(dir, "cgroup.subtree_control", enabled, sizeof(enabled));
+
+  for (i = 0; i < (int)(sizeof(accounting_controllers) / sizeof(accounting_controllers[0])); i++) {
+    const char *name = accounting_controllers[i];
+    int required = controller_required(name, l);
+
+    if (!controller_listed(available, name)) {
+      if (required) {
+        fprintf(stderr, "[ERR] cgroup controller '%s' is not available in %s\n", name, dir);
+        return 1;
+      }
+      continue;
+    }
+    if (controller_listed(enabled, name)) {
+      continue;
+    }
+
+    snprintf(value, sizeof(value), "+%s", name);
+    if (required) {
+      if (write_cgroup_file(dir, "cgroup.subtree_control", value) != 0) {
+        return 1;
+      }
+    } else {
+      write_cgroup_file_quiet(dir, "cgroup.subtree_control", value);
+    }
+  }
+
+  /* Optional: without it, affinity and memory policy still place the container. */
+  if (cpuset_wanted(l) && controller_listed(available, "cpuset") &&
+      !controller_listed(enabled, "cpuset")) {
+    write_cgroup_file_quiet(dir, "cgroup.subtree_control", "+cpuset");
+  }
+
+  return 0;
+}
+
+static int write_limits(const char *dir, const struct cgroup_limits *l) {
+  char path[PATH_MAX];
+  char value[128];
+
+  if (l->cpu_quota_us > 0) {
+    snprintf(value, sizeof(value), "%lld %d", l->cpu_quota_us, CGROUP_CPU_PERIOD_US);
+    if (write_cgroup_file(dir, "cpu.max", value) != 0) return 1;
+  }
+  if (l->cpu_weight > 0) {
+    snprintf(value, sizeof(value), "%d", l->cpu_weight);
+    if (write_cgroup_file(dir, "cpu.weight", value) != 0) return 1;
+  }
+  if (l->memory_max > 0) {
+    snprintf(value, sizeof(value), "%lld", l->memory_max);
+    if (write_cgroup_file(dir, "memory.max", value) != 0) return 1;
+  }
+  if (l->memory_swap < 0) {
+    if (write_cgroup_file(dir, "memory.swap.max", "max") != 0) return 1;
+  } else if (l->memory_swap > 0) {
+    snprintf(value, sizeof(value), "%lld", l->memory_swap - l->memory_max);
+    if (write_cgroup_file(dir, "memory.swap.max", value) != 0) return 1;
+  }
+  if (l->pids_max > 0) {
+    snprintf(value, sizeof(value), "%lld", l->pids_max);
+    if (write_cgroup_file(dir, "pids.max", value) != 0) return 1;
+  }
+  if (l->io_weight > 0) {
+    snprintf(value, sizeof(value), "default %d", l->io_weight);
+    if (write_cgroup_file(dir, "io.weight", value) != 0) return 1;
+  }
+  if (l->io_max[0] != '\0') {
+    if (write_cgroup_file(dir, "io.max", l->io_max) != 0) return 1;
+  }
+  if (cpuset_wanted(l)) {
+    snprintf(path, sizeof(path), "%s/cpuset.cpus", dir);
+    if (access(path, F_OK) != 0) {
+      fprintf(stderr, "[WARN] cgroup controller 'cpuset' is not available; "
+                      "placing by CPU affinity and memory policy only\n");
+      return 0;
+    }
+  }
+  if (l->cpuset_cpus[0] != '\0') {
+    if (write_cgroup_file(dir, "cpuset.cpus", l->cpuset_cpus) != 0) return 1;
+  }
+  if (l->cpuset_mems[0] != '\0') {
+    if (write_cgroup_file(dir, "cpuset.mems", l->cpuset_mems) != 0) return 1;
+  }
+  return 0;
+}
+
+int cgroup_available(void) {
+  char probe[PATH_MAX];
+
+  snprintf(probe, sizeof(probe), "%s/cgroup.controllers", ZOCKER_CGROUP_ROOT);
+  return access(probe, F_OK) == 0;
+}
+
+int cgroup_create(const char *id, const struct cgroup_limits *limits) {
+  char parent[PATH_MAX];
+  char path[PATH_MAX];
+  int fd;
+
+  if (!cgroup_available()) {
+    fprintf(stderr, "[ERR] No cgroup v2 hierarchy at %s\n", ZOCKER_CGROUP_ROOT);
+    return -1;
+  }
+
+  snprintf(parent, sizeof(parent), "%s/%s", ZOCKER_CGROUP_ROOT, ZOCKER_CGROUP_PARENT);
+  if (container_cgroup_path(id, path, sizeof(path)) != 0) {
+    return -1;
+  }
+
+  if ((mkdir(parent, 0755) != 0 && errno != EEXIST) ||
+      enable_controllers(ZOCKER_CGROUP_ROOT, limits) != 0 ||
+      enable_controllers(parent, limits) != 0) {
+    fprintf(stderr, "[ERR] Failed to prepare cgroup %s\n", parent);
+    return -1;
+  }
+
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "[ERR] Failed to create cgroup %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  if (write_limits(path, limits) != 0) {
+    rmdir(path);
+    return -1;
+  }
+
+  fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    rmdir(path);
+  }
+  return fd;
+}
+
+int cgroup_open(const char *id) {
+  char path[PATH_MAX];
+
+  if (container_cgroup_path(id, path, sizeof(path)) != 0) {
+    return -1;
+  }
+  return open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/* The last processes of a dead PID namespace may take a moment to leave. */
+void cgroup_remove(const char *id) {
+  char path[PATH_MAX];
+  int i;
+
+  if (container_cgroup_path(id, path, sizeof(path)) != 0) {
+    return;
+  }
+
+  for (i = 0; i < CGROUP_RMDIR_ATTEMPTS; i++) {
+    if (rmdir(path) == 0 || errno != EBUSY) {
+      return;
+    }
+    usleep(2000);
+  }
+  fprintf(stderr, "[WARN] cgroup %s is still busy; leaving it behind\n", path);
+}
@@ -0,0 +1,56 @@
+#ifndef __CGROUP_H__
+#define __CGROUP_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef ZOCKER_CGROUP_ROOT
+#define ZOCKER_CGROUP_ROOT "/sys/fs/cgroup"
+#endif
+
+/* Per-container cgroups live under ZOCKER_CGROUP_ROOT/<this>/<id>. */
+#ifndef ZOCKER_CGROUP_PARENT
+#define ZOCKER_CGROUP_PARENT "zocker"
+#endif
+
+#ifndef CGROUP_CPU_PERIOD_US
+#define CGROUP_CPU_PERIOD_US 100000
+#endif
+
+/* Resource limits of a container; zero fields are left at the kernel default. */
+struct cgroup_limits {
+  long long cpu_quota_us;
+  int cpu_weight;
+  long long memory_max;
+  /* Memory plus swap, as with docker's --memory-swap; -1 for unlimited swap. */
+  long long memory_swap;
+  long long pids_max;
+  int io_weight;
+  char io_max[256];
+  /* cpuset.cpus / cpuset.mems lists; also applied as affinity and memory policy. */
+  char cpuset_cpus[256];
+  char cpuset_mems[256];
+};
+
+int cgroup_limits_set(const struct cgroup_limits *limits);
+
+/* Parses 512, 64k, 512m, 2g (powers of 1024) into bytes. */
+int cgroup_parse_bytes(const char *s, long long *out);
+/* Maps docker's --cpu-shares (2..262144, default 1024) onto cpu.weight. */
+int cgroup_weight_from_shares(long long shares);
+
+/* Whether ZOCKER_CGROUP_ROOT is a cgroup v2 hierarchy. */
+int cgroup_available(void);
+
+/*
+ * Creates the container's cgroup v2 directory, enabling the controllers
+ * the limits need (and, where available, the other accounting ones) on the
+ * way down, and writes the limits. Returns an fd of
+ * the directory for spawn_process, or -1.
+ */
+int cgroup_create(const char *id, const struct cgroup_limits *limits);
+/* Opens an existing container cgroup, or returns -1 if it has none. */
+int cgroup_open(const char *id);
+void cgroup_remove(const char *id);
+
+#endif
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+
+#include "commit_queue.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+struct commit_node {
+  struct commit_job job;
+  struct commit_node *next;
+};
+
+struct commit_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t thread;
+  struct commit_node *head;
+  struct commit_node *tail;
+  int busy;
+  int stopping;
+  int failures;
+};
+
+/*
+ * The bookkeeping half of a layer commit. Nothing here feeds the next step's
+ * cache key or lower chain, so it can trail behind the build: size
+ * accounting, metadata, cache registration and removal of the step's temp
+ * dir. Blob pooling rewrites the diff, so it is not done here.
+ */
+static int run_commit_job(struct commit_job *job) {
+  int rc = 0;
+
+  if (job->tmp_dir[0] != '\0') {
+    remove_recursive(job->tmp_dir);
+  }
+
+  if (job->step_key[0] != '\0') {
+    record_step_duration(job->step_key, job->meta.duration_ms);
+  }
+
+  if (job->write_meta) {
+    job->meta.size = dir_size_bytes(job->diff_dir);
+    if (write_layer_metadata(&job->meta) != 0) {
+      fprintf(stderr, "[ERR] Failed to write metadata for layer %s\n", job->meta.id);
+      rc = 1;
+    }
+  }
+
+  if (rc == 0 && job->cache_key[0] != '\0' &&
+      register_layer_cache(job->cache_key, job->meta.id) != 0) {
+    fprintf(stderr, "[ERR] Failed to register cache entry for layer %s\n", job->meta.id);
+    rc = 1;
+  }
+
+  return rc;
+}
+
+static void *commit_worker(void *arg) {
+  struct commit_queue *queue = (struct commit_queue *)arg;
+
+  pthread_mutex_lock(&queue->lock);
+  while (1) {
+    struct commit_node *node;
+
+    while (!queue->stopping && queue->head == NULL) {
+      pthread_cond_wait(&queue->changed, &queue->lock);
+    }
+
+    if (queue->head == NULL) {
+      break;
+    }
+
+    node = queue->head;
+    queue->head = node->next;
+    if (queue->head == NULL) {
+      queue->tail = NULL;
+    }
+    queue->busy = 1;
+    pthread_mutex_unlock(&queue->lock);
+
+    if (run_commit_job(&node->job) != 0) {
+      pthread_mutex_lock(&queue->lock);
+      queue->failures++;
+      pthread_mutex_unlock(&queue->lock);
+    }
+    free(node);
+
+    pthread_mutex_lock(&queue->lock);
+    queue->busy = 0;
+    pthread_cond_broadcast(&queue->changed);
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
+
+struct commit_queue *commit_queue_start(void) {
+  struct commit_queue *queue = calloc(1, sizeof(*queue));
+
+  if (queue == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->changed, NULL);
+
+  if (pthread_create(&queue->thread, NULL, commit_worker, queue) != 0) {
+    pthread_cond_destroy(&queue->changed);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+    return NULL;
+  }
+
+  return queue;
+}
+
+/* Without a queue (thread creation failed) the job runs synchronously. */
+int commit_queue_push(struct commit_queue *queue, const struct commit_job *job) {
+  struct commit_node *node;
+
+  if (job == NULL) {
+    return 1;
+  }
+
+  if (queue == NULL) {
+    struct commit_job copy = *job;
+    return run_commit_job(&copy);
+  }
+
+  node = malloc(sizeof(*node));
+  if (node == NULL) {
+    return 1;
+  }
+  node->job = *job;
+  node->next = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail == NULL) {
+    queue->head = node;
+  } else {
+    queue->tail->next = node;
+  }
+  queue->tail = node;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+  return 0;
+}
+
+/* Waits until every queued job has finished; nonzero if any of them failed. */
+int commit_queue_drain(struct commit_queue *queue) {
+  int failures;
+
+  if (queue == NULL) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->head != NULL || queue->busy) {
+    pthread_cond_wait(&queue->changed, &queue->lock);
+  }
+  failures = queue->failures;
+  queue->failures = 0;
+  pthread_mutex_unlock(&queue->lock);
+
+  return failures != 0;
+}
+
+int commit_queue_stop(struct commit_queue *queue) {
+  int rc;
+
+  if (queue == NULL) {
+    return 0;
+  }
+
+  rc = commit_queue_drain(queue);
+
+  pthread_mutex_lock(&queue->lock);
+  queue->stopping = 1;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+
+  pthread_join(queue->thread, NULL);
+  pthread_cond_destroy(&queue->changed);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue);
+  return rc;
+}
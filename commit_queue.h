@@ -0,0 +1,28 @@
+#ifndef __COMMIT_QUEUE_H__
+#define __COMMIT_QUEUE_H__
+
+#include <limits.h>
+
+#include "image_store.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+struct commit_job {
+  struct layer_meta meta;
+  char cache_key[17];
+  char step_key[17];
+  char diff_dir[PATH_MAX];
+  char tmp_dir[PATH_MAX];
+  int write_meta;
+};
+
+struct commit_queue;
+
+struct commit_queue *commit_queue_start(void);
+int commit_queue_push(struct commit_queue *queue, const struct commit_job *job);
+int commit_queue_drain(struct commit_queue *queue);
+int commit_queue_stop(struct commit_queue *queue);
+
+#endif
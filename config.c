@@ -2,10 +2,11 @@
 #include <string.h>
 
 #include "config.h"
+#include "pool.h"
 
 int validate_config(struct config* cfg) {
   if (cfg->subcommand == NONE) {
-    fprintf(stderr, "[ERR] Missing subcommand (run|build|history|images|rmi|prune)\n");
+    fprintf(stderr, "[ERR] Missing subcommand (run|build|history|images|rmi|prune|rebase|metrics|pool|ps|stats|stop|wait|rm)\n");
     return 1;
   }
 
@@ -24,6 +25,16 @@ int validate_config(struct config* cfg) {
       return 1;
     }
 
+    if (cfg->limits.memory_swap > 0 && cfg->limits.memory_swap < cfg->limits.memory_max) {
+      fprintf(stderr, "[ERR] --memory-swap must be at least --memory\n");
+      return 1;
+    }
+
+    if (cfg->limits.memory_swap != 0 && cfg->limits.memory_max == 0) {
+      fprintf(stderr, "[ERR] --memory-swap requires --memory\n");
+      return 1;
+    }
+
     return 0;
   }
 
@@ -33,7 +44,7 @@ int validate_config(struct config* cfg) {
       return 1;
     }
 
-    if (strcmp(cfg->image_ref, "") == 0) {
+    if (strcmp(cfg->image_ref, "") == 0 && !cfg->plan) {
       fprintf(stderr, "[ERR] Missing image tag (use -t imagename:tag)\n");
       return 1;
     }
@@ -49,5 +60,56 @@ int validate_config(struct config* cfg) {
     return 0;
   }
 
+  if (cfg->subcommand == EXEC) {
+    if (strcmp(cfg->name, "") == 0) {
+      fprintf(stderr, "[ERR] Missing container name\n");
+      return 1;
+    }
+
+    if (strcmp(cfg->command, "") == 0) {
+      fprintf(stderr, "[ERR] Missing command (e.g. 'ps')\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  if (cfg->subcommand == STOP || cfg->subcommand == WAIT || cfg->subcommand == RM) {
+    if (strcmp(cfg->name, "") == 0) {
+      fprintf(stderr, "[ERR] Missing container name\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  if (cfg->subcommand == POOL) {
+    if (strcmp(cfg->base_image, "") == 0) {
+      fprintf(stderr, "[ERR] Missing image to pool (use --base-image image:tag)\n");
+      return 1;
+    }
+
+    if (cfg->pool_size == 0) {
+      cfg->pool_size = POOL_DEFAULT_SIZE;
+    }
+
+    if (cfg->pool_size < 1 || cfg->pool_size > POOL_MAX_SIZE) {
+      fprintf(stderr, "[ERR] Pool size must be between 1 and %d\n", POOL_MAX_SIZE);
+      return 1;
+    }
+    return 0;
+  }
+
+  if (cfg->subcommand == REBASE) {
+    if (strcmp(cfg->image_ref, "") == 0) {
+      fprintf(stderr, "[ERR] Missing image reference (e.g. app:latest)\n");
+      return 1;
+    }
+
+    if (strcmp(cfg->onto, "") == 0) {
+      fprintf(stderr, "[ERR] Missing new base (use --onto image:tag or /path)\n");
+      return 1;
+    }
+    return 0;
+  }
+
   return 0;
 }
@@ -1,6 +1,8 @@
 #ifndef __CONFIG_H__
 #define __CONFIG_H__
 
+#include "cgroup.h"
+
 #ifndef DEFAULT_NAME
 #define DEFAULT_NAME "bib"
 #endif
@@ -9,6 +11,10 @@
 #define MAX_BUILD_ARGS 64
 #endif
 
+#ifndef MAX_STATS_CONTAINERS
+#define MAX_STATS_CONTAINERS 1024
+#endif
+
 enum COMMAND {
   NONE = 0,
   RUN = 10,
@@ -18,6 +24,14 @@ enum COMMAND {
   IMAGES = 14,
   RMI = 15,
   PRUNE = 16,
+  REBASE = 17,
+  METRICS = 18,
+  POOL = 19,
+  PS = 20,
+  STOP = 21,
+  WAIT = 22,
+  RM = 23,
+  STATS = 24,
 };
 
 struct build_arg {
@@ -33,8 +47,25 @@ struct config {
   char base_image[4096];
   char zockerfile[1024];
   char image_ref[256];
+  char onto[4096];
+  char rebase_from[256];
   struct build_arg build_args[MAX_BUILD_ARGS];
   int build_arg_count;
+  int blob_pool;
+  int plan;
+  int watch;
+  int timings;
+  int pool_size;
+  int share_image;
+  int detach;
+  struct cgroup_limits limits;
+  /* A NUMA node, NUMA_NODE_AUTO or NUMA_NODE_NONE. */
+  int numa_node;
+  /* Positional names of `zocker stats`, pointing into argv. */
+  const char *stats_names[MAX_STATS_CONTAINERS];
+  int stats_count;
+  int json;
+  int no_stream;
 };
 
 int validate_config(struct config *cfg);
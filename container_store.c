@@ -0,0 +1,332 @@
+#define _GNU_SOURCE
+
+#include "container_store.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "setup.h"
+#include "utils.h"
+
+static const char *status_names[] = {"created", "running", "exited", "failed"};
+
+static int container_root_path(const char *id, char *out, size_t out_size) {
+  int n;
+
+  if (id == NULL || id[0] == '\0' || strchr(id, '/') != NULL || strcmp(id, ".") == 0 ||
+      strcmp(id, "..") == 0) {
+    return 1;
+  }
+
+  n = snprintf(out, out_size, "%s/%s", ZOCKER_CONTAINERS_DIR, id);
+  return n < 0 || (size_t)n >= out_size;
+}
+
+static enum container_status status_from_name(const char *name) {
+  int i;
+
+  for (i = 0; i < (int)(sizeof(status_names) / sizeof(status_names[0])); i++) {
+    if (strcmp(name, status_names[i]) == 0) {
+      return (enum container_status)i;
+    }
+  }
+  return CONTAINER_FAILED;
+}
+
+/* Alive and not a zombie waiting for a parent that may never reap it. */
+static int process_alive(pid_t pid) {
+  char path[64];
+  char buf[512];
+  char *paren;
+  FILE *fp;
+  size_t n;
+
+  if (pid <= 0 || (kill(pid, 0) != 0 && errno != EPERM)) {
+    return 0;
+  }
+
+  snprintf(path, sizeof(path), "/proc/%ld/stat", (long)pid);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 1;
+  }
+  n = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[n] = '\0';
+
+  paren = strrchr(buf, ')');
+  return paren == NULL || paren[1] == '\0' || paren[2] != 'Z';
+}
+
+int container_live(const struct container_state *st) {
+  return (st->status == CONTAINER_CREATED || st->status == CONTAINER_RUNNING) &&
+         process_alive(st->shim_pid);
+}
+
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* Waits up to timeout_ms (-1: forever) for pid to exit. Returns 1 once it has. */
+static int wait_exit(pid_t pid, int timeout_ms) {
+  int pidfd = open_pidfd(pid);
+  int waited = 0;
+
+  if (pidfd >= 0) {
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = pidfd;
+    pfd.events = POLLIN;
+    do {
+      rc = poll(&pfd, 1, timeout_ms);
+    } while (rc < 0 && errno == EINTR);
+    close(pidfd);
+    return rc > 0;
+  }
+
+  while (process_alive(pid)) {
+    if (timeout_ms >= 0 && waited >= timeout_ms) {
+      return 0;
+    }
+    usleep(10000);
+    waited += 10;
+  }
+  return 1;
+}
+
+int save_container_state(const struct container_state *st) {
+  char root[PATH_MAX];
+  char path[PATH_MAX];
+  char tmp_path[PATH_MAX];
+  FILE *fp;
+
+  if (st == NULL || container_root_path(st->id, root, sizeof(root)) != 0) {
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/state", root);
+  snprintf(tmp_path, sizeof(tmp_path), "%s/state.tmp", root);
+  fp = fopen(tmp_path, "w");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  fprintf(fp, "id=%s\n", st->id);
+  fprintf(fp, "image=%s\n", st->image);
+  fprintf(fp, "command=%s\n", st->command);
+  fprintf(fp, "status=%s\n", status_names[st->status]);
+  fprintf(fp, "pid=%ld\n", (long)st->pid);
+  fprintf(fp, "shim_pid=%ld\n", (long)st->shim_pid);
+  fprintf(fp, "exit_code=%d\n", st->exit_code);
+  fprintf(fp, "started_at=%ld\n", st->started_at);
+  fprintf(fp, "finished_at=%ld\n", st->finished_at);
+  fprintf(fp, "numa_node=%d\n", st->numa_node);
+  fprintf(fp, "cpuset_cpus=%s\n", st->cpuset_cpus);
+  fprintf(fp, "cpuset_mems=%s\n", st->cpuset_mems);
+
+  if (fclose(fp) != 0) {
+    return 1;
+  }
+
+  return rename(tmp_path, path) != 0;
+}
+
+int load_container_state(const char *id, struct container_state *st) {
+  char root[PATH_MAX];
+  char path[PATH_MAX];
+  char line[8192];
+  FILE *fp;
+
+  if (st == NULL || container_root_path(id, root, sizeof(root)) != 0) {
+    return 1;
+  }
+
+  memset(st, 0, sizeof(*st));
+  st->numa_node = -1;
+  snprintf(path, sizeof(path), "%s/state", root);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *eq = strchr(line, '=');
+    char *key;
+    char *value;
+
+    if (eq == NULL) {
+      continue;
+    }
+
+    *eq = '\0';
+    key = trim_whitespace(line);
+    value = eq + 1;
+    value[strcspn(value, "\r\n")] = '\0';
+
+    if (strcmp(key, "id") == 0) {
+      snprintf(st->id, sizeof(st->id), "%s", value);
+    } else if (strcmp(key, "image") == 0) {
+      snprintf(st->image, sizeof(st->image), "%s", value);
+    } else if (strcmp(key, "command") == 0) {
+      snprintf(st->command, sizeof(st->command), "%s", value);
+    } else if (strcmp(key, "status") == 0) {
+      st->status = status_from_name(trim_whitespace(value));
+    } else if (strcmp(key, "pid") == 0) {
+      st->pid = (pid_t)strtol(value, NULL, 10);
+    } else if (strcmp(key, "shim_pid") == 0) {
+      st->shim_pid = (pid_t)strtol(value, NULL, 10);
+    } else if (strcmp(key, "exit_code") == 0) {
+      st->exit_code = (int)strtol(value, NULL, 10);
+    } else if (strcmp(key, "started_at") == 0) {
+      st->started_at = strtol(value, NULL, 10);
+    } else if (strcmp(key, "finished_at") == 0) {
+      st->finished_at = strtol(value, NULL, 10);
+    } else if (strcmp(key, "numa_node") == 0) {
+      st->numa_node = (int)strtol(value, NULL, 10);
+    } else if (strcmp(key, "cpuset_cpus") == 0) {
+      snprintf(st->cpuset_cpus, sizeof(st->cpuset_cpus), "%s", value);
+    } else if (strcmp(key, "cpuset_mems") == 0) {
+      snprintf(st->cpuset_mems, sizeof(st->cpuset_mems), "%s", value);
+    }
+  }
+
+  fclose(fp);
+  return 0;
+}
+
+int list_containers(void) {
+  DIR *dir;
+  struct dirent *ent;
+
+  dir = opendir(ZOCKER_CONTAINERS_DIR);
+  if (dir == NULL) {
+    return 1;
+  }
+
+  printf("CONTAINER\tPID\tSTATUS\t\tCOMMAND\n");
+
+  while ((ent = readdir(dir)) != NULL) {
+    struct container_state st;
+    char status[32];
+
+    if (ent->d_name[0] == '.' || load_container_state(ent->d_name, &st) != 0) {
+      continue;
+    }
+
+    if (st.status == CONTAINER_EXITED) {
+      snprintf(status, sizeof(status), "exited (%d)", st.exit_code);
+    } else if (!container_live(&st) && st.status != CONTAINER_FAILED) {
+      snprintf(status, sizeof(status), "dead");
+    } else {
+      snprintf(status, sizeof(status), "%s", status_names[st.status]);
+    }
+
+    printf("%s\t%ld\t%-15s\t%s\n", st.id, (long)st.pid, status, st.command);
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+/*
+ * Sends SIGTERM to the container's init and SIGKILL if it is still there
+ * after CONTAINER_STOP_TIMEOUT_MS. Returns once the shim has recorded the
+ * exit.
+ */
+int stop_container(const char *id) {
+  struct container_state st;
+
+  if (load_container_state(id, &st) != 0) {
+    fprintf(stderr, "[ERR] Container not found: %s\n", id);
+    return 1;
+  }
+
+  if (!container_live(&st) || st.status != CONTAINER_RUNNING) {
+    fprintf(stderr, "[WARN] Container %s is not running\n", id);
+    return 0;
+  }
+
+  if (kill(st.pid, SIGTERM) != 0 && errno != ESRCH) {
+    fprintf(stderr, "[ERR] Failed to signal container %s: %s\n", id, strerror(errno));
+    return 1;
+  }
+
+  if (!wait_exit(st.pid, CONTAINER_STOP_TIMEOUT_MS)) {
+    kill(st.pid, SIGKILL);
+    wait_exit(st.pid, -1);
+  }
+
+  wait_exit(st.shim_pid, -1);
+  printf("%s\n", id);
+  return 0;
+}
+
+int wait_container(const char *id) {
+  struct container_state st;
+
+  if (load_container_state(id, &st) != 0) {
+    fprintf(stderr, "[ERR] Container not found: %s\n", id);
+    return 1;
+  }
+
+  if (container_live(&st)) {
+    wait_exit(st.shim_pid, -1);
+    if (load_container_state(id, &st) != 0) {
+      return 1;
+    }
+  }
+
+  if (st.status != CONTAINER_EXITED) {
+    fprintf(stderr, "[ERR] Container %s did not exit cleanly (%s)\n", id,
+            status_names[st.status]);
+    return 1;
+  }
+
+  printf("%d\n", st.exit_code);
+  return 0;
+}
+
+int remove_container(const char *id) {
+  struct container_state st;
+  char root[PATH_MAX];
+  char merged[PATH_MAX];
+
+  if (container_root_path(id, root, sizeof(root)) != 0 || !path_exists(root)) {
+    fprintf(stderr, "[ERR] Container not found: %s\n", id);
+    return 1;
+  }
+
+  if (load_container_state(id, &st) == 0 && container_live(&st)) {
+    fprintf(stderr, "[ERR] Container %s is running; stop it first\n", id);
+    return 1;
+  }
+
+  snprintf(merged, sizeof(merged), "%s/merged", root);
+  umount2(merged, MNT_DETACH);
+  cgroup_remove(id);
+
+  if (remove_recursive(root) != 0) {
+    fprintf(stderr, "[ERR] Failed to remove container %s\n", id);
+    return 1;
+  }
+
+  printf("%s\n", id);
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __CONTAINER_STORE_H__
+#define __CONTAINER_STORE_H__
+
+#include <sys/types.h>
+
+#ifndef CONTAINER_STOP_TIMEOUT_MS
+#define CONTAINER_STOP_TIMEOUT_MS 10000
+#endif
+
+enum container_status {
+  CONTAINER_CREATED = 0,
+  CONTAINER_RUNNING = 1,
+  CONTAINER_EXITED = 2,
+  CONTAINER_FAILED = 3,
+};
+
+/*
+ * State of a detached container, kept in ZOCKER_CONTAINERS_DIR/<id>/state.
+ * Only its shim writes it once the container has been created. pid is the
+ * container's init as seen from the host.
+ */
+struct container_state {
+  char id[64];
+  char image[4096];
+  char command[1024];
+  enum container_status status;
+  pid_t pid;
+  pid_t shim_pid;
+  int exit_code;
+  long started_at;
+  long finished_at;
+  /* Placement, for exec and the NUMA allocator; numa_node is -1 if unplaced. */
+  int numa_node;
+  char cpuset_cpus[256];
+  char cpuset_mems[256];
+};
+
+int save_container_state(const struct container_state *st);
+int load_container_state(const char *id, struct container_state *st);
+
+/* A container counts as live while its shim is around to record its exit. */
+int container_live(const struct container_state *st);
+
+int list_containers(void);
+int stop_container(const char *id);
+int wait_container(const char *id);
+int remove_container(const char *id);
+
+#endif
@@ -0,0 +1,489 @@
+#define _GNU_SOURCE
+
+#include "download.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "setup.h"
+#include "utils.h"
+
+#define DOWNLOAD_BODY "download.bin"
+#define DOWNLOAD_BLOBS ZOCKER_DOWNLOADS_DIR "/blobs"
+#define DOWNLOAD_STORE_LOCK ZOCKER_DOWNLOADS_DIR "/lock"
+
+struct download_meta {
+  char url[2048];
+  char etag[256];
+  char last_modified[128];
+  char sha256[65];
+};
+
+int download_checksum_valid(const char *checksum) {
+  size_t i;
+
+  if (checksum == NULL || !starts_with(checksum, "sha256:")) {
+    return 0;
+  }
+
+  checksum += 7;
+  for (i = 0; checksum[i] != '\0'; i++) {
+    if (!isxdigit((unsigned char)checksum[i])) {
+      return 0;
+    }
+  }
+
+  return i == 64;
+}
+
+static int read_download_meta(const char *path, struct download_meta *meta) {
+  char line[4096];
+  FILE *fp;
+
+  memset(meta, 0, sizeof(*meta));
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *eq = strchr(line, '=');
+
+    if (eq == NULL) {
+      continue;
+    }
+    *eq = '\0';
+    eq[1 + strcspn(eq + 1, "\r\n")] = '\0';
+
+    if (strcmp(line, "url") == 0) {
+      snprintf(meta->url, sizeof(meta->url), "%s", eq + 1);
+    } else if (strcmp(line, "etag") == 0) {
+      snprintf(meta->etag, sizeof(meta->etag), "%s", eq + 1);
+    } else if (strcmp(line, "last_modified") == 0) {
+      snprintf(meta->last_modified, sizeof(meta->last_modified), "%s", eq + 1);
+    } else if (strcmp(line, "sha256") == 0) {
+      snprintf(meta->sha256, sizeof(meta->sha256), "%s", eq + 1);
+    }
+  }
+
+  fclose(fp);
+  return meta->sha256[0] == '\0';
+}
+
+static int write_download_meta(const char *path, const struct download_meta *meta) {
+  char tmp[PATH_MAX];
+  FILE *fp;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fp = fopen(tmp, "w");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  fprintf(fp, "url=%s\n", meta->url);
+  fprintf(fp, "etag=%s\n", meta->etag);
+  fprintf(fp, "last_modified=%s\n", meta->last_modified);
+  fprintf(fp, "sha256=%s\n", meta->sha256);
+  fprintf(fp, "fetched_at=%ld\n", (long)time(NULL));
+
+  if (fclose(fp) != 0) {
+    unlink(tmp);
+    return 1;
+  }
+
+  return rename(tmp, path) != 0;
+}
+
+/*
+ * Reads the status and validators of the last response in a curl -D dump;
+ * earlier blocks belong to redirects.
+ */
+static int parse_response_headers(const char *path, int *status, struct download_meta *meta) {
+  char line[4096];
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  *status = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *value;
+
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (starts_with(line, "HTTP/")) {
+      const char *code = strchr(line, ' ');
+
+      *status = code == NULL ? 0 : atoi(code + 1);
+      meta->etag[0] = '\0';
+      meta->last_modified[0] = '\0';
+      continue;
+    }
+
+    value = strchr(line, ':');
+    if (value == NULL) {
+      continue;
+    }
+    *value++ = '\0';
+    value = trim_whitespace(value);
+
+    if (strcasecmp(line, "ETag") == 0) {
+      snprintf(meta->etag, sizeof(meta->etag), "%s", value);
+    } else if (strcasecmp(line, "Last-Modified") == 0) {
+      snprintf(meta->last_modified, sizeof(meta->last_modified), "%s", value);
+    }
+  }
+
+  fclose(fp);
+  return *status == 0;
+}
+
+static int run_curl(const char *url, const struct download_meta *cached, const char *headers,
+                    const char *body) {
+  char if_none_match[300];
+  char if_modified_since[160];
+  const char *argv[16];
+  int argc = 0;
+  pid_t pid;
+  int status;
+
+  argv[argc++] = "curl";
+  argv[argc++] = "-fsSL";
+  argv[argc++] = "-D";
+  argv[argc++] = headers;
+  argv[argc++] = "-o";
+  argv[argc++] = body;
+
+  if (cached != NULL && cached->etag[0] != '\0') {
+    snprintf(if_none_match, sizeof(if_none_match), "If-None-Match: %s", cached->etag);
+    argv[argc++] = "-H";
+    argv[argc++] = if_none_match;
+  }
+  if (cached != NULL && cached->last_modified[0] != '\0') {
+    snprintf(if_modified_since, sizeof(if_modified_since), "If-Modified-Since: %s",
+             cached->last_modified);
+    argv[argc++] = "-H";
+    argv[argc++] = if_modified_since;
+  }
+
+  argv[argc++] = url;
+  argv[argc] = NULL;
+
+  pid = fork();
+  if (pid < 0) {
+    return 1;
+  }
+
+  if (pid == 0) {
+    execvp("curl", (char *const *)argv);
+    _exit(127);
+  }
+
+  if (waitpid(pid, &status, 0) < 0) {
+    return 1;
+  }
+
+  return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+static int lock_file(const char *path, int op) {
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  while (flock(fd, op) != 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  return fd;
+}
+
+static int lock_entry(const char *entry_dir) {
+  char path[PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/lock", entry_dir);
+  return lock_file(path, LOCK_EX);
+}
+
+static void blob_path(const char *sha256, char *out, size_t out_size) {
+  snprintf(out, out_size, "%s/%s/%s", DOWNLOAD_BLOBS, sha256, DOWNLOAD_BODY);
+}
+
+/*
+ * Moves a verified body to blobs/<sha256>/ unless that blob already exists; an
+ * existing blob holds the same bytes and is never replaced.
+ */
+static int store_blob(const char *body_tmp, const char *sha256) {
+  char stage[PATH_MAX];
+  char staged_body[PATH_MAX];
+  char blob_dir[PATH_MAX];
+  char blob[PATH_MAX];
+
+  blob_path(sha256, blob, sizeof(blob));
+  if (path_exists(blob)) {
+    unlink(body_tmp);
+    return 0;
+  }
+
+  if (mkdir(DOWNLOAD_BLOBS, 0755) != 0 && errno != EEXIST) {
+    return 1;
+  }
+
+  snprintf(stage, sizeof(stage), "%s/.tmp-%s-%ld", DOWNLOAD_BLOBS, sha256, (long)getpid());
+  snprintf(staged_body, sizeof(staged_body), "%s/%s", stage, DOWNLOAD_BODY);
+  snprintf(blob_dir, sizeof(blob_dir), "%s/%s", DOWNLOAD_BLOBS, sha256);
+  remove_recursive(stage);
+
+  if (mkdir(stage, 0755) != 0 || rename(body_tmp, staged_body) != 0) {
+    remove_recursive(stage);
+    return 1;
+  }
+
+  /* Losing the race to another writer of the same digest is fine. */
+  if (rename(stage, blob_dir) != 0) {
+    remove_recursive(stage);
+    return path_exists(blob) ? 0 : 1;
+  }
+
+  return 0;
+}
+
+/* Downloads url for the locked entry, pointing it at a new blob on a 200. */
+static int refresh_entry(const char *url, const char *entry_dir, const char *want,
+                         struct download_meta *meta, int have_cached) {
+  char headers[PATH_MAX];
+  char body_tmp[PATH_MAX];
+  char meta_path[PATH_MAX];
+  struct download_meta fresh;
+  int status = 0;
+
+  snprintf(headers, sizeof(headers), "%s/headers.tmp", entry_dir);
+  snprintf(body_tmp, sizeof(body_tmp), "%s/%s.tmp", entry_dir, DOWNLOAD_BODY);
+  snprintf(meta_path, sizeof(meta_path), "%s/meta", entry_dir);
+  unlink(body_tmp);
+
+  memset(&fresh, 0, sizeof(fresh));
+  snprintf(fresh.url, sizeof(fresh.url), "%s", url);
+
+  if (run_curl(url, have_cached ? meta : NULL, headers, body_tmp) != 0 ||
+      parse_response_headers(headers, &status, &fresh) != 0) {
+    unlink(headers);
+    unlink(body_tmp);
+    if (have_cached && want == NULL) {
+      fprintf(stderr, "[WARN] Could not revalidate %s, using the cached copy\n", url);
+      return 0;
+    }
+    fprintf(stderr, "[ERR] Failed to download %s\n", url);
+    return 1;
+  }
+  unlink(headers);
+
+  if (status == 304 && have_cached) {
+    unlink(body_tmp);
+    return 0;
+  }
+
+  if (sha256_file(body_tmp, fresh.sha256) != 0) {
+    unlink(body_tmp);
+    return 1;
+  }
+
+  if (want != NULL && strcasecmp(fresh.sha256, want) != 0) {
+    fprintf(stderr, "[ERR] Checksum mismatch for %s: expected sha256:%s, got sha256:%s\n", url,
+            want, fresh.sha256);
+    unlink(body_tmp);
+    return 1;
+  }
+
+  if (store_blob(body_tmp, fresh.sha256) != 0 ||
+      write_download_meta(meta_path, &fresh) != 0) {
+    unlink(body_tmp);
+    return 1;
+  }
+
+  printf("[FETCH] %s\n", url);
+  *meta = fresh;
+  return 0;
+}
+
+int download_fetch(const char *url, const char *checksum, int offline, struct download *out) {
+  char key[17];
+  char entry_dir[PATH_MAX];
+  char meta_path[PATH_MAX];
+  struct download_meta meta;
+  const char *want = NULL;
+  int have_cached;
+  int store_fd;
+  int lock_fd;
+  int rc = 0;
+
+  if (url == NULL || out == NULL || hash_string(url, key) != 0) {
+    return 1;
+  }
+
+  if (checksum != NULL && checksum[0] != '\0') {
+    if (!download_checksum_valid(checksum)) {
+      fprintf(stderr, "[ERR] Unsupported checksum '%s' (use sha256:<hex>)\n", checksum);
+      return 1;
+    }
+    want = checksum + 7;
+  }
+
+  snprintf(entry_dir, sizeof(entry_dir), "%s/%s", ZOCKER_DOWNLOADS_DIR, key);
+  snprintf(meta_path, sizeof(meta_path), "%s/meta", entry_dir);
+
+  if (mkdir(entry_dir, 0755) != 0 && errno != EEXIST) {
+    return 1;
+  }
+
+  /* Shared, so fetches only exclude download_prune, not each other. */
+  store_fd = lock_file(DOWNLOAD_STORE_LOCK, LOCK_SH);
+  if (store_fd < 0) {
+    return 1;
+  }
+
+  lock_fd = lock_entry(entry_dir);
+  if (lock_fd < 0) {
+    close(store_fd);
+    return 1;
+  }
+
+  have_cached = read_download_meta(meta_path, &meta) == 0 && strcmp(meta.url, url) == 0;
+  if (have_cached) {
+    blob_path(meta.sha256, out->path, sizeof(out->path));
+    have_cached = path_exists(out->path);
+  }
+  if (!have_cached) {
+    memset(&meta, 0, sizeof(meta));
+  }
+
+  if (want != NULL && have_cached && strcasecmp(meta.sha256, want) == 0) {
+    rc = 0;
+  } else if (offline) {
+    rc = have_cached && want == NULL ? 0 : 1;
+  } else {
+    /* A pinned checksum the cached body fails is a stale entry: fetch it whole. */
+    rc = refresh_entry(url, entry_dir, want, &meta, have_cached && want == NULL);
+  }
+
+  if (rc == 0) {
+    snprintf(out->sha256, sizeof(out->sha256), "%s", meta.sha256);
+    blob_path(meta.sha256, out->path, sizeof(out->path));
+  }
+
+  close(lock_fd);
+  close(store_fd);
+  return rc;
+}
+
+struct blob_ref {
+  char sha256[65];
+};
+
+/* The blob every cache entry points at; *count is set to how many. */
+static struct blob_ref *referenced_blobs(int *count) {
+  struct blob_ref *refs = NULL;
+  struct dirent *ent;
+  DIR *dir;
+
+  *count = 0;
+  dir = opendir(ZOCKER_DOWNLOADS_DIR);
+  if (dir == NULL) {
+    return NULL;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    char meta_path[PATH_MAX];
+    struct download_meta meta;
+    struct blob_ref *grown;
+
+    if (ent->d_name[0] == '.' || strcmp(ent->d_name, "blobs") == 0) {
+      continue;
+    }
+
+    snprintf(meta_path, sizeof(meta_path), "%s/%s/meta", ZOCKER_DOWNLOADS_DIR, ent->d_name);
+    if (read_download_meta(meta_path, &meta) != 0) {
+      continue;
+    }
+
+    grown = realloc(refs, sizeof(*refs) * (size_t)(*count + 1));
+    if (grown == NULL) {
+      break;
+    }
+    refs = grown;
+    snprintf(refs[(*count)++].sha256, sizeof(refs[0].sha256), "%s", meta.sha256);
+  }
+
+  closedir(dir);
+  return refs;
+}
+
+int download_prune(void) {
+  struct blob_ref *refs;
+  struct dirent *ent;
+  DIR *dir;
+  int removed = 0;
+  int store_fd;
+  int count;
+
+  dir = opendir(DOWNLOAD_BLOBS);
+  if (dir == NULL) {
+    return 0;
+  }
+
+  store_fd = lock_file(DOWNLOAD_STORE_LOCK, LOCK_EX);
+  if (store_fd < 0) {
+    closedir(dir);
+    return 0;
+  }
+
+  refs = referenced_blobs(&count);
+  while ((ent = readdir(dir)) != NULL) {
+    char blob_dir[PATH_MAX];
+    int used = 0;
+    int i;
+
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+
+    snprintf(blob_dir, sizeof(blob_dir), "%s/%s", DOWNLOAD_BLOBS, ent->d_name);
+
+    /* No fetch is running, so every staging directory is left over. */
+    if (starts_with(ent->d_name, ".tmp-")) {
+      remove_recursive(blob_dir);
+      continue;
+    }
+
+    for (i = 0; i < count && !used; i++) {
+      used = strcasecmp(refs[i].sha256, ent->d_name) == 0;
+    }
+    if (!used && remove_recursive(blob_dir) == 0) {
+      removed++;
+    }
+  }
+
+  free(refs);
+  closedir(dir);
+  close(store_fd);
+  return removed;
+}
@@ -0,0 +1,37 @@
+#ifndef __DOWNLOAD_H__
+#define __DOWNLOAD_H__
+
+#include <stddef.h>
+
+/*
+ * ADD <url> artifacts are cached under ZOCKER_DOWNLOADS_DIR, one entry per URL
+ * holding the sha256 of its body and the validators the server sent. Entries
+ * are locked with flock while they are fetched, so concurrent builds wait for
+ * one download instead of each starting their own. Bodies live apart from the
+ * entries, in blobs/<sha256>/, written once and never modified, so a path
+ * handed out stays valid after the entry is refreshed.
+ */
+struct download {
+  char path[4096];
+  char sha256[65];
+};
+
+/*
+ * Returns the cached artifact for url, revalidating it with If-None-Match /
+ * If-Modified-Since first. checksum ("sha256:<hex>") may be NULL or empty;
+ * when it is set, a cached body that matches is used without touching the
+ * network and a fresh body that does not match is an error. With offline set
+ * the cache is never refreshed and a missing entry is an error.
+ */
+int download_fetch(const char *url, const char *checksum, int offline, struct download *out);
+
+int download_checksum_valid(const char *checksum);
+
+/*
+ * Removes blobs no cache entry points at any more, and staging directories
+ * left behind by interrupted downloads. Waits for running fetches to finish
+ * first. Returns how many blobs were removed.
+ */
+int download_prune(void);
+
+#endif
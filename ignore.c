@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+
+#include "ignore.h"
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IGNORE_MAX_DEPTH 256
+
+static int has_wildcard(const char *s) { return strpbrk(s, "*?[\\") != NULL; }
+
+static void free_pattern(struct ignore_pattern *p) {
+  int i;
+
+  for (i = 0; i < p->segment_count; i++) {
+    free(p->segments[i]);
+  }
+  free(p->segments);
+}
+
+/*
+ * Compiles one gitignore-style line: "!" negates, a trailing "/" matches
+ * directories only, and any other "/" anchors the pattern to the context root.
+ * Unanchored patterns only ever see the entry's basename.
+ */
+static int compile_pattern(const char *line, struct ignore_pattern *out) {
+  char buf[PATH_MAX];
+  char *saveptr = NULL;
+  char *token;
+  char *p = buf;
+  size_t len;
+
+  memset(out, 0, sizeof(*out));
+  snprintf(buf, sizeof(buf), "%s", line);
+
+  if (p[0] == '!') {
+    out->negate = 1;
+    p++;
+  } else if (p[0] == '\\' && (p[1] == '!' || p[1] == '#')) {
+    p++;
+  }
+
+  len = strlen(p);
+  while (len > 0 && p[len - 1] == '/') {
+    out->dir_only = 1;
+    p[--len] = '\0';
+  }
+
+  if (len == 0) {
+    return 1;
+  }
+
+  if (strchr(p, '/') != NULL) {
+    out->anchored = 1;
+  }
+
+  while (p[0] == '/') {
+    p++;
+  }
+
+  out->literal = 1;
+  for (token = strtok_r(p, "/", &saveptr); token != NULL;
+       token = strtok_r(NULL, "/", &saveptr)) {
+    char **segments = realloc(out->segments, sizeof(char *) * (out->segment_count + 1));
+
+    if (segments == NULL) {
+      free_pattern(out);
+      return 1;
+    }
+    out->segments = segments;
+
+    out->segments[out->segment_count] = strdup(token);
+    if (out->segments[out->segment_count] == NULL) {
+      free_pattern(out);
+      return 1;
+    }
+    out->segment_count++;
+
+    if (has_wildcard(token)) {
+      out->literal = 0;
+    }
+  }
+
+  return out->segment_count == 0;
+}
+
+static int add_pattern(struct ignore_rules *rules, const struct ignore_pattern *p) {
+  if (rules->count == rules->cap) {
+    int new_cap = rules->cap == 0 ? 16 : rules->cap * 2;
+    struct ignore_pattern *patterns = realloc(rules->patterns, sizeof(*patterns) * new_cap);
+
+    if (patterns == NULL) {
+      return 1;
+    }
+    rules->patterns = patterns;
+    rules->cap = new_cap;
+  }
+
+  rules->patterns[rules->count++] = *p;
+  return 0;
+}
+
+static int match_segment(const char *pattern, const char *name, int literal) {
+  if (literal) {
+    return strcmp(pattern, name) == 0;
+  }
+  return fnmatch(pattern, name, 0) == 0;
+}
+
+/* "**" matches zero or more whole path segments. */
+static int match_segments(const struct ignore_pattern *p, int pi, char **parts, int n) {
+  if (pi == p->segment_count) {
+    return n == 0;
+  }
+
+  if (strcmp(p->segments[pi], "**") == 0) {
+    int k;
+
+    for (k = 0; k <= n; k++) {
+      if (match_segments(p, pi + 1, parts + k, n - k)) {
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  if (n == 0 || !match_segment(p->segments[pi], parts[0], p->literal)) {
+    return 0;
+  }
+
+  return match_segments(p, pi + 1, parts + 1, n - 1);
+}
+
+static int skip_ignored(const char *rel, int is_dir, void *ctx) {
+  return ignore_match((const struct ignore_rules *)ctx, rel, is_dir);
+}
+
+/*
+ * Loads <context_dir>/.zockerignore. A missing file is not an error and
+ * leaves an empty rule set.
+ */
+int ignore_load(const char *context_dir, struct ignore_rules *out) {
+  char path[PATH_MAX];
+  char *line = NULL;
+  size_t line_cap = 0;
+  FILE *fp;
+
+  memset(out, 0, sizeof(*out));
+  out->filter.skip = skip_ignored;
+  out->filter.ctx = out;
+
+  if (realpath(context_dir, out->filter.root) == NULL) {
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", out->filter.root, ZOCKER_IGNORE_FILE);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return errno == ENOENT ? 0 : 1;
+  }
+
+  while (getline(&line, &line_cap, fp) != -1) {
+    struct ignore_pattern pattern;
+    char *trimmed = trim_whitespace(line);
+
+    if (trimmed[0] == '\0' || trimmed[0] == '#') {
+      continue;
+    }
+
+    if (compile_pattern(trimmed, &pattern) != 0) {
+      continue;
+    }
+
+    if (add_pattern(out, &pattern) != 0) {
+      free_pattern(&pattern);
+      free(line);
+      fclose(fp);
+      ignore_free(out);
+      return 1;
+    }
+  }
+
+  free(line);
+  fclose(fp);
+  return 0;
+}
+
+/*
+ * Returns 1 if rel (relative to the context root) is excluded. As in
+ * gitignore, the last matching pattern wins. Callers prune excluded
+ * directories, so a file below one can never be re-included.
+ */
+int ignore_match(const struct ignore_rules *rules, const char *rel, int is_dir) {
+  char buf[PATH_MAX];
+  char *parts[IGNORE_MAX_DEPTH];
+  char *saveptr = NULL;
+  char *token;
+  const char *base;
+  int n = 0;
+  int excluded = 0;
+  int i;
+
+  if (rules == NULL || rules->count == 0 || rel == NULL || rel[0] == '\0') {
+    return 0;
+  }
+
+  base = strrchr(rel, '/');
+  base = base == NULL ? rel : base + 1;
+
+  snprintf(buf, sizeof(buf), "%s", rel);
+  for (token = strtok_r(buf, "/", &saveptr); token != NULL && n < IGNORE_MAX_DEPTH;
+       token = strtok_r(NULL, "/", &saveptr)) {
+    parts[n++] = token;
+  }
+
+  for (i = rules->count - 1; i >= 0; i--) {
+    const struct ignore_pattern *p = &rules->patterns[i];
+    int matched;
+
+    if (p->dir_only && !is_dir) {
+      continue;
+    }
+
+    if (!p->anchored) {
+      matched = match_segment(p->segments[0], base, p->literal);
+    } else {
+      matched = match_segments(p, 0, parts, n);
+    }
+
+    if (matched) {
+      excluded = !p->negate;
+      break;
+    }
+  }
+
+  return excluded;
+}
+
+void ignore_free(struct ignore_rules *rules) {
+  int i;
+
+  if (rules == NULL) {
+    return;
+  }
+
+  for (i = 0; i < rules->count; i++) {
+    free_pattern(&rules->patterns[i]);
+  }
+  free(rules->patterns);
+  rules->patterns = NULL;
+  rules->count = 0;
+  rules->cap = 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __IGNORE_H__
+#define __IGNORE_H__
+
+#include "utils.h"
+
+#ifndef ZOCKER_IGNORE_FILE
+#define ZOCKER_IGNORE_FILE ".zockerignore"
+#endif
+
+struct ignore_pattern {
+  char **segments;
+  int segment_count;
+  int negate;
+  int dir_only;
+  int anchored;
+  int literal;
+};
+
+/*
+ * Compiled .zockerignore rules for one build context. filter is ready to pass
+ * to the filtered hash/copy walks.
+ */
+struct ignore_rules {
+  struct ignore_pattern *patterns;
+  int count;
+  int cap;
+  struct path_filter filter;
+};
+
+int ignore_load(const char *context_dir, struct ignore_rules *out);
+int ignore_match(const struct ignore_rules *rules, const char *rel, int is_dir);
+void ignore_free(struct ignore_rules *rules);
+
+#endif
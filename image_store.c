@@ -10,9 +10,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/xattr.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "download.h"
 #include "setup.h"
 #include "utils.h"
 
@@ -151,6 +153,8 @@ static int load_image_meta_from_path(const char *path, struct image_meta *meta)
       snprintf(meta->ref, sizeof(meta->ref), "%s", value);
     } else if (strcmp(key, "top_layer") == 0) {
       snprintf(meta->top_layer, sizeof(meta->top_layer), "%s", value);
+    } else if (strcmp(key, "base_layer") == 0) {
+      snprintf(meta->base_layer, sizeof(meta->base_layer), "%s", value);
     } else if (strcmp(key, "created_at") == 0) {
       snprintf(meta->created_at, sizeof(meta->created_at), "%s", value);
     } else if (strcmp(key, "cmd") == 0) {
@@ -210,6 +214,9 @@ int save_image_meta(const struct image_meta *meta) {
   fprintf(fp, "tag=%s\n", tag);
   fprintf(fp, "ref=%s:%s\n", name, tag);
   fprintf(fp, "top_layer=%s\n", meta->top_layer);
+  if (meta->base_layer[0] != '\0') {
+    fprintf(fp, "base_layer=%s\n", meta->base_layer);
+  }
   fprintf(fp, "created_at=%s\n", created_at);
   fprintf(fp, "cmd=%s\n", meta->cmd);
 
@@ -244,6 +251,138 @@ int layer_exists(const char *layer_id) {
   return is_directory(path);
 }
 
+int publish_layer_link(const char *layer_id) {
+  char link_path[PATH_MAX];
+  char short_id[64];
+  char symlink_path[PATH_MAX];
+  char symlink_target[PATH_MAX];
+  size_t i;
+  size_t w = 0;
+  FILE *fp;
+
+  if (layer_id == NULL || layer_id[0] == '\0') {
+    return 1;
+  }
+
+  for (i = 0; layer_id[i] != '\0' && w + 1 < sizeof(short_id); i++) {
+    if (layer_id[i] != '-') {
+      short_id[w++] = layer_id[i];
+      if (w >= 26) break;
+    }
+  }
+  short_id[w] = '\0';
+
+  snprintf(link_path, sizeof(link_path), "%s/%s/link", ZOCKER_LAYERS_DIR, layer_id);
+  fp = fopen(link_path, "w");
+  if (fp == NULL) {
+    return 1;
+  }
+  fprintf(fp, "%s\n", short_id);
+  fclose(fp);
+
+  snprintf(symlink_path, sizeof(symlink_path), "%s/%s", ZOCKER_LAYER_LINKS_DIR,
+           short_id);
+  snprintf(symlink_target, sizeof(symlink_target), "../%s/diff", layer_id);
+  unlink(symlink_path);
+  return symlink(symlink_target, symlink_path) != 0;
+}
+
+/*
+ * Layers are addressed by the SHA-256 of their parent chain and diff digest, so
+ * two builds that commit the same bytes on the same parent share one layer.
+ * The FNV diff_hash is only a cache-key hint and never names a layer.
+ */
+int compute_layer_digest(const char *parent_chain, const char *diff_digest,
+                         char out_digest[LAYER_DIGEST_HEX + 1]) {
+  char raw[16384];
+  char full[65];
+  int n = snprintf(raw, sizeof(raw), "LAYER|%s|%s", parent_chain, diff_digest);
+
+  if (n < 0 || (size_t)n >= sizeof(raw) || diff_digest[0] == '\0' ||
+      sha256_string(raw, full) != 0) {
+    return 1;
+  }
+
+  snprintf(out_digest, LAYER_DIGEST_HEX + 1, "%.*s", LAYER_DIGEST_HEX, full);
+  return 0;
+}
+
+/*
+ * Moves a freshly built layer from its staging directory to its digest. If a
+ * layer with that digest already exists the staging copy is dropped and
+ * *collapsed is set, leaving the existing layer and its metadata in place.
+ */
+int commit_layer_dir(const char *staging_root, const char *digest, int *collapsed) {
+  char layer_root[PATH_MAX];
+
+  *collapsed = 0;
+  snprintf(layer_root, sizeof(layer_root), "%s/%s", ZOCKER_LAYERS_DIR, digest);
+
+  if (!layer_exists(digest)) {
+    if (rename(staging_root, layer_root) == 0) {
+      return publish_layer_link(digest);
+    }
+
+    if (errno != EEXIST && errno != ENOTEMPTY) {
+      fprintf(stderr, "[ERR] Failed to commit layer %s: %s\n", digest, strerror(errno));
+      return 1;
+    }
+  }
+
+  *collapsed = 1;
+  remove_recursive(staging_root);
+  return publish_layer_link(digest);
+}
+
+/*
+ * Creates a layer record that reuses another layer's diff: its diff is a
+ * symlink to diff_layer's diff and its lower is parent_chain. Used for COPY
+ * --link splices and rebases; the record's digest is the one a regular layer
+ * with the same bytes on the same parent would get.
+ */
+int create_splice_layer(const char *parent_chain, const char *diff_layer,
+                        const char *diff_digest, char layer_id[LAYER_DIGEST_HEX + 1],
+                        int *collapsed) {
+  char staging_id[64];
+  char layer_root[PATH_MAX];
+  char path[PATH_MAX];
+  char target[PATH_MAX];
+  FILE *fp;
+
+  if (generate_uuid(staging_id) != 0) {
+    return 1;
+  }
+
+  snprintf(layer_root, sizeof(layer_root), "%s/%s", ZOCKER_LAYERS_DIR, staging_id);
+  if (mkdir(layer_root, 0755) != 0) {
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/diff", layer_root);
+  snprintf(target, sizeof(target), "../%s/diff", diff_layer);
+  if (symlink(target, path) != 0) {
+    remove_recursive(layer_root);
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/lower", layer_root);
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    remove_recursive(layer_root);
+    return 1;
+  }
+  fprintf(fp, "%s\n", parent_chain);
+  fclose(fp);
+
+  if (compute_layer_digest(parent_chain, diff_digest, layer_id) != 0 ||
+      commit_layer_dir(layer_root, layer_id, collapsed) != 0) {
+    remove_recursive(layer_root);
+    return 1;
+  }
+
+  return 0;
+}
+
 static int read_layer_link(const char *layer_id, char *out_link, size_t out_link_size) {
   char link_path[PATH_MAX];
   FILE *fp;
@@ -518,6 +657,54 @@ int lookup_layer_cache(const char *hash, char *layer_id, size_t layer_id_size) {
   return 0;
 }
 
+/*
+ * Step durations are kept per descriptor, independent of the parent state, so
+ * a step that misses the cache can still be costed from its previous runs.
+ */
+int record_step_duration(const char *step_key, long duration_ms) {
+  char path[PATH_MAX];
+  FILE *fp;
+
+  if (step_key == NULL || step_key[0] == '\0' || duration_ms < 0) {
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", ZOCKER_TIMINGS_DIR, step_key);
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  fprintf(fp, "%ld\n", duration_ms);
+  fclose(fp);
+  return 0;
+}
+
+int lookup_step_duration(const char *step_key, long *duration_ms) {
+  char path[PATH_MAX];
+  char line[64];
+  FILE *fp;
+
+  if (step_key == NULL || duration_ms == NULL) {
+    return 1;
+  }
+
+  snprintf(path, sizeof(path), "%s/%s", ZOCKER_TIMINGS_DIR, step_key);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 1;
+  }
+
+  if (fgets(line, sizeof(line), fp) == NULL) {
+    fclose(fp);
+    return 1;
+  }
+
+  fclose(fp);
+  *duration_ms = strtol(line, NULL, 10);
+  return 0;
+}
+
 int write_layer_metadata(const struct layer_meta *meta) {
   char path[PATH_MAX];
   FILE *fp;
@@ -535,7 +722,15 @@ int write_layer_metadata(const struct layer_meta *meta) {
   fprintf(fp, "id=%s\n", meta->id);
   fprintf(fp, "parent=%s\n", meta->parent);
   fprintf(fp, "hash=%s\n", meta->hash);
+  fprintf(fp, "diff_hash=%s\n", meta->diff_hash);
+  if (meta->diff_digest[0] != '\0') {
+    fprintf(fp, "diff_digest=%s\n", meta->diff_digest);
+  }
+  if (meta->diff_layer[0] != '\0') {
+    fprintf(fp, "diff_layer=%s\n", meta->diff_layer);
+  }
   fprintf(fp, "created_at=%ld\n", meta->created_at);
+  fprintf(fp, "duration_ms=%ld\n", meta->duration_ms);
   fprintf(fp, "size=%llu\n", meta->size);
   fprintf(fp, "instruction=%s\n", meta->instruction);
   fprintf(fp, "workdir=%s\n", meta->workdir);
@@ -580,8 +775,16 @@ int read_layer_metadata(const char *layer_id, struct layer_meta *meta) {
       snprintf(meta->parent, sizeof(meta->parent), "%s", value);
     } else if (strcmp(key, "hash") == 0) {
       snprintf(meta->hash, sizeof(meta->hash), "%s", value);
+    } else if (strcmp(key, "diff_hash") == 0) {
+      snprintf(meta->diff_hash, sizeof(meta->diff_hash), "%s", value);
+    } else if (strcmp(key, "diff_digest") == 0) {
+      snprintf(meta->diff_digest, sizeof(meta->diff_digest), "%s", value);
+    } else if (strcmp(key, "diff_layer") == 0) {
+      snprintf(meta->diff_layer, sizeof(meta->diff_layer), "%s", value);
     } else if (strcmp(key, "created_at") == 0) {
       meta->created_at = strtol(value, NULL, 10);
+    } else if (strcmp(key, "duration_ms") == 0) {
+      meta->duration_ms = strtol(value, NULL, 10);
     } else if (strcmp(key, "size") == 0) {
       meta->size = strtoull(value, NULL, 10);
     } else if (strcmp(key, "instruction") == 0) {
@@ -710,6 +913,144 @@ int remove_image_ref(const char *ref) {
   return 0;
 }
 
+/*
+ * Replays the image's own layers onto a new base. Every new record reuses the
+ * existing diff (directly, or through the splice source it already pointed
+ * at), so nothing is copied. The walk stops at the first layer without a
+ * parent, or at the base layer: old_base's top layer when given, otherwise
+ * the one recorded in the image. Images without a recorded base need
+ * old_base, since their parents may run on into the base's own layers. The
+ * replaced records are left in place for prune.
+ */
+int rebase_image(const char *ref, const char *onto, const char *old_base) {
+  struct image_meta image;
+  struct image_meta base;
+  struct layer_meta *layers = NULL;
+  char stop_at[64] = "";
+  char current[64];
+  char chain[16384];
+  char parent[64] = "-";
+  char top[LAYER_DIGEST_HEX + 1] = "";
+  int count = 0;
+  int rc = 1;
+  int i;
+
+  if (load_image_meta(ref, &image) != 0) {
+    fprintf(stderr, "[ERR] Image not found: %s\n", ref);
+    return 1;
+  }
+
+  if (old_base != NULL && old_base[0] != '\0') {
+    if (load_image_meta(old_base, &base) != 0 || base.top_layer[0] == '\0') {
+      fprintf(stderr, "[ERR] Image not found: %s\n", old_base);
+      return 1;
+    }
+    snprintf(stop_at, sizeof(stop_at), "%s", base.top_layer);
+  } else if (image.base_layer[0] != '\0') {
+    snprintf(stop_at, sizeof(stop_at), "%s", image.base_layer);
+  } else {
+    fprintf(stderr, "[ERR] %s has no recorded base image; pass --from <old-base>\n", ref);
+    return 1;
+  }
+
+  snprintf(current, sizeof(current), "%s", image.top_layer);
+  while (current[0] != '\0' && strcmp(current, "-") != 0 && strcmp(current, stop_at) != 0) {
+    struct layer_meta *new_layers = realloc(layers, sizeof(*layers) * (count + 1));
+
+    if (new_layers == NULL) {
+      goto out;
+    }
+    layers = new_layers;
+
+    if (read_layer_metadata(current, &layers[count]) != 0) {
+      fprintf(stderr, "[ERR] Missing metadata for layer %s\n", current);
+      goto out;
+    }
+
+    snprintf(current, sizeof(current), "%s", layers[count].parent);
+    count++;
+  }
+
+  if (count == 0) {
+    fprintf(stderr, "[ERR] %s has no layers of its own to rebase\n", ref);
+    goto out;
+  }
+
+  if (resolve_base_chain(onto, chain, sizeof(chain)) != 0) {
+    fprintf(stderr, "[ERR] Failed to resolve base image/path: %s\n", onto);
+    goto out;
+  }
+
+  if (load_image_meta(onto, &base) == 0 && base.top_layer[0] != '\0') {
+    snprintf(parent, sizeof(parent), "%s", base.top_layer);
+  }
+  snprintf(image.base_layer, sizeof(image.base_layer), "%s", parent);
+
+  for (i = count - 1; i >= 0; i--) {
+    const struct layer_meta *old = &layers[i];
+    const char *owner = old->diff_layer[0] != '\0' ? old->diff_layer : old->id;
+    char diff_hash[17];
+    char diff_digest[65];
+    int collapsed = 0;
+
+    if (old->diff_hash[0] != '\0' && old->diff_digest[0] != '\0') {
+      snprintf(diff_hash, sizeof(diff_hash), "%s", old->diff_hash);
+      snprintf(diff_digest, sizeof(diff_digest), "%s", old->diff_digest);
+    } else {
+      char diff_dir[PATH_MAX];
+
+      snprintf(diff_dir, sizeof(diff_dir), "%s/%s/diff", ZOCKER_LAYERS_DIR, owner);
+      if (digest_path_recursive(diff_dir, diff_hash, diff_digest) != 0) {
+        fprintf(stderr, "[ERR] Failed to hash layer %s\n", owner);
+        goto out;
+      }
+    }
+
+    if (create_splice_layer(chain, owner, diff_digest, top, &collapsed) != 0) {
+      fprintf(stderr, "[ERR] Failed to create rebased layer for %s\n", old->id);
+      goto out;
+    }
+
+    if (!collapsed) {
+      struct layer_meta meta;
+
+      memset(&meta, 0, sizeof(meta));
+      snprintf(meta.id, sizeof(meta.id), "%s", top);
+      snprintf(meta.parent, sizeof(meta.parent), "%s", parent);
+      snprintf(meta.hash, sizeof(meta.hash), "-");
+      snprintf(meta.diff_hash, sizeof(meta.diff_hash), "%s", diff_hash);
+      snprintf(meta.diff_digest, sizeof(meta.diff_digest), "%s", diff_digest);
+      snprintf(meta.diff_layer, sizeof(meta.diff_layer), "%s", owner);
+      meta.created_at = (long)time(NULL);
+      meta.size = old->size;
+      snprintf(meta.instruction, sizeof(meta.instruction), "%s", old->instruction);
+      snprintf(meta.workdir, sizeof(meta.workdir), "%s", old->workdir);
+
+      if (write_layer_metadata(&meta) != 0) {
+        goto out;
+      }
+    }
+
+    if (layer_chain_from_top(top, chain, sizeof(chain)) != 0) {
+      goto out;
+    }
+    snprintf(parent, sizeof(parent), "%s", top);
+  }
+
+  snprintf(image.top_layer, sizeof(image.top_layer), "%s", top);
+  image.created_at[0] = '\0';
+  if (save_image_meta(&image) != 0) {
+    goto out;
+  }
+
+  printf("Rebased %s onto %s (%d layers, top layer: %s)\n", image.ref, onto, count, top);
+  rc = 0;
+
+out:
+  free(layers);
+  return rc;
+}
+
 struct str_set {
   char **items;
   size_t count;
@@ -790,6 +1131,11 @@ static int mark_layer_chain_used(const char *top_layer, struct str_set *used) {
       break;
     }
 
+    if (meta.diff_layer[0] != '\0' && !str_set_contains(used, meta.diff_layer) &&
+        str_set_add(used, meta.diff_layer) != 0) {
+      return 1;
+    }
+
     if (meta.parent[0] == '\0' || strcmp(meta.parent, "-") == 0) {
       break;
     }
@@ -877,6 +1223,197 @@ static int cleanup_cache_entries(void) {
   return 0;
 }
 
+static int files_equal(const char *a, const char *b) {
+  FILE *fa;
+  FILE *fb;
+  unsigned char buf_a[8192];
+  unsigned char buf_b[8192];
+  int equal = 1;
+
+  fa = fopen(a, "rb");
+  if (fa == NULL) {
+    return 0;
+  }
+  fb = fopen(b, "rb");
+  if (fb == NULL) {
+    fclose(fa);
+    return 0;
+  }
+
+  while (equal) {
+    size_t na = fread(buf_a, 1, sizeof(buf_a), fa);
+    size_t nb = fread(buf_b, 1, sizeof(buf_b), fb);
+
+    if (na != nb || memcmp(buf_a, buf_b, na) != 0) {
+      equal = 0;
+    }
+    if (na == 0 || nb == 0) {
+      break;
+    }
+  }
+
+  if (ferror(fa) || ferror(fb)) {
+    equal = 0;
+  }
+
+  fclose(fa);
+  fclose(fb);
+  return equal;
+}
+
+/*
+ * Replaces one regular file of a committed layer with a hardlink into the blob
+ * pool. Blob names carry everything a hardlink shares (content, size, mode and
+ * owner), and the link count of a pooled blob is its reference count.
+ */
+static int pool_file(const char *path, const struct stat *st) {
+  char content_hash[65];
+  char bucket[PATH_MAX];
+  char blob[PATH_MAX];
+  char tmp[PATH_MAX];
+  struct stat blob_st;
+
+  /* Files carrying xattrs (capabilities, overlay markers) stay private. */
+  if (llistxattr(path, NULL, 0) > 0) {
+    return 0;
+  }
+
+  if (sha256_file(path, content_hash) != 0) {
+    return 1;
+  }
+
+  snprintf(bucket, sizeof(bucket), "%s/%.2s", ZOCKER_BLOBS_DIR, content_hash);
+  snprintf(blob, sizeof(blob), "%s/%s-%llu-%o-%u-%u", bucket, content_hash,
+           (unsigned long long)st->st_size, (unsigned int)(st->st_mode & 07777),
+           (unsigned int)st->st_uid, (unsigned int)st->st_gid);
+
+  if (ensure_dir_exists(bucket, 0755) != 0 && !is_directory(bucket)) {
+    return 1;
+  }
+
+  if (lstat(blob, &blob_st) != 0) {
+    if (link(path, blob) == 0 || errno == EXDEV) {
+      return 0;
+    }
+    if (errno != EEXIST || lstat(blob, &blob_st) != 0) {
+      return 1;
+    }
+  }
+
+  if (blob_st.st_ino == st->st_ino && blob_st.st_dev == st->st_dev) {
+    return 0;
+  }
+
+  if (!files_equal(blob, path)) {
+    return 0;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.zocker-pool", path);
+  unlink(tmp);
+  if (link(blob, tmp) != 0) {
+    return errno == EXDEV || errno == EMLINK ? 0 : 1;
+  }
+
+  if (rename(tmp, path) != 0) {
+    unlink(tmp);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int pool_dir_files(const char *path) {
+  DIR *dir;
+  struct dirent *ent;
+  int rc = 0;
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    return 1;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    char child[PATH_MAX];
+    struct stat st;
+
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+
+    snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+    if (lstat(child, &st) != 0) {
+      rc = 1;
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+      rc |= pool_dir_files(child);
+    } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+      rc |= pool_file(child, &st);
+    }
+  }
+
+  closedir(dir);
+  return rc;
+}
+
+int pool_layer_files(const char *diff_dir) {
+  if (diff_dir == NULL || !is_directory(diff_dir)) {
+    return 1;
+  }
+
+  return pool_dir_files(diff_dir);
+}
+
+static int prune_blob_pool(void) {
+  DIR *buckets;
+  struct dirent *bucket_ent;
+  int removed = 0;
+
+  buckets = opendir(ZOCKER_BLOBS_DIR);
+  if (buckets == NULL) {
+    return 0;
+  }
+
+  while ((bucket_ent = readdir(buckets)) != NULL) {
+    char bucket[PATH_MAX];
+    DIR *dir;
+    struct dirent *ent;
+
+    if (strcmp(bucket_ent->d_name, ".") == 0 || strcmp(bucket_ent->d_name, "..") == 0) {
+      continue;
+    }
+
+    snprintf(bucket, sizeof(bucket), "%s/%s", ZOCKER_BLOBS_DIR, bucket_ent->d_name);
+    dir = opendir(bucket);
+    if (dir == NULL) {
+      continue;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+      char blob[PATH_MAX];
+      struct stat st;
+
+      if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+        continue;
+      }
+
+      snprintf(blob, sizeof(blob), "%s/%s", bucket, ent->d_name);
+      if (lstat(blob, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink <= 1) {
+        if (unlink(blob) == 0) {
+          removed++;
+        }
+      }
+    }
+
+    closedir(dir);
+    rmdir(bucket);
+  }
+
+  closedir(buckets);
+  return removed;
+}
+
 int prune_unused_layers(void) {
   int total_removed = 0;
 
@@ -934,5 +1471,7 @@ int prune_unused_layers(void) {
   }
 
   printf("Removed %d unused layers\n", total_removed);
+  printf("Removed %d unused blobs\n", prune_blob_pool());
+  printf("Removed %d unused downloads\n", download_prune());
   return 0;
 }
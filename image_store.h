@@ -8,6 +8,8 @@ struct image_meta {
   char tag[64];
   char ref[256];
   char top_layer[64];
+  /* Top layer of the zocker image it was built or rebased on, "-" for none. */
+  char base_layer[64];
   char created_at[64];
   char cmd[1024];
 };
@@ -16,7 +18,14 @@ struct layer_meta {
   char id[64];
   char parent[64];
   char hash[32];
+  char diff_hash[32];
+  /* SHA-256 of the diff tree; the layer's identity, unlike the diff_hash hint. */
+  char diff_digest[65];
+
+  /* Set on splice records (COPY --link, rebase): the layer holding the diff. */
+  char diff_layer[64];
   long created_at;
+  long duration_ms;
   unsigned long long size;
   char instruction[1024];
   char workdir[512];
@@ -35,13 +44,29 @@ int layer_chain_from_top(const char *layer_id, char *out_chain, size_t out_size)
 int register_layer_cache(const char *hash, const char *layer_id);
 int lookup_layer_cache(const char *hash, char *layer_id, size_t layer_id_size);
 
+int record_step_duration(const char *step_key, long duration_ms);
+int lookup_step_duration(const char *step_key, long *duration_ms);
+
 int write_layer_metadata(const struct layer_meta *meta);
 int read_layer_metadata(const char *layer_id, struct layer_meta *meta);
 int layer_exists(const char *layer_id);
+int publish_layer_link(const char *layer_id);
+/* Hex digits of a layer id: SHA-256 truncated to 128 bits. */
+#define LAYER_DIGEST_HEX 32
+
+int compute_layer_digest(const char *parent_chain, const char *diff_digest,
+                         char out_digest[LAYER_DIGEST_HEX + 1]);
+int commit_layer_dir(const char *staging_root, const char *digest, int *collapsed);
+int create_splice_layer(const char *parent_chain, const char *diff_layer,
+                        const char *diff_digest, char layer_id[LAYER_DIGEST_HEX + 1],
+                        int *collapsed);
+
+int pool_layer_files(const char *diff_dir);
 
 int list_images(void);
 int print_image_history(const char *ref);
 int remove_image_ref(const char *ref);
+int rebase_image(const char *ref, const char *onto, const char *old_base);
 int prune_unused_layers(void);
 
 #endif
@@ -1,13 +1,20 @@
 #define _GNU_SOURCE
 
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "build.h"
 #include "config.h"
+#include "container_store.h"
 #include "image_store.h"
+#include "metrics.h"
+#include "numa.h"
+#include "pool.h"
 #include "run.h"
 #include "setup.h"
+#include "stats.h"
 
 static int append_run_command(struct config *cfg, const char *token) {
   size_t current_len = strlen(cfg->command);
@@ -61,8 +68,130 @@ static int parse_build_arg_value(const char *raw, struct config *cfg) {
   return 0;
 }
 
+/* The cgroup limit flags of zocker run, each followed by a value. */
+static const char *limit_flags[] = {
+    "--cpus", "--cpu-shares", "--memory", "-m", "--memory-swap", "--pids-limit",
+    "--io-weight", "--io-max", "--cpuset-cpus", "--cpuset-mems",
+};
+
+static int is_limit_flag(const char *word) {
+  size_t i;
+
+  for (i = 0; i < sizeof(limit_flags) / sizeof(limit_flags[0]); i++) {
+    if (strcmp(word, limit_flags[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Parses one of the cgroup limit flags. Returns -1 if flag is not one of
+ * them, 0 on success and 1 on an invalid value.
+ */
+static int parse_limit_flag(const char *flag, const char *value, struct cgroup_limits *l) {
+  char *end;
+
+  if (strcmp(flag, "--cpus") == 0) {
+    double cpus = strtod(value, &end);
+
+    if (*end != '\0' || cpus <= 0) {
+      return 1;
+    }
+    l->cpu_quota_us = (long long)(cpus * CGROUP_CPU_PERIOD_US);
+    return l->cpu_quota_us < 1000;
+  }
+
+  if (strcmp(flag, "--cpu-shares") == 0) {
+    long long shares = strtoll(value, &end, 10);
+
+    if (*end != '\0' || shares <= 0) {
+      return 1;
+    }
+    l->cpu_weight = cgroup_weight_from_shares(shares);
+    return 0;
+  }
+
+  if (strcmp(flag, "--memory") == 0 || strcmp(flag, "-m") == 0) {
+    return cgroup_parse_bytes(value, &l->memory_max) != 0 || l->memory_max == 0;
+  }
+
+  if (strcmp(flag, "--memory-swap") == 0) {
+    if (strcmp(value, "-1") == 0) {
+      l->memory_swap = -1;
+      return 0;
+    }
+    return cgroup_parse_bytes(value, &l->memory_swap) != 0 || l->memory_swap == 0;
+  }
+
+  if (strcmp(flag, "--pids-limit") == 0) {
+    l->pids_max = strtoll(value, &end, 10);
+    return *end != '\0' || l->pids_max <= 0;
+  }
+
+  if (strcmp(flag, "--io-weight") == 0) {
+    l->io_weight = (int)strtol(value, &end, 10);
+    return *end != '\0' || l->io_weight < 1 || l->io_weight > 10000;
+  }
+
+  if (strcmp(flag, "--io-max") == 0) {
+    int n = snprintf(l->io_max, sizeof(l->io_max), "%s", value);
+
+    return n <= 0 || (size_t)n >= sizeof(l->io_max) || strchr(value, ':') == NULL;
+  }
+
+  if (strcmp(flag, "--cpuset-cpus") == 0) {
+    int n = snprintf(l->cpuset_cpus, sizeof(l->cpuset_cpus), "%s", value);
+
+    return n <= 0 || (size_t)n >= sizeof(l->cpuset_cpus) ||
+           parse_id_list(value, NULL, CPU_SETSIZE) != 0;
+  }
+
+  if (strcmp(flag, "--cpuset-mems") == 0) {
+    int n = snprintf(l->cpuset_mems, sizeof(l->cpuset_mems), "%s", value);
+
+    return n <= 0 || (size_t)n >= sizeof(l->cpuset_mems) ||
+           parse_id_list(value, NULL, NUMA_MAX_NODES) != 0;
+  }
+
+  return -1;
+}
+
+static const struct {
+  const char *word;
+  enum COMMAND subcommand;
+} subcommands[] = {
+    {"run", RUN},
+    {"exec", EXEC},
+    {"build", BUILD},
+    {"history", HISTORY},
+    {"images", IMAGES},
+    {"rmi", RMI},
+    {"prune", PRUNE},
+    {"rebase", REBASE},
+    {"metrics", METRICS},
+    {"pool", POOL},
+    {"ps", PS},
+    {"stats", STATS},
+    {"stop", STOP},
+    {"wait", WAIT},
+    {"rm", RM},
+};
+
+static enum COMMAND subcommand_from_word(const char *word) {
+  size_t i;
+
+  for (i = 0; i < sizeof(subcommands) / sizeof(subcommands[0]); i++) {
+    if (strcmp(word, subcommands[i].word) == 0) {
+      return subcommands[i].subcommand;
+    }
+  }
+  return NONE;
+}
+
 int main(int argc, char **argv) {
   struct config cfg;
+  int in_command = 0;
   int i = 1;
 
   if (setup_zocker_dir() != 0) {
@@ -71,96 +200,154 @@ int main(int argc, char **argv) {
 
   memset(&cfg, 0, sizeof(cfg));
   cfg.subcommand = NONE;
+  cfg.numa_node = NUMA_NODE_NONE;
 
   while (i < argc) {
-    if (strcmp(argv[i], "run") == 0) {
-      cfg.subcommand = RUN;
+    /*
+     * Everything from the first word of a run/exec command (or after "--")
+     * on belongs to that command, so words like rm or -d inside it are
+     * never taken for zocker's own subcommands and options.
+     */
+    if (in_command) {
+      if (cfg.subcommand == EXEC && cfg.name[0] == '\0') {
+        snprintf(cfg.name, sizeof(cfg.name), "%s", argv[i]);
+      } else if (append_run_command(&cfg, argv[i]) != 0) {
+        fprintf(stderr, "[ERR] run command is too long\n");
+        return 1;
+      }
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "exec") == 0) {
-      cfg.subcommand = EXEC;
+    if (cfg.subcommand == NONE) {
+      enum COMMAND subcommand = subcommand_from_word(argv[i]);
+
+      if (subcommand != NONE) {
+        cfg.subcommand = subcommand;
+        i++;
+        continue;
+      }
+    }
+
+    if ((cfg.subcommand == RUN || cfg.subcommand == EXEC) && strcmp(argv[i], "--") == 0) {
+      in_command = 1;
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "build") == 0) {
-      cfg.subcommand = BUILD;
+    if (strcmp(argv[i], "--name") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "[ERR] Missing --name value\n");
+        return 1;
+      }
+      snprintf(cfg.name, sizeof(cfg.name), "%s", argv[++i]);
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "history") == 0) {
-      cfg.subcommand = HISTORY;
+    if (strcmp(argv[i], "--base-dir") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "[ERR] Missing --base-dir value\n");
+        return 1;
+      }
+      snprintf(cfg.base_dir, sizeof(cfg.base_dir), "%s", argv[++i]);
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "images") == 0) {
-      cfg.subcommand = IMAGES;
+    if (strcmp(argv[i], "--base-image") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "[ERR] Missing --base-image value\n");
+        return 1;
+      }
+      snprintf(cfg.base_image, sizeof(cfg.base_image), "%s", argv[++i]);
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "rmi") == 0) {
-      cfg.subcommand = RMI;
+    if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "[ERR] Missing -f/--file value\n");
+        return 1;
+      }
+      snprintf(cfg.zockerfile, sizeof(cfg.zockerfile), "%s", argv[++i]);
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "prune") == 0) {
-      cfg.subcommand = PRUNE;
+    if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--tag") == 0) {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "[ERR] Missing -t/--tag value\n");
+        return 1;
+      }
+      snprintf(cfg.image_ref, sizeof(cfg.image_ref), "%s", argv[++i]);
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "--name") == 0) {
+    if (strcmp(argv[i], "--onto") == 0) {
       if (i + 1 >= argc) {
-        fprintf(stderr, "[ERR] Missing --name value\n");
+        fprintf(stderr, "[ERR] Missing --onto value\n");
         return 1;
       }
-      snprintf(cfg.name, sizeof(cfg.name), "%s", argv[++i]);
+      snprintf(cfg.onto, sizeof(cfg.onto), "%s", argv[++i]);
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "--base-dir") == 0) {
+    if (strcmp(argv[i], "--from") == 0) {
       if (i + 1 >= argc) {
-        fprintf(stderr, "[ERR] Missing --base-dir value\n");
+        fprintf(stderr, "[ERR] Missing --from value\n");
         return 1;
       }
-      snprintf(cfg.base_dir, sizeof(cfg.base_dir), "%s", argv[++i]);
+      snprintf(cfg.rebase_from, sizeof(cfg.rebase_from), "%s", argv[++i]);
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "--base-image") == 0) {
+    if (strcmp(argv[i], "--size") == 0) {
       if (i + 1 >= argc) {
-        fprintf(stderr, "[ERR] Missing --base-image value\n");
+        fprintf(stderr, "[ERR] Missing --size value\n");
+        return 1;
+      }
+      if (sscanf(argv[++i], "%d", &cfg.pool_size) != 1 || cfg.pool_size < 1) {
+        fprintf(stderr, "[ERR] Invalid --size value: %s\n", argv[i]);
         return 1;
       }
-      snprintf(cfg.base_image, sizeof(cfg.base_image), "%s", argv[++i]);
       i++;
       continue;
     }
 
-    if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--file") == 0) {
+    if (cfg.subcommand == RUN && is_limit_flag(argv[i])) {
       if (i + 1 >= argc) {
-        fprintf(stderr, "[ERR] Missing -f/--file value\n");
+        fprintf(stderr, "[ERR] Missing %s value\n", argv[i]);
         return 1;
       }
-      snprintf(cfg.zockerfile, sizeof(cfg.zockerfile), "%s", argv[++i]);
-      i++;
+      if (parse_limit_flag(argv[i], argv[i + 1], &cfg.limits) != 0) {
+        fprintf(stderr, "[ERR] Invalid %s value: %s\n", argv[i], argv[i + 1]);
+        return 1;
+      }
+      i += 2;
       continue;
     }
 
-    if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--tag") == 0) {
+    if (strcmp(argv[i], "--numa-node") == 0) {
+      char *end;
+
       if (i + 1 >= argc) {
-        fprintf(stderr, "[ERR] Missing -t/--tag value\n");
+        fprintf(stderr, "[ERR] Missing --numa-node value\n");
         return 1;
       }
-      snprintf(cfg.image_ref, sizeof(cfg.image_ref), "%s", argv[++i]);
+      if (strcmp(argv[++i], "auto") == 0) {
+        cfg.numa_node = NUMA_NODE_AUTO;
+      } else {
+        cfg.numa_node = (int)strtol(argv[i], &end, 10);
+        if (end == argv[i] || *end != '\0' || cfg.numa_node < 0 ||
+            cfg.numa_node >= NUMA_MAX_NODES) {
+          fprintf(stderr, "[ERR] Invalid --numa-node value: %s (use a node or auto)\n", argv[i]);
+          return 1;
+        }
+      }
       i++;
       continue;
     }
@@ -177,16 +364,66 @@ int main(int argc, char **argv) {
       continue;
     }
 
-    if (cfg.subcommand == RUN) {
-      if (append_run_command(&cfg, argv[i]) != 0) {
-        fprintf(stderr, "[ERR] run command is too long\n");
-        return 1;
-      }
+    if (strcmp(argv[i], "--watch") == 0) {
+      cfg.watch = 1;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--plan") == 0) {
+      cfg.plan = 1;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--timings") == 0) {
+      cfg.timings = 1;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--detach") == 0) {
+      cfg.detach = 1;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--json") == 0) {
+      cfg.json = 1;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--no-stream") == 0) {
+      cfg.no_stream = 1;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--share-image") == 0) {
+      cfg.share_image = 1;
+      i++;
+      continue;
+    }
+
+    if (strcmp(argv[i], "--blob-pool") == 0) {
+      cfg.blob_pool = 1;
       i++;
       continue;
     }
 
-    if (cfg.subcommand == HISTORY || cfg.subcommand == RMI) {
+    if (cfg.subcommand == EXEC && cfg.name[0] == '\0') {
+      snprintf(cfg.name, sizeof(cfg.name), "%s", argv[i]);
+      i++;
+      continue;
+    }
+
+    if (cfg.subcommand == RUN || cfg.subcommand == EXEC) {
+      in_command = 1;
+      continue;
+    }
+
+    if (cfg.subcommand == HISTORY || cfg.subcommand == RMI || cfg.subcommand == REBASE) {
       if (cfg.image_ref[0] == '\0') {
         snprintf(cfg.image_ref, sizeof(cfg.image_ref), "%s", argv[i]);
         i++;
@@ -194,6 +431,24 @@ int main(int argc, char **argv) {
       }
     }
 
+    if (cfg.subcommand == STOP || cfg.subcommand == WAIT || cfg.subcommand == RM) {
+      if (cfg.name[0] == '\0') {
+        snprintf(cfg.name, sizeof(cfg.name), "%s", argv[i]);
+        i++;
+        continue;
+      }
+    }
+
+    if (cfg.subcommand == STATS) {
+      if (cfg.stats_count >= MAX_STATS_CONTAINERS) {
+        fprintf(stderr, "[ERR] Too many containers for stats\n");
+        return 1;
+      }
+      cfg.stats_names[cfg.stats_count++] = argv[i];
+      i++;
+      continue;
+    }
+
     fprintf(stderr, "[ERR] Unknown/unsupported argument: %s\n", argv[i]);
     return 1;
   }
@@ -205,14 +460,15 @@ int main(int argc, char **argv) {
   switch (cfg.subcommand) {
   case RUN: {
     struct container cont;
+    int exit_code = 0;
     memset(&cont, 0, sizeof(cont));
     container_from_config(cfg, &cont);
-    if (run_container(cont) != 0) {
+    if (run_container(cont, &exit_code) != 0) {
       fprintf(stderr,
               "[ERR] Running container failed due to internal errors.\n");
       return 1;
     }
-    break;
+    return exit_code;
   }
   case BUILD:
     if (build_image_from_config(&cfg) != 0) {
@@ -239,9 +495,53 @@ int main(int argc, char **argv) {
       return 1;
     }
     break;
-  case EXEC:
-    printf("EXEC subcommand has not been implemented yet...\n");
+  case METRICS:
+    if (print_run_metrics() != 0) {
+      return 1;
+    }
     break;
+  case POOL:
+    if (pool_serve(cfg.base_image, cfg.pool_size, cfg.share_image) != 0) {
+      return 1;
+    }
+    break;
+  case PS:
+    if (list_containers() != 0) {
+      return 1;
+    }
+    break;
+  case STATS:
+    if (stream_container_stats(cfg.stats_names, cfg.stats_count, cfg.json, cfg.no_stream) != 0) {
+      return 1;
+    }
+    break;
+  case STOP:
+    if (stop_container(cfg.name) != 0) {
+      return 1;
+    }
+    break;
+  case WAIT:
+    if (wait_container(cfg.name) != 0) {
+      return 1;
+    }
+    break;
+  case RM:
+    if (remove_container(cfg.name) != 0) {
+      return 1;
+    }
+    break;
+  case REBASE:
+    if (rebase_image(cfg.image_ref, cfg.onto, cfg.rebase_from) != 0) {
+      return 1;
+    }
+    break;
+  case EXEC: {
+    int exit_code = 0;
+    if (exec_container(cfg.name, cfg.command, &exit_code) != 0) {
+      return 1;
+    }
+    return exit_code;
+  }
   case NONE:
   default:
     break;
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "setup.h"
+
+#define METRICS_RUN_FILE ZOCKER_METRICS_DIR "/run_startup"
+
+/* One extra row for the whole startup, after the phases. */
+#define METRICS_ROWS (PHASE_COUNT + 1)
+
+static const char *phase_names[PHASE_COUNT] = {
+    "fork", "dirs", "resolve", "mount", "chroot", "proc", "exec",
+};
+
+struct histogram {
+  unsigned long long count;
+  unsigned long long sum_us;
+  unsigned long long buckets[METRICS_BUCKETS];
+};
+
+long long monotonic_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void timing_start(struct run_timings *t) {
+  memset(t, 0, sizeof(*t));
+  t->start_ns = monotonic_ns();
+}
+
+void timing_mark(struct run_timings *t, enum run_phase phase) {
+  if (t != NULL && phase < PHASE_COUNT) {
+    t->mark_ns[phase] = monotonic_ns();
+  }
+}
+
+const char *run_phase_name(enum run_phase phase) {
+  return phase < PHASE_COUNT ? phase_names[phase] : "total";
+}
+
+/* Microseconds spent in phase, or -1 if the run never went through it. */
+static long long phase_us(const struct run_timings *t, int phase) {
+  long long prev = t->start_ns;
+  int i;
+
+  if (t->mark_ns[phase] == 0) {
+    return -1;
+  }
+
+  for (i = phase - 1; i >= 0; i--) {
+    if (t->mark_ns[i] != 0) {
+      prev = t->mark_ns[i];
+      break;
+    }
+  }
+
+  return (t->mark_ns[phase] - prev) / 1000;
+}
+
+static long long total_us(const struct run_timings *t) {
+  int i;
+
+  for (i = PHASE_COUNT - 1; i >= 0; i--) {
+    if (t->mark_ns[i] != 0) {
+      return (t->mark_ns[i] - t->start_ns) / 1000;
+    }
+  }
+  return -1;
+}
+
+void print_run_timings(const char *container_id, const struct run_timings *t) {
+  const char *sep = "";
+  int i;
+
+  fprintf(stderr, "{\"container\":\"%s\",\"phases_us\":{", container_id);
+  for (i = 0; i < PHASE_COUNT; i++) {
+    long long us = phase_us(t, i);
+
+    if (us >= 0) {
+      fprintf(stderr, "%s\"%s\":%lld", sep, phase_names[i], us);
+      sep = ",";
+    }
+  }
+  fprintf(stderr, "},\"total_us\":%lld}\n", total_us(t));
+}
+
+static int bucket_of(long long us) {
+  int b = 0;
+
+  while (us > 1 && b < METRICS_BUCKETS - 1) {
+    us >>= 1;
+    b++;
+  }
+  return b;
+}
+
+static void read_histograms(FILE *fp, struct histogram rows[METRICS_ROWS]) {
+  char line[1024];
+
+  memset(rows, 0, sizeof(struct histogram) * METRICS_ROWS);
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char name[32];
+    struct histogram h;
+    char *p;
+    int n;
+    int row;
+    int b;
+
+    if (sscanf(line, "%31s %llu %llu%n", name, &h.count, &h.sum_us, &n) != 3) {
+      continue;
+    }
+
+    for (row = 0; row < METRICS_ROWS; row++) {
+      if (strcmp(name, run_phase_name((enum run_phase)row)) == 0) {
+        break;
+      }
+    }
+    if (row == METRICS_ROWS) {
+      continue;
+    }
+
+    p = line + n;
+    for (b = 0; b < METRICS_BUCKETS; b++) {
+      h.buckets[b] = strtoull(p, &p, 10);
+    }
+    rows[row] = h;
+  }
+}
+
+static void add_sample(struct histogram *h, long long us) {
+  if (us < 0) {
+    return;
+  }
+  h->count++;
+  h->sum_us += (unsigned long long)us;
+  h->buckets[bucket_of(us)]++;
+}
+
+int record_run_timings(const struct run_timings *t) {
+  struct histogram rows[METRICS_ROWS];
+  FILE *fp;
+  int fd;
+  int row;
+
+  fd = open(METRICS_RUN_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return 1;
+  }
+
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return 1;
+    }
+  }
+
+  fp = fdopen(fd, "r+");
+  if (fp == NULL) {
+    close(fd);
+    return 1;
+  }
+
+  read_histograms(fp, rows);
+  for (row = 0; row < PHASE_COUNT; row++) {
+    add_sample(&rows[row], phase_us(t, row));
+  }
+  add_sample(&rows[PHASE_COUNT], total_us(t));
+
+  rewind(fp);
+  if (ftruncate(fd, 0) != 0) {
+    fclose(fp);
+    return 1;
+  }
+
+  for (row = 0; row < METRICS_ROWS; row++) {
+    int b;
+
+    fprintf(fp, "%s %llu %llu", run_phase_name((enum run_phase)row), rows[row].count,
+            rows[row].sum_us);
+    for (b = 0; b < METRICS_BUCKETS; b++) {
+      fprintf(fp, " %llu", rows[row].buckets[b]);
+    }
+    fprintf(fp, "\n");
+  }
+
+  return fclose(fp) != 0;
+}
+
+/* Upper bound in microseconds of the bucket holding quantile q. */
+static unsigned long long quantile_us(const struct histogram *h, double q) {
+  unsigned long long want = (unsigned long long)(q * (double)h->count);
+  unsigned long long seen = 0;
+  int b;
+
+  if (want == 0) {
+    want = 1;
+  }
+
+  for (b = 0; b < METRICS_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen >= want) {
+      return 2ULL << b;
+    }
+  }
+  return 2ULL << (METRICS_BUCKETS - 1);
+}
+
+int print_run_metrics(void) {
+  struct histogram rows[METRICS_ROWS];
+  FILE *fp;
+  int row;
+
+  fp = fopen(METRICS_RUN_FILE, "r");
+  if (fp == NULL) {
+    if (errno == ENOENT) {
+      printf("No run metrics recorded yet\n");
+      return 0;
+    }
+    return 1;
+  }
+
+  read_histograms(fp, rows);
+  fclose(fp);
+
+  printf("%-8s %8s %10s %10s %10s %10s\n", "PHASE", "RUNS", "AVG_US", "P50_US", "P90_US",
+         "P99_US");
+  for (row = 0; row < METRICS_ROWS; row++) {
+    const struct histogram *h = &rows[row];
+
+    if (h->count == 0) {
+      continue;
+    }
+    printf("%-8s %8llu %10llu %10llu %10llu %10llu\n", run_phase_name((enum run_phase)row),
+           h->count, h->sum_us / h->count, quantile_us(h, 0.50), quantile_us(h, 0.90),
+           quantile_us(h, 0.99));
+  }
+
+  return 0;
+}
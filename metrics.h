@@ -0,0 +1,45 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#ifndef METRICS_BUCKETS
+#define METRICS_BUCKETS 24
+#endif
+
+/*
+ * Startup phases of `zocker run`, in order: fork (the clone3 that also creates
+ * the namespaces and joins the cgroup), dirs, resolve, mount, chroot, proc and
+ * exec. Each phase ends at its mark, and starts at the previous phase's mark
+ * (or at the run's start).
+ */
+enum run_phase {
+  PHASE_FORK = 0,
+  PHASE_DIRS,
+  PHASE_RESOLVE,
+  PHASE_MOUNT,
+  PHASE_CHROOT,
+  PHASE_PROC,
+  PHASE_EXEC,
+  PHASE_COUNT,
+};
+
+struct run_timings {
+  long long start_ns;
+  long long mark_ns[PHASE_COUNT];
+};
+
+long long monotonic_ns(void);
+void timing_start(struct run_timings *t);
+void timing_mark(struct run_timings *t, enum run_phase phase);
+const char *run_phase_name(enum run_phase phase);
+
+/* Prints one JSON object with the phase durations in microseconds. */
+void print_run_timings(const char *container_id, const struct run_timings *t);
+
+/*
+ * Adds a run to the persistent per-phase histograms (log2 microsecond
+ * buckets) under ZOCKER_METRICS_DIR. Concurrent runs serialize on flock.
+ */
+int record_run_timings(const struct run_timings *t);
+int print_run_metrics(void);
+
+#endif
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+
+#include "numa.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "container_store.h"
+#include "setup.h"
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+#define BITS_PER_WORD ((int)(sizeof(unsigned long) * CHAR_BIT))
+
+int parse_id_list(const char *list, unsigned long *bits, int nbits) {
+  const char *p = list;
+
+  if (bits != NULL) {
+    memset(bits, 0, sizeof(unsigned long) * (size_t)((nbits + BITS_PER_WORD - 1) / BITS_PER_WORD));
+  }
+  if (*p == '\0') {
+    return 1;
+  }
+
+  while (*p != '\0') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    long id;
+
+    if (end == p || first < 0) {
+      return 1;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return 1;
+      }
+    }
+    if (last >= nbits) {
+      return 1;
+    }
+
+    for (id = first; bits != NULL && id <= last; id++) {
+      bits[id / BITS_PER_WORD] |= 1UL << (id % BITS_PER_WORD);
+    }
+
+    if (*end == ',') {
+      end++;
+      if (*end == '\0') {
+        return 1;
+      }
+    } else if (*end != '\0' && *end != '\n') {
+      return 1;
+    } else {
+      break;
+    }
+    p = end;
+  }
+  return 0;
+}
+
+static int test_bit(const unsigned long *bits, int id) {
+  return (bits[id / BITS_PER_WORD] >> (id % BITS_PER_WORD)) & 1UL;
+}
+
+static int read_node_file(const char *file, char *out, size_t out_size) {
+  char path[PATH_MAX];
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "%s/%s", ZOCKER_NODE_DIR, file);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 1;
+  }
+  if (fgets(out, (int)out_size, fp) == NULL) {
+    fclose(fp);
+    return 1;
+  }
+  fclose(fp);
+
+  out[strcspn(out, "\n")] = '\0';
+  return 0;
+}
+
+/* Running containers per node, from their recorded placement. */
+static void count_node_load(int *load) {
+  struct dirent *ent;
+  DIR *dir;
+
+  dir = opendir(ZOCKER_CONTAINERS_DIR);
+  if (dir == NULL) {
+    return;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    struct container_state st;
+
+    if (ent->d_name[0] == '.' || load_container_state(ent->d_name, &st) != 0 ||
+        st.numa_node < 0 || st.numa_node >= NUMA_MAX_NODES || !container_live(&st)) {
+      continue;
+    }
+    load[st.numa_node]++;
+  }
+
+  closedir(dir);
+}
+
+/* Ties go to the lowest node, so a single container lands on node 0. */
+static int pick_least_loaded(const unsigned long *online) {
+  static int load[NUMA_MAX_NODES];
+  int best = -1;
+  int n;
+
+  memset(load, 0, sizeof(load));
+  count_node_load(load);
+
+  for (n = 0; n < NUMA_MAX_NODES; n++) {
+    if (test_bit(online, n) && (best < 0 || load[n] < load[best])) {
+      best = n;
+    }
+  }
+  return best;
+}
+
+int numa_place(int *node, struct cgroup_limits *limits) {
+  unsigned long online[NUMA_MAX_NODES / (sizeof(unsigned long) * CHAR_BIT)];
+  char list[512];
+  char file[64];
+
+  if (read_node_file("online", list, sizeof(list)) != 0 ||
+      parse_id_list(list, online, NUMA_MAX_NODES) != 0) {
+    fprintf(stderr, "[ERR] Failed to read NUMA nodes from %s\n", ZOCKER_NODE_DIR);
+    return 1;
+  }
+
+  if (*node == NUMA_NODE_AUTO) {
+    *node = pick_least_loaded(online);
+  }
+  if (*node < 0 || *node >= NUMA_MAX_NODES || !test_bit(online, *node)) {
+    fprintf(stderr, "[ERR] NUMA node %d is not online (online: %s)\n", *node, list);
+    return 1;
+  }
+
+  if (limits->cpuset_cpus[0] == '\0') {
+    snprintf(file, sizeof(file), "node%d/cpulist", *node);
+    if (read_node_file(file, limits->cpuset_cpus, sizeof(limits->cpuset_cpus)) != 0 ||
+        limits->cpuset_cpus[0] == '\0') {
+      fprintf(stderr, "[ERR] NUMA node %d has no CPUs\n", *node);
+      return 1;
+    }
+  }
+  if (limits->cpuset_mems[0] == '\0') {
+    snprintf(limits->cpuset_mems, sizeof(limits->cpuset_mems), "%d", *node);
+  }
+  return 0;
+}
+
+int numa_apply_placement(const struct cgroup_limits *limits) {
+  if (limits->cpuset_cpus[0] != '\0') {
+    unsigned long cpus[CPU_SETSIZE / (sizeof(unsigned long) * CHAR_BIT)];
+    cpu_set_t set;
+    int cpu;
+
+    if (parse_id_list(limits->cpuset_cpus, cpus, CPU_SETSIZE) != 0) {
+      fprintf(stderr, "[ERR] Invalid CPU list: %s\n", limits->cpuset_cpus);
+      return 1;
+    }
+    CPU_ZERO(&set);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (test_bit(cpus, cpu)) {
+        CPU_SET(cpu, &set);
+      }
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+      fprintf(stderr, "[ERR] Failed to set CPU affinity to %s: %s\n", limits->cpuset_cpus,
+              strerror(errno));
+      return 1;
+    }
+  }
+
+  if (limits->cpuset_mems[0] != '\0') {
+    unsigned long mems[NUMA_MAX_NODES / (sizeof(unsigned long) * CHAR_BIT)];
+
+    if (parse_id_list(limits->cpuset_mems, mems, NUMA_MAX_NODES) != 0) {
+      fprintf(stderr, "[ERR] Invalid memory node list: %s\n", limits->cpuset_mems);
+      return 1;
+    }
+    /* The kernel reads one bit less than maxnode says. */
+    if (syscall(SYS_set_mempolicy, MPOL_BIND, mems, (unsigned long)NUMA_MAX_NODES + 1) != 0) {
+      fprintf(stderr, "[ERR] Failed to bind memory to nodes %s: %s\n", limits->cpuset_mems,
+              strerror(errno));
+      return 1;
+    }
+  }
+  return 0;
+}
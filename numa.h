@@ -0,0 +1,37 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+struct cgroup_limits;
+
+#ifndef ZOCKER_NODE_DIR
+#define ZOCKER_NODE_DIR "/sys/devices/system/node"
+#endif
+
+#ifndef NUMA_MAX_NODES
+#define NUMA_MAX_NODES 1024
+#endif
+
+/* Values of --numa-node besides a node number. */
+#define NUMA_NODE_NONE (-1)
+#define NUMA_NODE_AUTO (-2)
+
+/*
+ * Parses a cpuset-style list ("0-3,8,10-11") into a bitmap of nbits bits.
+ * bits may be NULL to only validate the list.
+ */
+int parse_id_list(const char *list, unsigned long *bits, int nbits);
+
+/*
+ * Resolves --numa-node: NUMA_NODE_AUTO becomes the online node the fewest
+ * running containers are placed on. Fills the cpuset CPUs with the node's
+ * CPUs and the cpuset memory nodes with the node, unless set explicitly.
+ */
+int numa_place(int *node, struct cgroup_limits *limits);
+
+/*
+ * Makes the calling task's CPU affinity and memory policy (MPOL_BIND) match
+ * the cpuset of limits, so its children start with them as their defaults.
+ */
+int numa_apply_placement(const struct cgroup_limits *limits);
+
+#endif
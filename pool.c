@@ -0,0 +1,665 @@
+#define _GNU_SOURCE
+
+#include "pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "setup.h"
+#include "shared_mount.h"
+#include "spawn.h"
+#include "utils.h"
+
+#define POOL_MAX_SETUP_FAILURES 3
+
+enum sandbox_state {
+  SANDBOX_STARTING = 0,
+  SANDBOX_READY = 1,
+  SANDBOX_RUNNING = 2,
+  /* Killed for sitting on an outdated image chain; not a setup failure. */
+  SANDBOX_RETIRED = 3,
+};
+
+struct sandbox {
+  char id[64];
+  char chain_key[17];
+  pid_t pid;
+  int pidfd;
+  int ctl;
+  int client;
+  enum sandbox_state state;
+};
+
+/* chain_key is the hash of the layer chain the client resolved the image to. */
+struct pool_request {
+  char command[1024];
+  char hostname[64];
+  char chain_key[17];
+};
+
+struct pool_reply {
+  int claimed;
+};
+
+struct pool_exit {
+  int exit_code;
+};
+
+struct pool {
+  char image_ref[4096];
+  char chain[8192];
+  char chain_key[17];
+  char socket_path[PATH_MAX];
+  int size;
+  struct shared_mount shared;
+  int share_image;
+  int listen_fd;
+  int sfd;
+  sigset_t old_mask;
+  int failures;
+  struct sandbox *sandboxes;
+  int count;
+  int cap;
+};
+
+static int pool_socket_path(const char *image_ref, char *out, size_t out_size) {
+  char key[17];
+  int n;
+
+  if (hash_string(image_ref, key) != 0) {
+    return 1;
+  }
+
+  n = snprintf(out, out_size, "%s/%s.sock", ZOCKER_POOLS_DIR, key);
+  return n < 0 || (size_t)n >= out_size;
+}
+
+static int send_with_fds(int sock, const void *buf, size_t len, const int *fds, int nfds) {
+  char control[CMSG_SPACE(sizeof(int) * 4)];
+  struct iovec iov;
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = (void *)buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+
+  if (nfds > 0) {
+    struct cmsghdr *cmsg;
+
+    memset(control, 0, sizeof(control));
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)nfds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)nfds);
+  }
+
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : 1;
+}
+
+/* Receives exactly len bytes plus up to max_fds descriptors (set to -1 if absent). */
+static int recv_with_fds(int sock, void *buf, size_t len, int *fds, int max_fds) {
+  char control[CMSG_SPACE(sizeof(int) * 4)];
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  struct msghdr msg;
+  ssize_t n;
+  int i;
+
+  for (i = 0; i < max_fds; i++) {
+    fds[i] = -1;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  do {
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  } while (n < 0 && errno == EINTR);
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+      for (i = 0; i < count; i++) {
+        int fd;
+
+        memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * (size_t)i, sizeof(int));
+        if (i < max_fds) {
+          fds[i] = fd;
+        } else {
+          close(fd);
+        }
+      }
+    }
+  }
+
+  return n == (ssize_t)len ? 0 : 1;
+}
+
+static void close_fds(int *fds, int nfds) {
+  int i;
+
+  for (i = 0; i < nfds; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+}
+
+/*
+ * Body of a sandbox: the init of fresh PID, mount and UTS namespaces. It gets
+ * the rootfs ready, reports in, and then sleeps in recvmsg until the zygote
+ * hands it a command and the caller's stdio.
+ */
+static void sandbox_main(const struct pool *pool, const char *id, int ctl) {
+  struct pool_request req;
+  char container_dir[PATH_MAX];
+  int fds[3];
+  int i;
+
+  if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0 ||
+      setup_container_dir_on(id, 0, container_dir, sizeof(container_dir),
+                             pool->share_image ? pool->shared.lower : pool->chain, NULL) != 0 ||
+      chroot(container_dir) != 0 || chdir("/") != 0) {
+    _exit(1);
+  }
+
+  if (mkdir("/proc", 0555) != 0 && errno != EEXIST) {
+    _exit(1);
+  }
+  mount(NULL, "/proc", "proc", 0, NULL);
+
+  if (write(ctl, "R", 1) != 1 || recv_with_fds(ctl, &req, sizeof(req), fds, 3) != 0) {
+    _exit(0);
+  }
+
+  for (i = 0; i < 3; i++) {
+    if (fds[i] < 0 || dup2(fds[i], i) < 0) {
+      _exit(1);
+    }
+    close(fds[i]);
+  }
+
+  req.hostname[sizeof(req.hostname) - 1] = '\0';
+  req.command[sizeof(req.command) - 1] = '\0';
+  sethostname(req.hostname, strlen(req.hostname));
+  sigprocmask(SIG_SETMASK, &pool->old_mask, NULL);
+
+  printf("Running child with pid: %d\n", getpid());
+  fflush(stdout);
+
+  execl("/bin/sh", "sh", "-c", req.command, NULL);
+  _exit(127);
+}
+
+static int spawn_sandbox(struct pool *pool) {
+  struct sandbox *sb;
+  char uuid[64];
+  int ns_flags = CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWTIME;
+  int pidfd;
+  int sv[2];
+  pid_t pid;
+
+  if (pool->count == pool->cap) {
+    int new_cap = pool->cap == 0 ? 8 : pool->cap * 2;
+    struct sandbox *sandboxes = realloc(pool->sandboxes, sizeof(*sandboxes) * new_cap);
+
+    if (sandboxes == NULL) {
+      return 1;
+    }
+    pool->sandboxes = sandboxes;
+    pool->cap = new_cap;
+  }
+
+  if (generate_uuid(uuid) != 0 ||
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+    return 1;
+  }
+
+  sb = &pool->sandboxes[pool->count];
+  memset(sb, 0, sizeof(*sb));
+  snprintf(sb->id, sizeof(sb->id), "pool-%.12s", uuid);
+  snprintf(sb->chain_key, sizeof(sb->chain_key), "%s", pool->chain_key);
+
+  pid = spawn_process(&ns_flags, -1, &pidfd);
+  if (pid < 0) {
+    close(sv[0]);
+    close(sv[1]);
+    return 1;
+  }
+
+  if (pid == 0) {
+    close(sv[0]);
+    sandbox_main(pool, sb->id, sv[1]);
+  }
+
+  close(sv[1]);
+  sb->pid = pid;
+  sb->pidfd = pidfd;
+  sb->ctl = sv[0];
+  sb->client = -1;
+  sb->state = SANDBOX_STARTING;
+  pool->count++;
+  return 0;
+}
+
+static void release_sandbox(struct pool *pool, int idx) {
+  struct sandbox *sb = &pool->sandboxes[idx];
+  char container_root[PATH_MAX];
+
+  if (sb->pidfd >= 0) {
+    close(sb->pidfd);
+  }
+  if (sb->client >= 0) {
+    close(sb->client);
+  }
+  close(sb->ctl);
+
+  snprintf(container_root, sizeof(container_root), "%s/%s", ZOCKER_CONTAINERS_DIR, sb->id);
+  remove_recursive(container_root);
+
+  pool->sandboxes[idx] = pool->sandboxes[--pool->count];
+}
+
+static void reap_sandboxes(struct pool *pool) {
+  int status;
+  pid_t pid;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    int i;
+
+    for (i = 0; i < pool->count; i++) {
+      struct sandbox *sb = &pool->sandboxes[i];
+
+      if (sb->pid != pid) {
+        continue;
+      }
+
+      if (sb->state == SANDBOX_RUNNING && sb->client >= 0) {
+        struct pool_exit ex;
+
+        ex.exit_code = WIFEXITED(status)     ? WEXITSTATUS(status)
+                       : WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                             : 1;
+        send_with_fds(sb->client, &ex, sizeof(ex), NULL, 0);
+      } else if (sb->state == SANDBOX_STARTING) {
+        pool->failures++;
+        fprintf(stderr, "[WARN] Pool sandbox %s failed to start\n", sb->id);
+      }
+
+      release_sandbox(pool, i);
+      break;
+    }
+  }
+}
+
+/* Resolves the image's layer chain, moving the shared view along with it. */
+static int resolve_pool_chain(struct pool *pool) {
+  char chain[8192];
+  char key[17];
+
+  if (resolve_base_chain(pool->image_ref, chain, sizeof(chain)) != 0 ||
+      hash_string(chain, key) != 0) {
+    fprintf(stderr, "[ERR] Failed to resolve base image/path: %s\n", pool->image_ref);
+    return 1;
+  }
+
+  if (strcmp(key, pool->chain_key) == 0) {
+    return 0;
+  }
+
+  if (pool->share_image) {
+    struct shared_mount shared;
+
+    if (shared_mount_acquire_chain(chain, &shared) != 0) {
+      return 1;
+    }
+    if (pool->chain_key[0] != '\0') {
+      shared_mount_release(&pool->shared);
+    }
+    pool->shared = shared;
+  }
+
+  snprintf(pool->chain, sizeof(pool->chain), "%s", chain);
+  snprintf(pool->chain_key, sizeof(pool->chain_key), "%s", key);
+  return 0;
+}
+
+/*
+ * A client that resolved the image to another chain means it was rebuilt or
+ * retagged: re-resolve, and retire the warm sandboxes of the old chain so the
+ * refill replaces them. Running ones are left to finish.
+ */
+static void check_pool_chain(struct pool *pool, const char *client_key) {
+  int i;
+
+  if (strcmp(client_key, pool->chain_key) == 0 || resolve_pool_chain(pool) != 0) {
+    return;
+  }
+
+  for (i = 0; i < pool->count; i++) {
+    struct sandbox *sb = &pool->sandboxes[i];
+
+    if (strcmp(sb->chain_key, pool->chain_key) != 0 &&
+        (sb->state == SANDBOX_STARTING || sb->state == SANDBOX_READY)) {
+      kill(sb->pid, SIGKILL);
+      sb->state = SANDBOX_RETIRED;
+    }
+  }
+}
+
+static void serve_client(struct pool *pool, int conn) {
+  struct pool_request req;
+  struct pool_reply reply;
+  int fds[3];
+  int i;
+
+  reply.claimed = 0;
+  if (recv_with_fds(conn, &req, sizeof(req), fds, 3) != 0) {
+    close_fds(fds, 3);
+    close(conn);
+    return;
+  }
+
+  req.chain_key[sizeof(req.chain_key) - 1] = '\0';
+  check_pool_chain(pool, req.chain_key);
+
+  for (i = 0; i < pool->count; i++) {
+    struct sandbox *sb = &pool->sandboxes[i];
+
+    if (sb->state != SANDBOX_READY || sb->pidfd < 0 ||
+        strcmp(sb->chain_key, req.chain_key) != 0) {
+      continue;
+    }
+
+    if (send_with_fds(sb->ctl, &req, sizeof(req), fds, 3) != 0) {
+      continue;
+    }
+
+    sb->state = SANDBOX_RUNNING;
+    sb->client = conn;
+    reply.claimed = 1;
+    send_with_fds(conn, &reply, sizeof(reply), &sb->pidfd, 1);
+    close_fds(fds, 3);
+    return;
+  }
+
+  send_with_fds(conn, &reply, sizeof(reply), NULL, 0);
+  close_fds(fds, 3);
+  close(conn);
+}
+
+static void refill(struct pool *pool) {
+  int warm = 0;
+  int i;
+
+  for (i = 0; i < pool->count; i++) {
+    if (pool->sandboxes[i].state == SANDBOX_STARTING ||
+        pool->sandboxes[i].state == SANDBOX_READY) {
+      warm++;
+    }
+  }
+
+  while (warm < pool->size && pool->failures < POOL_MAX_SETUP_FAILURES) {
+    if (spawn_sandbox(pool) != 0) {
+      pool->failures++;
+      break;
+    }
+    warm++;
+  }
+}
+
+static int open_listener(struct pool *pool) {
+  struct sockaddr_un addr;
+
+  pool->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (pool->listen_fd < 0) {
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", pool->socket_path);
+  unlink(pool->socket_path);
+
+  if (bind(pool->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(pool->listen_fd, 64) != 0) {
+    fprintf(stderr, "[ERR] Failed to listen on %s: %s\n", pool->socket_path, strerror(errno));
+    close(pool->listen_fd);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void shutdown_pool(struct pool *pool) {
+  int i;
+
+  close(pool->listen_fd);
+  unlink(pool->socket_path);
+
+  for (i = 0; i < pool->count; i++) {
+    kill(pool->sandboxes[i].pid, SIGKILL);
+  }
+  while (pool->count > 0) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+
+    if (pid < 0 && errno != EINTR) {
+      break;
+    }
+    for (i = 0; pid > 0 && i < pool->count; i++) {
+      if (pool->sandboxes[i].pid == pid) {
+        release_sandbox(pool, i);
+        break;
+      }
+    }
+  }
+
+  free(pool->sandboxes);
+  if (pool->share_image && pool->chain_key[0] != '\0') {
+    shared_mount_release(&pool->shared);
+  }
+  close(pool->sfd);
+  sigprocmask(SIG_SETMASK, &pool->old_mask, NULL);
+}
+
+int pool_serve(const char *image_ref, int size, int share_image) {
+  struct pool pool;
+  sigset_t handled;
+  int rc = 0;
+
+  memset(&pool, 0, sizeof(pool));
+  snprintf(pool.image_ref, sizeof(pool.image_ref), "%s", image_ref);
+  pool.size = size;
+  pool.share_image = share_image;
+
+  if (pool_socket_path(image_ref, pool.socket_path, sizeof(pool.socket_path)) != 0) {
+    return 1;
+  }
+
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGCHLD);
+  sigaddset(&handled, SIGINT);
+  sigaddset(&handled, SIGTERM);
+  sigaddset(&handled, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &handled, &pool.old_mask) != 0) {
+    return 1;
+  }
+
+  pool.sfd = signalfd(-1, &handled, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (pool.sfd < 0) {
+    sigprocmask(SIG_SETMASK, &pool.old_mask, NULL);
+    return 1;
+  }
+
+  if (resolve_pool_chain(&pool) != 0 || open_listener(&pool) != 0) {
+    if (share_image && pool.chain_key[0] != '\0') {
+      shared_mount_release(&pool.shared);
+    }
+    close(pool.sfd);
+    sigprocmask(SIG_SETMASK, &pool.old_mask, NULL);
+    return 1;
+  }
+
+  printf("[POOL] Keeping %d sandboxes of %s warm on %s\n", size, image_ref, pool.socket_path);
+  fflush(stdout);
+
+  while (1) {
+    struct pollfd *pfds;
+    int nfds = 0;
+    int i;
+    int stop = 0;
+
+    refill(&pool);
+    if (pool.failures >= POOL_MAX_SETUP_FAILURES) {
+      fprintf(stderr, "[ERR] Pool sandboxes for %s keep failing to start\n", image_ref);
+      rc = 1;
+      break;
+    }
+
+    pfds = calloc((size_t)pool.count + 2, sizeof(*pfds));
+    if (pfds == NULL) {
+      rc = 1;
+      break;
+    }
+
+    pfds[nfds].fd = pool.sfd;
+    pfds[nfds++].events = POLLIN;
+    pfds[nfds].fd = pool.listen_fd;
+    pfds[nfds++].events = POLLIN;
+    for (i = 0; i < pool.count; i++) {
+      pfds[nfds].fd = pool.sandboxes[i].state == SANDBOX_STARTING ? pool.sandboxes[i].ctl : -1;
+      pfds[nfds++].events = POLLIN;
+    }
+
+    if (poll(pfds, (nfds_t)nfds, -1) < 0 && errno != EINTR) {
+      free(pfds);
+      rc = 1;
+      break;
+    }
+
+    /* Ready reports first: the sandbox array may shrink once children are reaped. */
+    for (i = 0; i < pool.count && i + 2 < nfds; i++) {
+      char ready;
+
+      if (pfds[i + 2].fd >= 0 && (pfds[i + 2].revents & POLLIN) &&
+          read(pool.sandboxes[i].ctl, &ready, 1) == 1) {
+        pool.sandboxes[i].state = SANDBOX_READY;
+        pool.failures = 0;
+      }
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      struct signalfd_siginfo si;
+
+      while (read(pool.sfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+        if (si.ssi_signo != SIGCHLD) {
+          stop = 1;
+        }
+      }
+      reap_sandboxes(&pool);
+    }
+
+    if (!stop && (pfds[1].revents & POLLIN)) {
+      int conn = accept4(pool.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+      if (conn >= 0) {
+        serve_client(&pool, conn);
+      }
+    }
+
+    free(pfds);
+    if (stop) {
+      break;
+    }
+  }
+
+  shutdown_pool(&pool);
+  return rc;
+}
+
+int pool_claim(const char *image_ref, const char *command, const char *hostname, int *pidfd,
+               int *exit_fd) {
+  static const int stdio_fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  struct sockaddr_un addr;
+  struct pool_request req;
+  struct pool_reply reply;
+  char chain[8192];
+  int fd;
+
+  *pidfd = -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (pool_socket_path(image_ref, addr.sun_path, sizeof(addr.sun_path)) != 0 ||
+      access(addr.sun_path, F_OK) != 0) {
+    return 1;
+  }
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return 1;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    close(fd);
+    return 1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  if (resolve_base_chain(image_ref, chain, sizeof(chain)) != 0 ||
+      hash_string(chain, req.chain_key) != 0) {
+    close(fd);
+    return 1;
+  }
+  snprintf(req.command, sizeof(req.command), "%s", command);
+  snprintf(req.hostname, sizeof(req.hostname), "%s", hostname);
+
+  if (send_with_fds(fd, &req, sizeof(req), stdio_fds, 3) != 0 ||
+      recv_with_fds(fd, &reply, sizeof(reply), pidfd, 1) != 0 || !reply.claimed ||
+      *pidfd < 0) {
+    if (*pidfd >= 0) {
+      close(*pidfd);
+    }
+    close(fd);
+    return 1;
+  }
+
+  *exit_fd = fd;
+  return 0;
+}
+
+int pool_read_exit(int exit_fd, int *exit_code) {
+  struct pool_exit ex;
+  int none;
+
+  if (recv_with_fds(exit_fd, &ex, sizeof(ex), &none, 0) != 0) {
+    return 1;
+  }
+
+  *exit_code = ex.exit_code;
+  return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#ifndef POOL_DEFAULT_SIZE
+#define POOL_DEFAULT_SIZE 4
+#endif
+
+#ifndef POOL_MAX_SIZE
+#define POOL_MAX_SIZE 64
+#endif
+
+/*
+ * Runs the warm pool for one image in the foreground: a zygote that keeps
+ * size sandboxes cloned into fresh namespaces, with the image's overlay
+ * mounted, chrooted and /proc mounted, each waiting for a command. Claimed
+ * sandboxes are replaced in the background. SIGINT/SIGTERM tear the pool
+ * down. With share_image, the pool holds the image's shared view for its
+ * lifetime and sandboxes stack on it.
+ */
+int pool_serve(const char *image_ref, int size, int share_image);
+
+/*
+ * Hands command to a ready sandbox of image_ref's pool, along with this
+ * process's stdin/stdout/stderr. Only sandboxes mounted on the layer chain
+ * image_ref resolves to now are handed out; the pool retires older ones.
+ * Returns 0 and sets *pidfd (the sandbox's init) and *exit_fd (readable once
+ * it exits) when a sandbox was claimed, and 1 when there is no pool or it has
+ * nothing ready on that chain.
+ */
+int pool_claim(const char *image_ref, const char *command, const char *hostname, int *pidfd,
+               int *exit_fd);
+int pool_read_exit(int exit_fd, int *exit_code);
+
+#endif
@@ -0,0 +1,354 @@
+#define _GNU_SOURCE
+
+#include "prefetch.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "download.h"
+#include "utils.h"
+
+enum prefetch_kind {
+  PREFETCH_HASH = 0,
+  PREFETCH_DOWNLOAD = 1,
+};
+
+enum prefetch_state {
+  PREFETCH_PENDING = 0,
+  PREFETCH_RUNNING = 1,
+  PREFETCH_DONE = 2,
+  /* Invalidated, and dropped from the array once no job is running. */
+  PREFETCH_STALE = 3,
+};
+
+/* path is the URL for downloads; checksum is only used by downloads. */
+struct prefetch_job {
+  enum prefetch_kind kind;
+  char path[PATH_MAX];
+  const struct path_filter *filter;
+  char checksum[80];
+  enum prefetch_state state;
+  int rc;
+  char hash[17];
+  struct download dl;
+};
+
+struct prefetch_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t *threads;
+  int thread_count;
+  int stopping;
+  struct prefetch_job *jobs;
+  size_t job_count;
+  size_t job_cap;
+  size_t next_pending;
+};
+
+static struct prefetch_job *find_job(struct prefetch_pool *pool, enum prefetch_kind kind,
+                                     const char *path, const struct path_filter *filter,
+                                     const char *checksum) {
+  size_t i;
+
+  for (i = 0; i < pool->job_count; i++) {
+    if (pool->jobs[i].state != PREFETCH_STALE && pool->jobs[i].kind == kind &&
+        pool->jobs[i].filter == filter &&
+        strcmp(pool->jobs[i].path, path) == 0 && strcmp(pool->jobs[i].checksum, checksum) == 0) {
+      return &pool->jobs[i];
+    }
+  }
+
+  return NULL;
+}
+
+/* Runs job index idx with the lock dropped; the job must already be RUNNING. */
+static void run_job(struct prefetch_pool *pool, size_t idx) {
+  struct prefetch_job job = pool->jobs[idx];
+  int rc;
+
+  pthread_mutex_unlock(&pool->lock);
+  if (job.kind == PREFETCH_DOWNLOAD) {
+    rc = download_fetch(job.path, job.checksum, 0, &job.dl);
+  } else {
+    rc = hash_path_filtered(job.path, job.filter, job.hash);
+  }
+  pthread_mutex_lock(&pool->lock);
+
+  pool->jobs[idx].rc = rc;
+  snprintf(pool->jobs[idx].hash, sizeof(pool->jobs[idx].hash), "%s", job.hash);
+  pool->jobs[idx].dl = job.dl;
+  pool->jobs[idx].state = PREFETCH_DONE;
+  pthread_cond_broadcast(&pool->changed);
+}
+
+static void *prefetch_worker(void *arg) {
+  struct prefetch_pool *pool = (struct prefetch_pool *)arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (!pool->stopping && pool->next_pending >= pool->job_count) {
+      pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+
+    if (pool->stopping) {
+      break;
+    }
+
+    {
+      size_t idx = pool->next_pending++;
+      if (pool->jobs[idx].state != PREFETCH_PENDING) {
+        continue;
+      }
+      pool->jobs[idx].state = PREFETCH_RUNNING;
+      run_job(pool, idx);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+struct prefetch_pool *prefetch_start(int workers) {
+  struct prefetch_pool *pool;
+  int i;
+
+  if (workers <= 0) {
+    return NULL;
+  }
+
+  pool = calloc(1, sizeof(*pool));
+  if (pool == NULL) {
+    return NULL;
+  }
+
+  pool->threads = calloc((size_t)workers, sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    free(pool);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->changed, NULL);
+
+  for (i = 0; i < workers; i++) {
+    if (pthread_create(&pool->threads[i], NULL, prefetch_worker, pool) != 0) {
+      break;
+    }
+    pool->thread_count++;
+  }
+
+  if (pool->thread_count == 0) {
+    prefetch_stop(pool);
+    return NULL;
+  }
+
+  return pool;
+}
+
+void prefetch_stop(struct prefetch_pool *pool) {
+  int i;
+
+  if (pool == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i < pool->thread_count; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->changed);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool->jobs);
+  free(pool);
+}
+
+static int queue_job(struct prefetch_pool *pool, enum prefetch_kind kind, const char *path,
+                     const struct path_filter *filter, const char *checksum) {
+  struct prefetch_job *job;
+
+  if (pool == NULL || path == NULL || path[0] == '\0') {
+    return 1;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  if (find_job(pool, kind, path, filter, checksum) != NULL) {
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+  }
+
+  if (pool->job_count == pool->job_cap) {
+    size_t new_cap = pool->job_cap == 0 ? 16 : pool->job_cap * 2;
+    struct prefetch_job *new_jobs = realloc(pool->jobs, new_cap * sizeof(*new_jobs));
+    if (new_jobs == NULL) {
+      pthread_mutex_unlock(&pool->lock);
+      return 1;
+    }
+    pool->jobs = new_jobs;
+    pool->job_cap = new_cap;
+  }
+
+  job = &pool->jobs[pool->job_count++];
+  memset(job, 0, sizeof(*job));
+  job->kind = kind;
+  snprintf(job->path, sizeof(job->path), "%s", path);
+  job->filter = filter;
+  snprintf(job->checksum, sizeof(job->checksum), "%s", checksum);
+  job->state = PREFETCH_PENDING;
+
+  pthread_cond_broadcast(&pool->changed);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+int prefetch_hash_path(struct prefetch_pool *pool, const char *path,
+                       const struct path_filter *filter) {
+  return queue_job(pool, PREFETCH_HASH, path, filter, "");
+}
+
+int prefetch_download(struct prefetch_pool *pool, const char *url, const char *checksum) {
+  return queue_job(pool, PREFETCH_DOWNLOAD, url, NULL, checksum == NULL ? "" : checksum);
+}
+
+static int running_job(struct prefetch_pool *pool, const char *path) {
+  size_t i;
+
+  for (i = 0; i < pool->job_count; i++) {
+    if (pool->jobs[i].state == PREFETCH_RUNNING &&
+        (path == NULL || strcmp(pool->jobs[i].path, path) == 0)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Forgets finished results for path (hashes under any filter, or a URL's
+ * download) so the next request computes them again. Only running jobs for
+ * path are waited for. Workers hold job indices while the lock is dropped, so
+ * forgotten jobs are only marked stale while anything runs, and removed from
+ * the array once nothing does.
+ */
+void prefetch_invalidate(struct prefetch_pool *pool, const char *path) {
+  size_t removed_before = 0;
+  size_t kept = 0;
+  size_t i;
+
+  if (pool == NULL || path == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  while (running_job(pool, path)) {
+    pthread_cond_wait(&pool->changed, &pool->lock);
+  }
+
+  for (i = 0; i < pool->job_count; i++) {
+    if (pool->jobs[i].state == PREFETCH_DONE && strcmp(pool->jobs[i].path, path) == 0) {
+      pool->jobs[i].state = PREFETCH_STALE;
+    }
+  }
+
+  if (running_job(pool, NULL)) {
+    pthread_mutex_unlock(&pool->lock);
+    return;
+  }
+
+  for (i = 0; i < pool->job_count; i++) {
+    if (pool->jobs[i].state == PREFETCH_STALE) {
+      if (i < pool->next_pending) {
+        removed_before++;
+      }
+      continue;
+    }
+    pool->jobs[kept++] = pool->jobs[i];
+  }
+
+  pool->job_count = kept;
+  pool->next_pending -= removed_before;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Finds the job and waits for it to finish, running it on the calling thread
+ * if no worker has picked it up yet. Returns with the lock held, or NULL
+ * (unlocked) when the job was never queued.
+ */
+static struct prefetch_job *claim_and_wait(struct prefetch_pool *pool, enum prefetch_kind kind,
+                                           const char *path, const struct path_filter *filter,
+                                           const char *checksum) {
+  struct prefetch_job *job;
+  size_t idx;
+
+  pthread_mutex_lock(&pool->lock);
+  job = find_job(pool, kind, path, filter, checksum);
+  if (job == NULL) {
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+  }
+
+  idx = (size_t)(job - pool->jobs);
+  if (pool->jobs[idx].state == PREFETCH_PENDING) {
+    pool->jobs[idx].state = PREFETCH_RUNNING;
+    run_job(pool, idx);
+  }
+
+  while (pool->jobs[idx].state != PREFETCH_DONE) {
+    pthread_cond_wait(&pool->changed, &pool->lock);
+  }
+
+  return &pool->jobs[idx];
+}
+
+/*
+ * Returns the hash of path, waiting for a queued job if a worker is on it. A
+ * job nobody has started yet is run by the caller instead of waiting in line,
+ * and a path that was never queued is hashed directly.
+ */
+int prefetch_wait_hash(struct prefetch_pool *pool, const char *path,
+                       const struct path_filter *filter, char out_hex[17]) {
+  struct prefetch_job *job;
+  int rc;
+
+  job = pool == NULL ? NULL : claim_and_wait(pool, PREFETCH_HASH, path, filter, "");
+  if (job == NULL) {
+    return hash_path_filtered(path, filter, out_hex);
+  }
+
+  rc = job->rc;
+  if (rc == 0) {
+    snprintf(out_hex, 17, "%s", job->hash);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return rc;
+}
+
+/* Download counterpart of prefetch_wait_hash. */
+int prefetch_wait_download(struct prefetch_pool *pool, const char *url, const char *checksum,
+                           struct download *out) {
+  struct prefetch_job *job;
+  int rc;
+
+  if (checksum == NULL) {
+    checksum = "";
+  }
+
+  job = pool == NULL ? NULL : claim_and_wait(pool, PREFETCH_DOWNLOAD, url, NULL, checksum);
+  if (job == NULL) {
+    return download_fetch(url, checksum, 0, out);
+  }
+
+  rc = job->rc;
+  if (rc == 0) {
+    *out = job->dl;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return rc;
+}
@@ -0,0 +1,30 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#ifndef PREFETCH_WORKERS
+#define PREFETCH_WORKERS 4
+#endif
+
+/* Worker count, and so the connection limit, of the ADD <url> download pool. */
+#ifndef PREFETCH_DOWNLOADS
+#define PREFETCH_DOWNLOADS 3
+#endif
+
+struct prefetch_pool;
+struct path_filter;
+struct download;
+
+struct prefetch_pool *prefetch_start(int workers);
+void prefetch_stop(struct prefetch_pool *pool);
+
+int prefetch_hash_path(struct prefetch_pool *pool, const char *path,
+                       const struct path_filter *filter);
+void prefetch_invalidate(struct prefetch_pool *pool, const char *path);
+int prefetch_wait_hash(struct prefetch_pool *pool, const char *path,
+                       const struct path_filter *filter, char out_hex[17]);
+
+int prefetch_download(struct prefetch_pool *pool, const char *url, const char *checksum);
+int prefetch_wait_download(struct prefetch_pool *pool, const char *url, const char *checksum,
+                           struct download *out);
+
+#endif
@@ -1,84 +1,466 @@
 #define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mount.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "cgroup.h"
 #include "config.h"
+#include "container_store.h"
+#include "metrics.h"
+#include "numa.h"
+#include "pool.h"
 #include "run.h"
 #include "setup.h"
+#include "shared_mount.h"
+#include "spawn.h"
 
 void container_from_config(struct config cfg, struct container *c) {
   strncpy(c->id, cfg.name, sizeof(c->id));
   strncpy(c->command, cfg.command, sizeof(c->command));
   strncpy(c->base_dir, cfg.base_dir, sizeof(c->base_dir));
   strncpy(c->base_image, cfg.base_image, sizeof(c->base_image));
+  c->timings = cfg.timings;
+  c->share_image = cfg.share_image;
+  c->detach = cfg.detach;
+  c->ready_fd = -1;
+  c->limits = cfg.limits;
+  c->numa_node = cfg.numa_node;
 }
 
-int run_container(struct container cont) {
-  pid_t pid;
-  int ns_flags = CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWTIME;
+static int open_pidfd(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  errno = ENOSYS;
+  return -1;
+#endif
+}
 
-  if (unshare(ns_flags) != 0) {
-    if (errno == EINVAL) {
-      ns_flags = CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWUTS;
-      if (unshare(ns_flags) != 0) {
-        fprintf(stderr, "[ERR] Failed to unshare namespaces: %s\n",
-                strerror(errno));
+static int signal_child(int pidfd, pid_t pid, int sig) {
+#ifdef SYS_pidfd_send_signal
+  if (pidfd >= 0) {
+    return (int)syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+  }
+#endif
+  return kill(pid, sig);
+}
+
+static int exit_code_of(int status) {
+  if (WIFEXITED(status)) {
+    return WEXITSTATUS(status);
+  }
+  if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  }
+  return 1;
+}
+
+/*
+ * Sleeps in poll() until the child exits or a signal arrives, so the parent
+ * returns as soon as the container does. SIGINT, SIGTERM and SIGHUP are
+ * forwarded. The child is PID 1 of its namespace and drops signals it has no
+ * handler for, so a second one escalates to SIGKILL. Without pidfd support,
+ * SIGCHLD on the signalfd stands in for the pidfd becoming readable.
+ *
+ * A container claimed from a warm pool is not our child: pidfd comes from
+ * the pool and its exit code arrives on exit_fd instead of from waitpid.
+ */
+static int supervise_child(pid_t pid, int pidfd, int exit_fd, int sfd, int *exit_code) {
+  int forwarded = 0;
+
+  if (pidfd < 0 && exit_fd < 0) {
+    pidfd = open_pidfd(pid);
+  }
+
+  while (1) {
+    struct pollfd pfds[2];
+    int nfds = 0;
+    int status;
+    pid_t done;
+
+    pfds[nfds].fd = sfd;
+    pfds[nfds++].events = POLLIN;
+    if (exit_fd >= 0) {
+      pfds[nfds].fd = exit_fd;
+      pfds[nfds++].events = POLLIN;
+    } else if (pidfd >= 0) {
+      pfds[nfds].fd = pidfd;
+      pfds[nfds++].events = POLLIN;
+    }
+
+    if (poll(pfds, (nfds_t)nfds, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "[ERR] poll failed: %s\n", strerror(errno));
+      break;
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      struct signalfd_siginfo si;
+
+      while (read(sfd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+        if (si.ssi_signo == SIGCHLD) {
+          continue;
+        }
+        signal_child(pidfd, pid, forwarded ? SIGKILL : (int)si.ssi_signo);
+        forwarded = 1;
+      }
+    }
+
+    if (exit_fd >= 0) {
+      if (nfds < 2 || !(pfds[1].revents & (POLLIN | POLLHUP))) {
+        continue;
+      }
+      if (pidfd >= 0) {
+        close(pidfd);
+      }
+      if (pool_read_exit(exit_fd, exit_code) != 0) {
+        fprintf(stderr, "[ERR] Lost track of pooled container\n");
         return 1;
       }
-      fprintf(stderr,
-              "[WARN] CLONE_NEWTIME is not supported; running without time namespace.\n");
-    } else {
-      fprintf(stderr, "[ERR] Failed to unshare namespaces: %s\n", strerror(errno));
+      return 0;
+    }
+
+    done = waitpid(pid, &status, WNOHANG);
+    if (done < 0) {
+      fprintf(stderr, "[ERR] waitpid failed: %s\n", strerror(errno));
+      break;
+    }
+
+    if (done == pid) {
+      if (pidfd >= 0) {
+        close(pidfd);
+      }
+      *exit_code = exit_code_of(status);
+      return 0;
+    }
+  }
+
+  if (pidfd >= 0) {
+    close(pidfd);
+  }
+  return 1;
+}
+
+/*
+ * Collects the child's phase marks. The child writes them just before exec
+ * and the pipe is close-on-exec, so EOF is the moment exec succeeded.
+ * Returns 0 if the child got as far as exec.
+ */
+static int collect_child_timings(int fd, struct run_timings *timings) {
+  struct run_timings child;
+  size_t got = 0;
+  char drain;
+  int i;
+
+  while (got < sizeof(child)) {
+    ssize_t n = read(fd, (char *)&child + got, sizeof(child) - got);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return 1;
+    }
+    got += (size_t)n;
+  }
+
+  while (read(fd, &drain, 1) < 0 && errno == EINTR) {
+  }
+  timing_mark(timings, PHASE_EXEC);
+
+  for (i = PHASE_FORK; i < PHASE_EXEC; i++) {
+    timings->mark_ns[i] = child.mark_ns[i];
+  }
+  return 0;
+}
+
+static int block_supervised_signals(sigset_t *old_mask) {
+  sigset_t supervised;
+  int sfd;
+
+  sigemptyset(&supervised);
+  sigaddset(&supervised, SIGINT);
+  sigaddset(&supervised, SIGTERM);
+  sigaddset(&supervised, SIGHUP);
+  sigaddset(&supervised, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &supervised, old_mask) != 0) {
+    return -1;
+  }
+
+  sfd = signalfd(-1, &supervised, SFD_CLOEXEC | SFD_NONBLOCK);
+  if (sfd < 0) {
+    fprintf(stderr, "[ERR] signalfd failed: %s\n", strerror(errno));
+    sigprocmask(SIG_SETMASK, old_mask, NULL);
+  }
+  return sfd;
+}
+
+/* Host pid of the process behind a pidfd, from its fdinfo. */
+static pid_t pidfd_pid(int pidfd) {
+  char path[64];
+  char line[256];
+  pid_t pid = 0;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "/proc/self/fdinfo/%d", pidfd);
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    return 0;
+  }
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    long value;
+
+    if (sscanf(line, "Pid: %ld", &value) == 1) {
+      pid = (pid_t)value;
+      break;
+    }
+  }
+
+  fclose(fp);
+  return pid;
+}
+
+static void state_from_container(const struct container *cont, struct container_state *st) {
+  memset(st, 0, sizeof(*st));
+  snprintf(st->id, sizeof(st->id), "%s", cont->id);
+  snprintf(st->image, sizeof(st->image), "%s",
+           strlen(cont->base_dir) > 0 ? cont->base_dir : cont->base_image);
+  snprintf(st->command, sizeof(st->command), "%s", cont->command);
+  st->numa_node = cont->numa_node;
+  snprintf(st->cpuset_cpus, sizeof(st->cpuset_cpus), "%s", cont->limits.cpuset_cpus);
+  snprintf(st->cpuset_mems, sizeof(st->cpuset_mems), "%s", cont->limits.cpuset_mems);
+}
+
+/*
+ * Called once the container's command is running: records its pid so that
+ * exec, stop and ps can find it, and lets a detached run's CLI return. A
+ * foreground run acts as its own shim.
+ */
+static void container_started(const struct container *cont, pid_t pid) {
+  struct container_state st;
+
+  if (cont->detach && load_container_state(cont->id, &st) != 0) {
+    fprintf(stderr, "[WARN] Lost state of %s\n", cont->id);
+  } else {
+    if (!cont->detach) {
+      char root[4096];
+
+      snprintf(root, sizeof(root), "%s/%s", ZOCKER_CONTAINERS_DIR, cont->id);
+      mkdir(root, 0755);
+      state_from_container(cont, &st);
+      st.shim_pid = getpid();
+    }
+
+    st.status = CONTAINER_RUNNING;
+    st.pid = pid;
+    st.started_at = (long)time(NULL);
+    if (save_container_state(&st) != 0) {
+      fprintf(stderr, "[WARN] Failed to record state of %s\n", cont->id);
+    }
+  }
+
+  if (cont->ready_fd >= 0) {
+    if (write(cont->ready_fd, &pid, sizeof(pid)) != (ssize_t)sizeof(pid)) {
+      fprintf(stderr, "[WARN] Failed to notify zocker run of %s\n", cont->id);
+    }
+    close(cont->ready_fd);
+  }
+}
+
+/* Records how the container ended, if this process is its shim. */
+static int container_finished(const struct container *cont, int rc, int exit_code) {
+  struct container_state st;
+
+  if (load_container_state(cont->id, &st) != 0 || st.shim_pid != getpid()) {
+    return 0;
+  }
+
+  st.status = rc == 0 ? CONTAINER_EXITED : CONTAINER_FAILED;
+  st.exit_code = rc == 0 ? exit_code : -1;
+  st.finished_at = (long)time(NULL);
+  return save_container_state(&st);
+}
+
+static void finish_timings(const struct container *cont, const struct run_timings *timings) {
+  if (record_run_timings(timings) != 0) {
+    fprintf(stderr, "[WARN] Failed to record startup timings\n");
+  }
+  if (cont->timings) {
+    print_run_timings(cont->id, timings);
+  }
+}
+
+/* Printed once a foreground container exits; scripts may match it as is. */
+static void report_stopped(void) { printf("[Parent] Stoping...\n"); }
+
+/*
+ * Hands the command to a warm sandbox of the image's pool, if one is
+ * running. Returns 0 if the container ran there, 1 if there was none to
+ * claim and the caller should start a container itself, -1 on errors.
+ */
+static int run_pooled(struct container *cont, struct run_timings *timings, int *exit_code) {
+  sigset_t old_mask;
+  int exit_fd;
+  int pidfd;
+  int sfd;
+  int rc;
+
+  sfd = block_supervised_signals(&old_mask);
+  if (sfd < 0) {
+    return -1;
+  }
+
+  fflush(stdout);
+  if (pool_claim(cont->base_image, cont->command, cont->id, &pidfd, &exit_fd) != 0) {
+    close(sfd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 1;
+  }
+  timing_mark(timings, PHASE_EXEC);
+  container_started(cont, pidfd_pid(pidfd));
+
+  rc = supervise_child(0, pidfd, exit_fd, sfd, exit_code);
+  close(exit_fd);
+  close(sfd);
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+  finish_timings(cont, timings);
+  if (rc == 0) {
+    report_stopped();
+  }
+  return rc == 0 ? 0 : -1;
+}
+
+/*
+ * Starts the container's init with one clone3 that creates its namespaces,
+ * places it in its cgroup and hands back a pidfd; this process's own
+ * namespaces are left alone. The child reports its setup steps over a sync
+ * pipe that closes on exec. With lower_chain set, the rootfs is a thin
+ * overlay over it instead of over the resolved image chain.
+ */
+static int run_cold(const struct container *cont, struct run_timings *timings,
+                    const char *lower_chain, int *exit_code) {
+  sigset_t old_mask;
+  int sync_pipe[2];
+  int cgroup_fd = -1;
+  int pidfd = -1;
+  int timed;
+  int sfd;
+  int rc;
+  pid_t pid;
+  pid_t shim_pid = cont->detach ? getpid() : 0;
+  int ns_flags = CLONE_NEWPID | CLONE_NEWNS | CLONE_NEWUTS | CLONE_NEWTIME;
+
+  sfd = block_supervised_signals(&old_mask);
+  if (sfd < 0) {
+    return 1;
+  }
+
+  if (pipe2(sync_pipe, O_CLOEXEC) != 0) {
+    close(sfd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 1;
+  }
+
+  /* Without limits the cgroup is only for accounting, and optional. */
+  if (cgroup_limits_set(&cont->limits) || cgroup_available()) {
+    cgroup_fd = cgroup_create(cont->id, &cont->limits);
+    if (cgroup_fd < 0 && !cgroup_limits_set(&cont->limits)) {
+      fprintf(stderr, "[WARN] Running %s without a cgroup; it will not show in stats\n",
+              cont->id);
+    } else if (cgroup_fd < 0) {
+      close(sfd);
+      close(sync_pipe[0]);
+      close(sync_pipe[1]);
+      sigprocmask(SIG_SETMASK, &old_mask, NULL);
       return 1;
     }
   }
 
-  pid = fork();
+  fflush(stdout);
+  pid = spawn_process(&ns_flags, cgroup_fd, &pidfd);
   if (pid < 0) {
+    fprintf(stderr, "[ERR] Failed to create container process: %s\n", strerror(errno));
+    close(sfd);
+    close(sync_pipe[0]);
+    close(sync_pipe[1]);
+    if (cgroup_fd >= 0) {
+      close(cgroup_fd);
+      cgroup_remove(cont->id);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
     return 1;
   }
 
+  /*
+   * The child must never return into our callers: with --share-image they
+   * would release the shared view from inside the new PID namespace.
+   */
   if (pid == 0) {
     char container_dir[4096];
-    if (strlen(cont.base_dir) > 0) {
-      snprintf(container_dir, sizeof(container_dir), "%s", cont.base_dir);
-    } else if (setup_container_dir(cont.id, container_dir, sizeof(container_dir),
-                                   cont.base_image) != 0) {
-      fprintf(stderr, "[ERR] Failed to setup container directory for %s\n",
-              cont.id);
-      return 1;
+
+    timing_mark(timings, PHASE_FORK);
+    close(sync_pipe[0]);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (numa_apply_placement(&cont->limits) != 0) {
+      _exit(1);
     }
 
+    /* Private first, so the rootfs mounts below never propagate to the host. */
     if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
       fprintf(stderr, "[ERR] Failed to change mount to private: %s\n",
               strerror(errno));
-      return 1;
+      _exit(1);
+    }
+
+    if (strlen(cont->base_dir) > 0) {
+      snprintf(container_dir, sizeof(container_dir), "%s", cont->base_dir);
+    } else if ((lower_chain != NULL
+                    ? setup_container_dir_on(cont->id, shim_pid, container_dir,
+                                             sizeof(container_dir), lower_chain, timings)
+                    : setup_container_dir(cont->id, shim_pid, container_dir,
+                                          sizeof(container_dir), cont->base_image,
+                                          timings)) != 0) {
+      fprintf(stderr, "[ERR] Failed to setup container directory for %s\n",
+              cont->id);
+      _exit(1);
     }
 
     if (chroot(container_dir) != 0) {
       fprintf(stderr,
               "[ERR] Failed to chroot into container directory for %s: %s\n",
-              cont.id, strerror(errno));
-      return 1;
+              cont->id, strerror(errno));
+      _exit(1);
     }
 
     if (chdir("/") != 0) {
       fprintf(stderr, "[ERR] Failed to change directory to root: %s\n",
               strerror(errno));
-      return 1;
+      _exit(1);
     }
+    timing_mark(timings, PHASE_CHROOT);
 
     if (mkdir("/proc", 0555) != 0) {
       if (errno != EEXIST) {
         fprintf(stderr, "[ERR] Failed to create /proc directory: %s\n",
                 strerror(errno));
-        return 1;
+        _exit(1);
       }
     }
 
@@ -86,29 +468,287 @@ int run_container(struct container cont) {
       fprintf(stderr, "[WARN] Failed to remount /proc: %s\n", strerror(errno));
     }
 
-    if (sethostname(cont.id, 64) != 0) {
+    if (sethostname(cont->id, 64) != 0) {
       fprintf(stderr, "[WARN] Failed to set hostname: %s\n", strerror(errno));
     }
 
     printf("Running child with pid: %d\n", getpid());
-    if (execl("/bin/sh", "sh", "-c", cont.command, NULL) != 0) {
-      fprintf(stderr, "[ERR] Failed to call create container process: %s\n",
-              strerror(errno));
-      return 1;
+    fflush(stdout);
+    timing_mark(timings, PHASE_PROC);
+    if (write(sync_pipe[1], timings, sizeof(*timings)) != (ssize_t)sizeof(*timings)) {
+      fprintf(stderr, "[WARN] Failed to report startup timings\n");
     }
-  } else {
-    int status = 0;
-    sleep(2);
-    if (waitpid(pid, &status, 0) < 0) {
-      fprintf(stderr, "[ERR] waitpid failed: %s\n", strerror(errno));
-      return 1;
+    execl("/bin/sh", "sh", "-c", cont->command, NULL);
+    fprintf(stderr, "[ERR] Failed to call create container process: %s\n", strerror(errno));
+    _exit(127);
+  }
+
+  if (!(ns_flags & CLONE_NEWTIME)) {
+    fprintf(stderr,
+            "[WARN] CLONE_NEWTIME is not supported; running without time namespace.\n");
+  }
+
+  close(sync_pipe[1]);
+  timed = collect_child_timings(sync_pipe[0], timings) == 0;
+  close(sync_pipe[0]);
+  if (timed) {
+    container_started(cont, pid);
+  }
+
+  rc = supervise_child(pid, pidfd, -1, sfd, exit_code);
+  close(sfd);
+  if (cgroup_fd >= 0) {
+    close(cgroup_fd);
+    cgroup_remove(cont->id);
+  }
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+  if (timed) {
+    finish_timings(cont, timings);
+  }
+
+  if (rc == 0) {
+    report_stopped();
+  }
+  return rc;
+}
+
+static int run_attached(struct container cont, int *exit_code) {
+  struct run_timings timings;
+  struct shared_mount shared;
+  int rc;
+
+  timing_start(&timings);
+
+  if (strlen(cont.base_dir) > 0) {
+    return run_cold(&cont, &timings, NULL, exit_code);
+  }
+
+  /* Warm sandboxes already run outside any per-container cgroup. */
+  rc = cgroup_limits_set(&cont.limits) ? 1 : run_pooled(&cont, &timings, exit_code);
+  if (rc <= 0) {
+    return rc == 0 ? 0 : 1;
+  }
+
+  if (!cont.share_image) {
+    return run_cold(&cont, &timings, NULL, exit_code);
+  }
+
+  if (shared_mount_acquire(cont.base_image, &shared) != 0) {
+    return 1;
+  }
+
+  rc = run_cold(&cont, &timings, shared.lower, exit_code);
+  if (shared_mount_release(&shared) != 0) {
+    fprintf(stderr, "[WARN] Failed to release shared image mount\n");
+  }
+  return rc;
+}
+
+/*
+ * Runs the container under a shim: a forked, session-leading copy of this
+ * process that supervises it like a foreground run, with stdio going to
+ * ZOCKER_CONTAINERS_DIR/<id>/log, and records its state there. The CLI only
+ * waits for the container's command to start.
+ */
+static int run_detached(struct container cont) {
+  struct container_state st;
+  char root[4096];
+  char log_path[4096];
+  int ready[2];
+  pid_t shim;
+  pid_t pid;
+  ssize_t n;
+
+  snprintf(root, sizeof(root), "%s/%s", ZOCKER_CONTAINERS_DIR, cont.id);
+  if (mkdir(root, 0755) != 0) {
+    if (errno == EEXIST) {
+      fprintf(stderr, "[ERR] Container %s already exists\n", cont.id);
+    } else {
+      fprintf(stderr, "[ERR] Failed to create container directory: %s\n", strerror(errno));
     }
-    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
-      fprintf(stderr, "[ERR] Container child failed with status=%d\n",
-              WIFEXITED(status) ? WEXITSTATUS(status) : -1);
-      return 1;
+    return 1;
+  }
+
+  state_from_container(&cont, &st);
+  st.status = CONTAINER_CREATED;
+  if (save_container_state(&st) != 0 || pipe2(ready, O_CLOEXEC) != 0) {
+    fprintf(stderr, "[ERR] Failed to record state of %s\n", cont.id);
+    return 1;
+  }
+
+  snprintf(log_path, sizeof(log_path), "%s/log", root);
+  fflush(stdout);
+  fflush(stderr);
+  shim = fork();
+  if (shim < 0) {
+    close(ready[0]);
+    close(ready[1]);
+    return 1;
+  }
+
+  if (shim == 0) {
+    int exit_code = 0;
+    int devnull;
+    int log_fd;
+    int rc;
+
+    close(ready[0]);
+    setsid();
+    devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (devnull < 0 || log_fd < 0 || dup2(devnull, STDIN_FILENO) < 0 ||
+        dup2(log_fd, STDOUT_FILENO) < 0 || dup2(log_fd, STDERR_FILENO) < 0) {
+      _exit(1);
     }
-    printf("[Parent] Stoping...\n");
+    close(devnull);
+    close(log_fd);
+
+    st.shim_pid = getpid();
+    save_container_state(&st);
+
+    cont.ready_fd = ready[1];
+    rc = run_attached(cont, &exit_code);
+    fflush(stdout);
+    _exit(container_finished(&cont, rc, exit_code) != 0);
+  }
+
+  close(ready[1]);
+  do {
+    n = read(ready[0], &pid, sizeof(pid));
+  } while (n < 0 && errno == EINTR);
+  close(ready[0]);
+
+  if (n != (ssize_t)sizeof(pid)) {
+    fprintf(stderr, "[ERR] Container %s failed to start; see %s\n", cont.id, log_path);
+    return 1;
   }
+
+  printf("%s\n", cont.id);
   return 0;
 }
+
+int run_container(struct container cont, int *exit_code) {
+  int rc;
+
+  /* Placed before detaching, so the allocator sees it in the created state. */
+  if (cont.numa_node != NUMA_NODE_NONE) {
+    if (numa_place(&cont.numa_node, &cont.limits) != 0) {
+      return 1;
+    }
+    fprintf(stderr, "[NUMA] Placing %s on node %d (CPUs %s)\n", cont.id, cont.numa_node,
+            cont.limits.cpuset_cpus);
+  }
+
+  if (cont.detach) {
+    *exit_code = 0;
+    return run_detached(cont);
+  }
+
+  rc = run_attached(cont, exit_code);
+  if (container_finished(&cont, rc, *exit_code) != 0) {
+    fprintf(stderr, "[WARN] Failed to record state of %s\n", cont.id);
+  }
+  return rc;
+}
+
+/*
+ * Joins the mount, PID and UTS namespaces of a running container's init
+ * through its pidfd and chroots into the same rootfs, through
+ * /proc/<pid>/root, which is opened before leaving the host's mount
+ * namespace. Joining a PID namespace only applies to children, so the
+ * command costs exactly one fork; it also starts inside the container's
+ * cgroup, if it has one, with the same CPU affinity and memory policy.
+ * SIGINT, SIGTERM and SIGHUP are forwarded to it as for a foreground run.
+ */
+int exec_container(const char *id, const char *command, int *exit_code) {
+  struct container_state st;
+  sigset_t old_mask;
+  char root_path[64];
+  int cgroup_fd;
+  int root_fd;
+  int pidfd;
+  int sfd;
+  int rc;
+  pid_t pid;
+
+  if (load_container_state(id, &st) != 0) {
+    fprintf(stderr, "[ERR] Container not found: %s\n", id);
+    return 1;
+  }
+
+  pidfd = st.status == CONTAINER_RUNNING ? open_pidfd(st.pid) : -1;
+  if (pidfd < 0) {
+    fprintf(stderr, "[ERR] Container %s is not running\n", id);
+    return 1;
+  }
+
+  snprintf(root_path, sizeof(root_path), "/proc/%ld/root", (long)st.pid);
+  root_fd = open(root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0) {
+    fprintf(stderr, "[ERR] Failed to open rootfs of %s: %s\n", id, strerror(errno));
+    close(pidfd);
+    return 1;
+  }
+
+  cgroup_fd = cgroup_open(id);
+  if (setns(pidfd, CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWUTS) != 0) {
+    fprintf(stderr, "[ERR] Failed to enter namespaces of %s: %s\n", id, strerror(errno));
+    close(root_fd);
+    close(pidfd);
+    if (cgroup_fd >= 0) {
+      close(cgroup_fd);
+    }
+    return 1;
+  }
+  close(pidfd);
+
+  if (fchdir(root_fd) != 0 || chroot(".") != 0 || chdir("/") != 0) {
+    fprintf(stderr, "[ERR] Failed to chroot into %s: %s\n", id, strerror(errno));
+    close(root_fd);
+    if (cgroup_fd >= 0) {
+      close(cgroup_fd);
+    }
+    return 1;
+  }
+  close(root_fd);
+
+  sfd = block_supervised_signals(&old_mask);
+  if (sfd < 0) {
+    if (cgroup_fd >= 0) {
+      close(cgroup_fd);
+    }
+    return 1;
+  }
+
+  fflush(stdout);
+  pid = spawn_process(NULL, cgroup_fd, &pidfd);
+  if (cgroup_fd >= 0) {
+    close(cgroup_fd);
+  }
+  if (pid < 0) {
+    fprintf(stderr, "[ERR] Failed to fork into %s: %s\n", id, strerror(errno));
+    close(sfd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 1;
+  }
+
+  if (pid == 0) {
+    struct cgroup_limits placement;
+
+    memset(&placement, 0, sizeof(placement));
+    snprintf(placement.cpuset_cpus, sizeof(placement.cpuset_cpus), "%s", st.cpuset_cpus);
+    snprintf(placement.cpuset_mems, sizeof(placement.cpuset_mems), "%s", st.cpuset_mems);
+    if (numa_apply_placement(&placement) != 0) {
+      _exit(1);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    execl("/bin/sh", "sh", "-c", command, NULL);
+    _exit(127);
+  }
+
+  rc = supervise_child(pid, pidfd, -1, sfd, exit_code);
+  close(sfd);
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  return rc;
+}
@@ -8,9 +8,23 @@ struct container {
   char command[1024];
   char base_dir[4096];
   char base_image[4096];
+  int timings;
+  int share_image;
+  int detach;
+  struct cgroup_limits limits;
+  /* --numa-node: a node, NUMA_NODE_AUTO until placed, or NUMA_NODE_NONE. */
+  int numa_node;
+  /* Written with the container's pid once it runs; -1 if nobody waits. */
+  int ready_fd;
 };
 
-int run_container(struct container cont);
+/*
+ * Runs the container to completion; *exit_code is its shell-style exit
+ * status. Detached containers return as soon as they have started.
+ */
+int run_container(struct container cont, int *exit_code);
+/* Runs command inside a running container; *exit_code as for run_container. */
+int exec_container(const char *id, const char *command, int *exit_code);
 void container_from_config(struct config cfg, struct container *c);
 
 #endif
@@ -8,8 +8,11 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 
+#include "container_store.h"
 #include "image_store.h"
+#include "metrics.h"
 #include "setup.h"
+#include "utils.h"
 
 static int ensure_dir(const char *path, mode_t mode) {
   struct stat st;
@@ -204,50 +207,55 @@ int setup_zocker_dir(void) {
   if (ensure_dir(ZOCKER_LAYER_LINKS_DIR, 0755) != 0) return 1;
   if (ensure_dir(ZOCKER_IMAGES_DIR, 0755) != 0) return 1;
   if (ensure_dir(ZOCKER_CACHE_DIR, 0755) != 0) return 1;
+  if (ensure_dir(ZOCKER_BLOBS_DIR, 0755) != 0) return 1;
+  if (ensure_dir(ZOCKER_TIMINGS_DIR, 0755) != 0) return 1;
+  if (ensure_dir(ZOCKER_DOWNLOADS_DIR, 0755) != 0) return 1;
+  if (ensure_dir(ZOCKER_METRICS_DIR, 0755) != 0) return 1;
+  if (ensure_dir(ZOCKER_POOLS_DIR, 0755) != 0) return 1;
+  if (ensure_dir(ZOCKER_SHARED_DIR, 0755) != 0) return 1;
   if (ensure_dir(ZOCKER_BUILD_TMP_DIR, 0755) != 0) return 1;
   return 0;
 }
 
-int setup_container_dir(const char id[64], char *container_dir, size_t container_dir_size,
-                        const char base_image[4096]) {
-  char container_root[4096];
-  char upper[4096];
-  char work[4096];
-  char merged[4096];
-  char base_chain[8192];
-  char mount_ops[12288];
+static int make_container_root(const char id[64], pid_t shim_pid, char *container_root,
+                               size_t container_root_size) {
+  snprintf(container_root, container_root_size, "%s/%s", ZOCKER_CONTAINERS_DIR, id);
+  if (mkdir(container_root, 0755) != 0) {
+    struct container_state st;
+    int err = errno;
 
-  if (container_dir == NULL || container_dir_size == 0) {
-    return 1;
-  }
+    /* A detached run reserves its root (and state) before its shim sets it up. */
+    if (err == EEXIST && shim_pid > 0 && load_container_state(id, &st) == 0 &&
+        st.status == CONTAINER_CREATED && st.shim_pid == shim_pid) {
+      return 0;
+    }
 
-  snprintf(container_root, sizeof(container_root), "%s/%s", ZOCKER_CONTAINERS_DIR,
-           id);
-  if (mkdir(container_root, 0755) != 0) {
-    if (errno == EEXIST) {
+    if (err == EEXIST) {
       fprintf(stderr, "[ERR] Container %s already exists\n", id);
       fprintf(stderr,
               "Use a different container name or use --base-dir instead of --base-image\n");
       return 1;
     }
 
-    fprintf(stderr, "[ERR] Failed to create container directory: %s\n", strerror(errno));
+    fprintf(stderr, "[ERR] Failed to create container directory: %s\n", strerror(err));
     return 1;
   }
 
+  return 0;
+}
+
+static int mount_container_overlay(const char *container_root, const char *base_chain,
+                                   char *container_dir, size_t container_dir_size,
+                                   struct run_timings *timings) {
+  char upper[4096];
+  char work[4096];
+  char merged[4096];
+  char mount_ops[12288];
+
   snprintf(upper, sizeof(upper), "%s/upper", container_root);
   snprintf(work, sizeof(work), "%s/work", container_root);
   snprintf(merged, sizeof(merged), "%s/merged", container_root);
 
-  mkdir(upper, 0755);
-  mkdir(work, 0755);
-  mkdir(merged, 0755);
-
-  if (resolve_base_chain(base_image, base_chain, sizeof(base_chain)) != 0) {
-    fprintf(stderr, "[ERR] Failed to resolve base image/path: %s\n", base_image);
-    return 1;
-  }
-
   snprintf(mount_ops, sizeof(mount_ops), "lowerdir=%s,upperdir=%s,workdir=%s",
            base_chain, upper, work);
 
@@ -259,7 +267,63 @@ int setup_container_dir(const char id[64], char *container_dir, size_t container
     fprintf(stderr, "[ERR] Overlay mount failed: %s\n", strerror(errno));
     return 1;
   }
+  timing_mark(timings, PHASE_MOUNT);
 
   snprintf(container_dir, container_dir_size, "%s", merged);
   return 0;
 }
+
+static void make_overlay_dirs(const char *container_root) {
+  char path[4096];
+
+  snprintf(path, sizeof(path), "%s/upper", container_root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/work", container_root);
+  mkdir(path, 0755);
+  snprintf(path, sizeof(path), "%s/merged", container_root);
+  mkdir(path, 0755);
+}
+
+int setup_container_dir_on(const char id[64], pid_t shim_pid, char *container_dir,
+                           size_t container_dir_size, const char *lower_chain,
+                           struct run_timings *timings) {
+  char container_root[4096];
+
+  if (container_dir == NULL || container_dir_size == 0 ||
+      make_container_root(id, shim_pid, container_root, sizeof(container_root)) != 0) {
+    return 1;
+  }
+
+  make_overlay_dirs(container_root);
+  timing_mark(timings, PHASE_DIRS);
+
+  return mount_container_overlay(container_root, lower_chain, container_dir,
+                                 container_dir_size, timings);
+}
+
+int setup_container_dir(const char id[64], pid_t shim_pid, char *container_dir,
+                        size_t container_dir_size, const char base_image[4096],
+                        struct run_timings *timings) {
+  char container_root[4096];
+  char base_chain[8192];
+
+  if (container_dir == NULL || container_dir_size == 0) {
+    return 1;
+  }
+
+  if (make_container_root(id, shim_pid, container_root, sizeof(container_root)) != 0) {
+    return 1;
+  }
+
+  make_overlay_dirs(container_root);
+  timing_mark(timings, PHASE_DIRS);
+
+  if (resolve_base_chain(base_image, base_chain, sizeof(base_chain)) != 0) {
+    fprintf(stderr, "[ERR] Failed to resolve base image/path: %s\n", base_image);
+    return 1;
+  }
+  timing_mark(timings, PHASE_RESOLVE);
+
+  return mount_container_overlay(container_root, base_chain, container_dir,
+                                 container_dir_size, timings);
+}
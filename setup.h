@@ -2,6 +2,9 @@
 #define __SETUP_H__
 
 #include <stddef.h>
+#include <sys/types.h>
+
+struct run_timings;
 
 #ifndef ZOCKER_PREFIX
 #define ZOCKER_PREFIX "/tmp/zocker"
@@ -27,13 +30,47 @@
 #define ZOCKER_CACHE_DIR ZOCKER_PREFIX "/cache"
 #endif
 
+#ifndef ZOCKER_BLOBS_DIR
+#define ZOCKER_BLOBS_DIR ZOCKER_PREFIX "/blobs"
+#endif
+
+#ifndef ZOCKER_TIMINGS_DIR
+#define ZOCKER_TIMINGS_DIR ZOCKER_PREFIX "/timings"
+#endif
+
+#ifndef ZOCKER_DOWNLOADS_DIR
+#define ZOCKER_DOWNLOADS_DIR ZOCKER_PREFIX "/downloads"
+#endif
+
+#ifndef ZOCKER_METRICS_DIR
+#define ZOCKER_METRICS_DIR ZOCKER_PREFIX "/metrics"
+#endif
+
+#ifndef ZOCKER_POOLS_DIR
+#define ZOCKER_POOLS_DIR ZOCKER_PREFIX "/pools"
+#endif
+
+#ifndef ZOCKER_SHARED_DIR
+#define ZOCKER_SHARED_DIR ZOCKER_PREFIX "/shared"
+#endif
+
 #ifndef ZOCKER_BUILD_TMP_DIR
 #define ZOCKER_BUILD_TMP_DIR ZOCKER_PREFIX "/tmp"
 #endif
 
 int setup_zocker_dir(void);
-int setup_container_dir(const char id[64], char *container_dir, size_t container_dir_size,
-                        const char base_image[4096]);
+/*
+ * Creates ZOCKER_CONTAINERS_DIR/<id> and mounts its overlay. An existing root
+ * is only taken over when it is still reserved, in the created state, by the
+ * detached run whose shim is shim_pid; pass 0 when there is no such shim.
+ */
+int setup_container_dir(const char id[64], pid_t shim_pid, char *container_dir,
+                        size_t container_dir_size, const char base_image[4096],
+                        struct run_timings *timings);
+/* Like setup_container_dir, over an already resolved lowerdir chain. */
+int setup_container_dir_on(const char id[64], pid_t shim_pid, char *container_dir,
+                           size_t container_dir_size, const char *lower_chain,
+                           struct run_timings *timings);
 int resolve_base_chain(const char *base_ref_or_path, char *out_chain, size_t out_chain_size);
 int build_docker_chain_from_upper(const char *upper_dir, char *out_chain, size_t out_chain_size);
 
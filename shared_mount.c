@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+
+#include "shared_mount.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "setup.h"
+#include "utils.h"
+
+#define SHARED_MAX_HOLDERS 4096
+
+static int make_dir(const char *path) {
+  return ensure_dir_exists(path, 0755) != 0 && !is_directory(path);
+}
+
+static int holder_alive(pid_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/* The view is mounted iff its mountpoint sits on another device than its parent. */
+static int view_mounted(const struct shared_mount *sm) {
+  struct stat dir_st;
+  struct stat lower_st;
+
+  if (stat(sm->dir, &dir_st) != 0 || stat(sm->lower, &lower_st) != 0) {
+    return 0;
+  }
+  return dir_st.st_dev != lower_st.st_dev;
+}
+
+static int lock_view(const struct shared_mount *sm) {
+  char lock_path[PATH_MAX];
+  int fd;
+
+  snprintf(lock_path, sizeof(lock_path), "%s/lock", sm->dir);
+  fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  while (flock(fd, LOCK_EX) != 0) {
+    if (errno != EINTR) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+/*
+ * Rewrites the holders file with the live holders other than drop, plus add.
+ * Must be called with the view locked. Returns the number of holders left,
+ * or -1 on errors.
+ */
+static int update_holders(const struct shared_mount *sm, pid_t add, pid_t drop) {
+  static pid_t pids[SHARED_MAX_HOLDERS];
+  char path[PATH_MAX];
+  FILE *fp;
+  long pid;
+  int count = 0;
+  int i;
+
+  snprintf(path, sizeof(path), "%s/holders", sm->dir);
+  fp = fopen(path, "r");
+  if (fp != NULL) {
+    while (count < SHARED_MAX_HOLDERS && fscanf(fp, "%ld", &pid) == 1) {
+      if ((pid_t)pid != drop && (pid_t)pid != add && holder_alive((pid_t)pid)) {
+        pids[count++] = (pid_t)pid;
+      }
+    }
+    fclose(fp);
+  }
+
+  if (add > 0) {
+    if (count == SHARED_MAX_HOLDERS) {
+      return -1;
+    }
+    pids[count++] = add;
+  }
+
+  fp = fopen(path, "w");
+  if (fp == NULL) {
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    fprintf(fp, "%ld\n", (long)pids[i]);
+  }
+  if (fclose(fp) != 0) {
+    return -1;
+  }
+
+  return count;
+}
+
+int shared_mount_acquire(const char *base_image, struct shared_mount *sm) {
+  char chain[8192];
+
+  memset(sm, 0, sizeof(*sm));
+
+  if (resolve_base_chain(base_image, chain, sizeof(chain)) != 0) {
+    fprintf(stderr, "[ERR] Failed to resolve base image/path: %s\n", base_image);
+    return 1;
+  }
+
+  return shared_mount_acquire_chain(chain, sm);
+}
+
+int shared_mount_acquire_chain(const char *chain, struct shared_mount *sm) {
+  char key[17];
+  char *mount_ops;
+  size_t ops_size;
+  int lock_fd;
+  int rc = 0;
+
+  memset(sm, 0, sizeof(*sm));
+
+  if (strchr(chain, ':') == NULL) {
+    snprintf(sm->lower, sizeof(sm->lower), "%s", chain);
+    return 0;
+  }
+
+  if (hash_string(chain, key) != 0) {
+    return 1;
+  }
+
+  snprintf(sm->dir, sizeof(sm->dir), "%s/%s", ZOCKER_SHARED_DIR, key);
+  snprintf(sm->lower, sizeof(sm->lower), "%s/merged", sm->dir);
+  if (make_dir(sm->dir) != 0 || make_dir(sm->lower) != 0) {
+    fprintf(stderr, "[ERR] Failed to create shared image dir %s\n", sm->dir);
+    return 1;
+  }
+
+  lock_fd = lock_view(sm);
+  if (lock_fd < 0) {
+    fprintf(stderr, "[ERR] Failed to lock shared image dir %s\n", sm->dir);
+    return 1;
+  }
+
+  if (update_holders(sm, getpid(), 0) < 0) {
+    close(lock_fd);
+    return 1;
+  }
+
+  if (!view_mounted(sm)) {
+    ops_size = strlen(chain) + sizeof("lowerdir=");
+    mount_ops = malloc(ops_size);
+    if (mount_ops == NULL) {
+      rc = 1;
+    } else {
+      snprintf(mount_ops, ops_size, "lowerdir=%s", chain);
+      if (mount("overlay", sm->lower, "overlay", MS_RDONLY, mount_ops) != 0) {
+        fprintf(stderr, "[ERR] Shared image mount failed: %s\n", strerror(errno));
+        rc = 1;
+      }
+      free(mount_ops);
+    }
+
+    if (rc != 0) {
+      update_holders(sm, 0, getpid());
+    }
+  }
+
+  close(lock_fd);
+  sm->mounted = rc == 0;
+  return rc;
+}
+
+int shared_mount_release(struct shared_mount *sm) {
+  int lock_fd;
+  int left;
+  int rc = 0;
+
+  if (!sm->mounted) {
+    return 0;
+  }
+
+  lock_fd = lock_view(sm);
+  if (lock_fd < 0) {
+    return 1;
+  }
+
+  left = update_holders(sm, 0, getpid());
+  if (left == 0 && view_mounted(sm) && umount2(sm->lower, MNT_DETACH) != 0) {
+    fprintf(stderr, "[WARN] Failed to unmount shared image %s: %s\n", sm->lower,
+            strerror(errno));
+    rc = 1;
+  }
+
+  close(lock_fd);
+  sm->mounted = 0;
+  return rc || left < 0;
+}
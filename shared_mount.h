@@ -0,0 +1,31 @@
+#ifndef __SHARED_MOUNT_H__
+#define __SHARED_MOUNT_H__
+
+#include <limits.h>
+
+/*
+ * A read-only overlay of an image's whole layer chain, mounted once in the
+ * host mount namespace and shared by every container of that image. Each
+ * container then stacks a thin overlay with `lower` as its single lowerdir.
+ */
+struct shared_mount {
+  char dir[PATH_MAX];
+  char lower[PATH_MAX];
+  int mounted;
+};
+
+/*
+ * Resolves base_image and makes sure its shared view is mounted, registering
+ * this process as a holder. Holders are pids, so one that dies without
+ * releasing is dropped by the next acquire/release. Chains of a single layer
+ * need no merged view: lower is that layer and nothing is mounted.
+ */
+int shared_mount_acquire(const char *base_image, struct shared_mount *sm);
+
+/* Like shared_mount_acquire, for a layer chain resolved by the caller. */
+int shared_mount_acquire_chain(const char *chain, struct shared_mount *sm);
+
+/* Drops this process's hold; the last holder unmounts the view. */
+int shared_mount_release(struct shared_mount *sm);
+
+#endif
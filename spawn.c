@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+
+#include "spawn.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+
+#ifndef CLONE_PIDFD
+#define CLONE_PIDFD 0x00001000
+#endif
+
+#ifndef CLONE_NEWTIME
+#define CLONE_NEWTIME 0x00000080
+#endif
+
+#ifndef CLONE_INTO_CGROUP
+#define CLONE_INTO_CGROUP 0x200000000ULL
+#endif
+
+/* struct clone_args from <linux/sched.h>, which clashes with <sched.h>. */
+struct zocker_clone_args {
+  uint64_t flags;
+  uint64_t pidfd;
+  uint64_t child_tid;
+  uint64_t parent_tid;
+  uint64_t exit_signal;
+  uint64_t stack;
+  uint64_t stack_size;
+  uint64_t tls;
+  uint64_t set_tid;
+  uint64_t set_tid_size;
+  uint64_t cgroup;
+};
+
+static pid_t clone3_process(int ns_flags, int cgroup_fd, int *pidfd) {
+  struct zocker_clone_args args;
+
+  memset(&args, 0, sizeof(args));
+  args.flags = (uint64_t)(unsigned int)ns_flags;
+  args.exit_signal = SIGCHLD;
+  if (pidfd != NULL) {
+    args.flags |= CLONE_PIDFD;
+    args.pidfd = (uint64_t)(uintptr_t)pidfd;
+  }
+  if (cgroup_fd >= 0) {
+    args.flags |= CLONE_INTO_CGROUP;
+    args.cgroup = (uint64_t)cgroup_fd;
+  }
+
+  return (pid_t)syscall(SYS_clone3, &args, sizeof(args));
+}
+
+/* clone() without clone3: no time namespace, and the cgroup is joined late. */
+static pid_t clone_process(int *ns_flags, int cgroup_fd, int *pidfd) {
+  pid_t pid;
+
+  *ns_flags &= ~CLONE_NEWTIME;
+  pid = (pid_t)syscall(SYS_clone, (unsigned long)*ns_flags | SIGCHLD, NULL, NULL, NULL, NULL);
+  if (pid < 0) {
+    return pid;
+  }
+
+  if (pid == 0) {
+    if (cgroup_fd >= 0) {
+      int procs = openat(cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+
+      if (procs < 0 || write(procs, "0", 1) != 1) {
+        fprintf(stderr, "[ERR] Failed to join cgroup: %s\n", strerror(errno));
+        _exit(1);
+      }
+      close(procs);
+    }
+    return 0;
+  }
+
+  if (pidfd != NULL) {
+#ifdef SYS_pidfd_open
+    *pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    *pidfd = -1;
+#endif
+  }
+  return pid;
+}
+
+pid_t spawn_process(int *ns_flags, int cgroup_fd, int *pidfd) {
+  int no_flags = 0;
+  pid_t pid;
+
+  if (ns_flags == NULL) {
+    ns_flags = &no_flags;
+  }
+  if (pidfd != NULL) {
+    *pidfd = -1;
+  }
+
+  pid = clone3_process(*ns_flags, cgroup_fd, pidfd);
+  if (pid < 0 && errno == EINVAL && (*ns_flags & CLONE_NEWTIME)) {
+    *ns_flags &= ~CLONE_NEWTIME;
+    pid = clone3_process(*ns_flags, cgroup_fd, pidfd);
+  }
+
+  if (pid < 0 && (errno == ENOSYS || errno == E2BIG)) {
+    pid = clone_process(ns_flags, cgroup_fd, pidfd);
+  }
+
+  return pid;
+}
@@ -0,0 +1,16 @@
+#ifndef __SPAWN_H__
+#define __SPAWN_H__
+
+#include <sys/types.h>
+
+/*
+ * fork() as one clone3 call: the child starts in new namespaces (CLONE_NEW*
+ * bits of ns_flags), inside cgroup_fd's cgroup if cgroup_fd >= 0, and a
+ * pidfd for it is stored in *pidfd if pidfd is not NULL (-1 if none could
+ * be had). Kernels without a time namespace drop CLONE_NEWTIME, reported
+ * through *ns_flags. Without clone3 it falls back to clone() and the child
+ * moves itself into the cgroup before returning.
+ */
+pid_t spawn_process(int *ns_flags, int cgroup_fd, int *pidfd);
+
+#endif
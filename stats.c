@@ -0,0 +1,423 @@
+#define _GNU_SOURCE
+
+#include "stats.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "container_store.h"
+#include "metrics.h"
+#include "setup.h"
+
+enum stats_file {
+  STATS_CPU = 0,
+  STATS_MEMORY,
+  STATS_MEMORY_PEAK,
+  STATS_PIDS,
+  STATS_IO,
+  STATS_FILE_COUNT,
+};
+
+static const char *stats_file_names[STATS_FILE_COUNT] = {
+    "cpu.stat", "memory.current", "memory.peak", "pids.current", "io.stat",
+};
+
+/* One reading of a container's cgroup; -1 where its controller is off. */
+struct stats_sample {
+  long long cpu_usage_us;
+  long long memory_bytes;
+  long long memory_peak_bytes;
+  long long pids;
+  long long io_read_bytes;
+  long long io_write_bytes;
+};
+
+struct stats_target {
+  char id[64];
+  int fds[STATS_FILE_COUNT];
+  int gone;
+  long long prev_cpu_usage_us;
+};
+
+/* Each open target holds STATS_FILE_COUNT fds; hundreds of them outgrow 1024. */
+static void raise_fd_limit(void) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+static void close_target(struct stats_target *t) {
+  int i;
+
+  for (i = 0; i < STATS_FILE_COUNT; i++) {
+    if (t->fds[i] >= 0) {
+      close(t->fds[i]);
+      t->fds[i] = -1;
+    }
+  }
+  t->gone = 1;
+}
+
+/* Opens the stats files of a running container. cpu.stat is in every cgroup. */
+static int open_target(const char *id, struct stats_target *t) {
+  struct container_state st;
+  int dir_fd;
+  int i;
+
+  memset(t, 0, sizeof(*t));
+  snprintf(t->id, sizeof(t->id), "%s", id);
+  for (i = 0; i < STATS_FILE_COUNT; i++) {
+    t->fds[i] = -1;
+  }
+
+  if (load_container_state(id, &st) != 0) {
+    fprintf(stderr, "[ERR] Container not found: %s\n", id);
+    return 1;
+  }
+  if (st.status != CONTAINER_RUNNING || !container_live(&st)) {
+    fprintf(stderr, "[WARN] Container %s is not running\n", id);
+    return 1;
+  }
+
+  dir_fd = cgroup_open(id);
+  if (dir_fd < 0) {
+    fprintf(stderr, "[WARN] Container %s has no cgroup\n", id);
+    return 1;
+  }
+
+  for (i = 0; i < STATS_FILE_COUNT; i++) {
+    t->fds[i] = openat(dir_fd, stats_file_names[i], O_RDONLY | O_CLOEXEC);
+  }
+  close(dir_fd);
+
+  if (t->fds[STATS_CPU] < 0) {
+    fprintf(stderr, "[WARN] Container %s has no cpu.stat\n", id);
+    close_target(t);
+    return 1;
+  }
+  return 0;
+}
+
+/* Re-reads a whole cgroup file. Returns its length, or -1. */
+static ssize_t read_stats_file(int fd, char *buf, size_t size) {
+  ssize_t n;
+
+  if (fd < 0) {
+    return -1;
+  }
+  n = pread(fd, buf, size - 1, 0);
+  if (n >= 0) {
+    buf[n] = '\0';
+  }
+  return n;
+}
+
+static long long parse_keyed(const char *buf, const char *key) {
+  const char *p = strstr(buf, key);
+
+  return p == NULL ? -1 : strtoll(p + strlen(key), NULL, 10);
+}
+
+/* Sums a per-device key such as "rbytes=" over all lines of io.stat. */
+static long long parse_io_total(const char *buf, const char *key) {
+  const char *p = buf;
+  long long total = 0;
+
+  while ((p = strstr(p, key)) != NULL) {
+    p += strlen(key);
+    total += strtoll(p, NULL, 10);
+  }
+  return total;
+}
+
+/*
+ * Reads all files of a target, one pread each. Returns 1 once its cgroup is
+ * gone, i.e. the container has exited and been cleaned up.
+ */
+static int sample_target(struct stats_target *t, struct stats_sample *s) {
+  char buf[4096];
+  int i;
+
+  s->cpu_usage_us = -1;
+  s->memory_bytes = -1;
+  s->memory_peak_bytes = -1;
+  s->pids = -1;
+  s->io_read_bytes = -1;
+  s->io_write_bytes = -1;
+
+  for (i = 0; i < STATS_FILE_COUNT; i++) {
+    if (read_stats_file(t->fds[i], buf, sizeof(buf)) < 0) {
+      if (i == STATS_CPU) {
+        return 1;
+      }
+      continue;
+    }
+
+    switch (i) {
+    case STATS_CPU:
+      s->cpu_usage_us = parse_keyed(buf, "usage_usec ");
+      break;
+    case STATS_MEMORY:
+      s->memory_bytes = strtoll(buf, NULL, 10);
+      break;
+    case STATS_MEMORY_PEAK:
+      s->memory_peak_bytes = strtoll(buf, NULL, 10);
+      break;
+    case STATS_PIDS:
+      s->pids = strtoll(buf, NULL, 10);
+      break;
+    case STATS_IO:
+      s->io_read_bytes = parse_io_total(buf, "rbytes=");
+      s->io_write_bytes = parse_io_total(buf, "wbytes=");
+      break;
+    default:
+      break;
+    }
+  }
+  return 0;
+}
+
+static void format_bytes(long long bytes, char *out, size_t out_size) {
+  static const char *units[] = {"KiB", "MiB", "GiB", "TiB"};
+  double value = (double)bytes;
+  int unit = -1;
+
+  if (bytes < 0) {
+    snprintf(out, out_size, "-");
+    return;
+  }
+  if (bytes < 1024) {
+    snprintf(out, out_size, "%lldB", bytes);
+    return;
+  }
+
+  while (value >= 1024 && unit < 3) {
+    value /= 1024;
+    unit++;
+  }
+  snprintf(out, out_size, "%.1f%s", value, units[unit]);
+}
+
+static void print_table_row(const char *id, double cpu_percent, const struct stats_sample *s) {
+  char cpu[16];
+  char memory[16];
+  char peak[16];
+  char pids[24];
+  char io_read[16];
+  char io_write[16];
+  char io[40];
+
+  if (cpu_percent < 0) {
+    snprintf(cpu, sizeof(cpu), "-");
+  } else {
+    snprintf(cpu, sizeof(cpu), "%.2f%%", cpu_percent);
+  }
+  format_bytes(s->memory_bytes, memory, sizeof(memory));
+  format_bytes(s->memory_peak_bytes, peak, sizeof(peak));
+  if (s->pids < 0) {
+    snprintf(pids, sizeof(pids), "-");
+  } else {
+    snprintf(pids, sizeof(pids), "%lld", s->pids);
+  }
+  format_bytes(s->io_read_bytes, io_read, sizeof(io_read));
+  format_bytes(s->io_write_bytes, io_write, sizeof(io_write));
+  snprintf(io, sizeof(io), "%s / %s", io_read, io_write);
+
+  printf("%-24s %8s %10s %10s %6s %21s\n", id, cpu, memory, peak, pids, io);
+}
+
+static void print_json_field(const char *name, long long value) {
+  if (value < 0) {
+    printf(",\"%s\":null", name);
+  } else {
+    printf(",\"%s\":%lld", name, value);
+  }
+}
+
+static void print_json_row(const char *id, long long time_ms, double cpu_percent,
+                           const struct stats_sample *s) {
+  printf("{\"container\":\"%s\",\"time_ms\":%lld", id, time_ms);
+  if (cpu_percent < 0) {
+    printf(",\"cpu_percent\":null");
+  } else {
+    printf(",\"cpu_percent\":%.2f", cpu_percent);
+  }
+  print_json_field("cpu_usage_us", s->cpu_usage_us);
+  print_json_field("memory_bytes", s->memory_bytes);
+  print_json_field("memory_peak_bytes", s->memory_peak_bytes);
+  print_json_field("pids", s->pids);
+  print_json_field("io_read_bytes", s->io_read_bytes);
+  print_json_field("io_write_bytes", s->io_write_bytes);
+  printf("}\n");
+}
+
+/* Opens every running container under ZOCKER_CONTAINERS_DIR. */
+static int open_running_targets(struct stats_target **targets, int *count) {
+  struct dirent *ent;
+  int capacity = 0;
+  DIR *dir;
+
+  dir = opendir(ZOCKER_CONTAINERS_DIR);
+  if (dir == NULL) {
+    return 1;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    struct container_state st;
+
+    if (ent->d_name[0] == '.' || load_container_state(ent->d_name, &st) != 0 ||
+        st.status != CONTAINER_RUNNING || !container_live(&st)) {
+      continue;
+    }
+
+    if (*count == capacity) {
+      struct stats_target *grown;
+
+      capacity = capacity == 0 ? 64 : capacity * 2;
+      grown = realloc(*targets, sizeof(**targets) * (size_t)capacity);
+      if (grown == NULL) {
+        closedir(dir);
+        return 1;
+      }
+      *targets = grown;
+    }
+
+    if (open_target(ent->d_name, &(*targets)[*count]) == 0) {
+      (*count)++;
+    }
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+static long long realtime_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sleep_until_ns(long long deadline_ns) {
+  struct timespec ts;
+
+  ts.tv_sec = (time_t)(deadline_ns / 1000000000LL);
+  ts.tv_nsec = (long)(deadline_ns % 1000000000LL);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+/*
+ * Takes a baseline reading, then one per tick on an absolute schedule, so
+ * the time spent sampling does not stretch the interval. CPU usage is the
+ * delta of usage_usec over the tick (100% per fully busy CPU).
+ */
+int stream_container_stats(const char **names, int count, int json, int once) {
+  static char out_buf[1 << 16];
+  struct stats_target *targets = NULL;
+  struct stats_sample sample;
+  long long interval_ns = (long long)STATS_INTERVAL_MS * 1000000LL;
+  long long prev_ns;
+  long long now_ns;
+  int clear_screen = !json && !once && isatty(STDOUT_FILENO);
+  int target_count = 0;
+  int live;
+  int i;
+
+  raise_fd_limit();
+
+  if (count > 0) {
+    targets = calloc((size_t)count, sizeof(*targets));
+    if (targets == NULL) {
+      return 1;
+    }
+    for (i = 0; i < count; i++) {
+      if (open_target(names[i], &targets[target_count]) == 0) {
+        target_count++;
+      }
+    }
+    if (target_count == 0) {
+      free(targets);
+      return 1;
+    }
+  } else if (open_running_targets(&targets, &target_count) != 0) {
+    free(targets);
+    return 1;
+  }
+
+  /* One write per refresh, however many containers there are. */
+  setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+  prev_ns = monotonic_ns();
+  for (i = 0; i < target_count; i++) {
+    if (sample_target(&targets[i], &sample) != 0) {
+      close_target(&targets[i]);
+      continue;
+    }
+    targets[i].prev_cpu_usage_us = sample.cpu_usage_us;
+  }
+
+  do {
+    long long time_ms;
+
+    sleep_until_ns(prev_ns + interval_ns);
+    now_ns = monotonic_ns();
+    time_ms = realtime_ms();
+
+    if (clear_screen) {
+      printf("\033[H\033[2J");
+    }
+    if (!json) {
+      printf("%-24s %8s %10s %10s %6s %21s\n", "CONTAINER", "CPU %", "MEM USAGE", "MEM PEAK",
+             "PIDS", "BLOCK I/O (R / W)");
+    }
+
+    live = 0;
+    for (i = 0; i < target_count; i++) {
+      struct stats_target *t = &targets[i];
+      double cpu_percent = -1;
+
+      if (t->gone) {
+        continue;
+      }
+      if (sample_target(t, &sample) != 0) {
+        close_target(t);
+        continue;
+      }
+      live++;
+
+      if (sample.cpu_usage_us >= 0 && t->prev_cpu_usage_us >= 0 && now_ns > prev_ns) {
+        cpu_percent =
+            (double)(sample.cpu_usage_us - t->prev_cpu_usage_us) * 1000.0 * 100.0 /
+            (double)(now_ns - prev_ns);
+      }
+      t->prev_cpu_usage_us = sample.cpu_usage_us;
+
+      if (json) {
+        print_json_row(t->id, time_ms, cpu_percent, &sample);
+      } else {
+        print_table_row(t->id, cpu_percent, &sample);
+      }
+    }
+
+    fflush(stdout);
+    prev_ns = now_ns;
+  } while (!once && live > 0);
+
+  for (i = 0; i < target_count; i++) {
+    close_target(&targets[i]);
+  }
+  free(targets);
+  return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#ifndef STATS_INTERVAL_MS
+#define STATS_INTERVAL_MS 1000
+#endif
+
+/*
+ * Streams CPU, memory, PID and block I/O usage of the named containers (all
+ * running ones if count is 0) every STATS_INTERVAL_MS until they have all
+ * exited, or prints a single refresh with once. Values come from the
+ * containers' cgroup v2 files, which stay open and are re-read with one
+ * pread each per refresh. With json, each refresh is one JSON object per
+ * container and line; otherwise a table.
+ */
+int stream_container_stats(const char **names, int count, int json, int once);
+
+#endif
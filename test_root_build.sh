@@ -16,6 +16,10 @@ BIN="./zocker"
 
 CTX_SIMPLE="$TEST_ROOT/simple"
 CTX_MULTI="$TEST_ROOT/multi"
+CTX_IGNORE="$TEST_ROOT/ignore"
+CTX_URL="$TEST_ROOT/url"
+CTX_REBASE="$TEST_ROOT/rebase"
+CTX_WATCH="$TEST_ROOT/watch"
 BASE_ROOT="$TEST_ROOT/base-rootfs"
 
 IMAGE_SIMPLE_V1="cache-demo:${RUN_ID}-v1"
@@ -36,7 +40,20 @@ fail() {
   exit 1
 }
 
+HTTP_PID=""
+WATCH_PID=""
+POOL_PID=""
+
 cleanup() {
+  if [[ -n "$HTTP_PID" ]]; then
+    kill "$HTTP_PID" 2>/dev/null || true
+  fi
+  if [[ -n "$WATCH_PID" ]]; then
+    kill "$WATCH_PID" 2>/dev/null || true
+  fi
+  if [[ -n "$POOL_PID" ]]; then
+    kill "$POOL_PID" 2>/dev/null || true
+  fi
   rm -rf "$TEST_ROOT"
   # keep STORE_DIR for debugging on failure
 }
@@ -98,6 +115,7 @@ prepare_minimal_base_rootfs() {
 
   copy_bin_with_libs /bin/sh "$BASE_ROOT"
   copy_bin_with_libs /bin/cat "$BASE_ROOT"
+  copy_bin_with_libs /bin/sleep "$BASE_ROOT"
 
   if chroot "$BASE_ROOT" /bin/sh -c '/bin/cat /bin/sh >/tmp/preflight-copy && test -s /tmp/preflight-copy' >/dev/null 2>&1; then
     echo "$BASE_ROOT"
@@ -156,13 +174,13 @@ echo "[INFO] Using BASEDIR=$BASE_DIR"
 
 log "Compile zocker with isolated ZOCKER_PREFIX"
 rm -f "$BIN"
-gcc -w -std=c11 -O2  *.c -o "$BIN"
+gcc -w -std=c11 -O2 -pthread *.c -o "$BIN"
 
 rm -rf "$STORE_DIR"
 if [[ ! -d "$BASE_DIR" ]]; then
   fail "Selected BASEDIR disappeared: $BASE_DIR"
 fi
-mkdir -p "$CTX_SIMPLE" "$CTX_MULTI"
+mkdir -p "$CTX_SIMPLE" "$CTX_MULTI" "$CTX_IGNORE"
 
 # -----------------------------
 # Test 1: cache behavior
@@ -211,6 +229,15 @@ fi
 echo "[PASS] Cache hit detected and top layer reused"
 echo "[INFO] Build#1=${ms1}ms, Build#2=${ms2}ms"
 
+log "Plan for unchanged inputs (should be fully cached)"
+plan_log="$TEST_ROOT/plan.log"
+"$BIN" build --plan -f "$CTX_SIMPLE/Zockerfile" | tee "$plan_log"
+if ! grep -q "fully cached" "$plan_log" || grep -q "REBUILD" "$plan_log"; then
+  fail "Plan for an unchanged build predicts a rebuild"
+fi
+
+echo "[PASS] Build plan matches the cache"
+
 log "Run cached image and verify output"
 run_simple_log="$TEST_ROOT/run_simple.log"
 "$BIN" run --name "$RUN_NAME_SIMPLE" --base-image "$IMAGE_SIMPLE_V2" "cat /tmp/zocker-simple-$RUN_ID/out.txt" | tee "$run_simple_log"
@@ -218,6 +245,62 @@ if ! grep -q "$PAYLOAD_SIMPLE" "$run_simple_log"; then
   fail "Simple run output mismatch"
 fi
 
+log "Run a command whose words look like zocker subcommands and options"
+run_words_log="$TEST_ROOT/run_words.log"
+"$BIN" run --name "words-run-${RUN_ID}" --base-image "$IMAGE_SIMPLE_V2" \
+  echo ls -d / rm -rf /tmp/x stop ps wait | tee "$run_words_log"
+if ! grep -q "^ls -d / rm -rf /tmp/x stop ps wait$" "$run_words_log"; then
+  fail "Words of the run command were parsed as zocker arguments"
+fi
+"$BIN" run --name "words-dash-run-${RUN_ID}" --base-image "$IMAGE_SIMPLE_V2" \
+  -- echo --name -d | tee -a "$run_words_log"
+if ! grep -q "^--name -d$" "$run_words_log"; then
+  fail "Arguments after -- were parsed as zocker arguments"
+fi
+"$BIN" run --name "words-limits-run-${RUN_ID}" --base-image "$IMAGE_SIMPLE_V2" \
+  echo grep -m 1 foo --cpus 2 --pids-limit 5 metrics pool stats --json --no-stream \
+  --numa-node 0 --cpuset-cpus 0 | tee -a "$run_words_log"
+if ! grep -q "^grep -m 1 foo --cpus 2 --pids-limit 5 metrics pool stats --json --no-stream --numa-node 0 --cpuset-cpus 0$" \
+  "$run_words_log"; then
+  fail "Limit flags or subcommand words in the run command were taken by zocker"
+fi
+
+log "Run cold and from a warm pool with --timings, then check the startup metrics"
+"$BIN" pool --base-image "$IMAGE_SIMPLE_V2" --size 1 > "$TEST_ROOT/pool.log" 2>&1 &
+POOL_PID=$!
+for _ in $(seq 1 50); do
+  grep -q "^\[POOL\] Keeping" "$TEST_ROOT/pool.log" && break
+  sleep 0.1
+done
+sleep 1
+timings_err="$TEST_ROOT/timings.err"
+"$BIN" run --timings --name "timings-pool-run-${RUN_ID}" --base-image "$IMAGE_SIMPLE_V2" \
+  "cat /tmp/zocker-simple-$RUN_ID/out.txt" 2> "$timings_err"
+kill "$POOL_PID" 2>/dev/null || true
+wait "$POOL_PID" 2>/dev/null || true
+POOL_PID=""
+"$BIN" run --timings --name "timings-run-${RUN_ID}" --base-image "$IMAGE_SIMPLE_V2" \
+  "cat /tmp/zocker-simple-$RUN_ID/out.txt" 2>> "$timings_err"
+
+if [[ $(grep -c "^{\"container\":\"timings-" "$timings_err") -ne 2 ]]; then
+  fail "--timings did not print one JSON line per run"
+fi
+if command -v python3 >/dev/null 2>&1; then
+  while read -r timings_line; do
+    if ! python3 -c 'import json,sys; json.loads(sys.argv[1])' "$timings_line"; then
+      fail "--timings printed invalid JSON: $timings_line"
+    fi
+  done < <(grep "^{\"container\":\"timings-" "$timings_err")
+else
+  echo "[SKIP] python3 is not available to parse the --timings JSON."
+fi
+"$BIN" metrics > "$TEST_ROOT/metrics.log"
+if ! grep -q "^total[[:space:]]" "$TEST_ROOT/metrics.log"; then
+  fail "metrics does not list the total startup row"
+fi
+
+echo "[PASS] Startup timings are valid JSON and recorded in the metrics"
+
 # -----------------------------
 # Test 2: multi-stage build
 # -----------------------------
@@ -252,6 +335,327 @@ fi
 
 echo "[PASS] Multi-stage build and runtime verification passed"
 
+# -----------------------------
+# Test 3: .zockerignore
+# -----------------------------
+mkdir -p "$CTX_IGNORE/app/.git" "$CTX_IGNORE/app/build"
+echo "kept" > "$CTX_IGNORE/app/main.txt"
+echo "ref: refs/heads/main" > "$CTX_IGNORE/app/.git/HEAD"
+echo "object" > "$CTX_IGNORE/app/build/out.o"
+echo "cfg-a" > "$CTX_IGNORE/a.cfg"
+echo "cfg-b" > "$CTX_IGNORE/b.cfg"
+mkdir -p "$CTX_IGNORE/pkg" "$TEST_ROOT/pkg-tar"
+echo "add-plain" > "$CTX_IGNORE/pkg/one.dat"
+echo "add-unpacked" > "$TEST_ROOT/pkg-tar/inner.txt"
+tar -cf "$CTX_IGNORE/pkg/two.dat" -C "$TEST_ROOT/pkg-tar" inner.txt
+
+cat > "$CTX_IGNORE/.zockerignore" <<ZEOF
+# VCS and build outputs
+.git/
+app/build
+ZEOF
+
+cat > "$CTX_IGNORE/Zockerfile" <<ZEOF
+BASEDIR $BASE_DIR
+COPY app /tmp/zocker-ignore-$RUN_ID
+COPY *.cfg app/main.txt /tmp/zocker-multi-src-$RUN_ID/
+ADD pkg/*.dat /tmp/zocker-add-glob-$RUN_ID/
+ZEOF
+
+log "Build with .zockerignore"
+"$BIN" build -f "$CTX_IGNORE/Zockerfile" -t "ignore-demo:${RUN_ID}" | tee "$TEST_ROOT/ignore_build.log"
+
+ignore_dir="/tmp/zocker-ignore-$RUN_ID"
+run_ignore_log="$TEST_ROOT/run_ignore.log"
+"$BIN" run --name "ignore-run-${RUN_ID}" --base-image "ignore-demo:${RUN_ID}" \
+  "/bin/sh -c 'cat $ignore_dir/main.txt; test -e $ignore_dir/.git && echo LEAK; test -e $ignore_dir/build && echo LEAK; true'" \
+  | tee "$run_ignore_log"
+if ! grep -q "kept" "$run_ignore_log" || grep -q "LEAK" "$run_ignore_log"; then
+  fail "Ignored paths were copied into the image"
+fi
+
+if [[ $(grep -c "^\[BUILT\]" "$TEST_ROOT/ignore_build.log") -ne 3 ]]; then
+  fail "Multi-source COPY did not produce a single layer"
+fi
+
+run_multi_src_log="$TEST_ROOT/run_multi_src.log"
+"$BIN" run --name "multi-src-run-${RUN_ID}" --base-image "ignore-demo:${RUN_ID}" \
+  "/bin/sh -c 'cat /tmp/zocker-multi-src-$RUN_ID/a.cfg /tmp/zocker-multi-src-$RUN_ID/b.cfg /tmp/zocker-multi-src-$RUN_ID/main.txt'" \
+  | tee "$run_multi_src_log"
+if ! grep -q "cfg-a" "$run_multi_src_log" || ! grep -q "cfg-b" "$run_multi_src_log"; then
+  fail "Glob COPY sources missing from the image"
+fi
+
+run_add_glob_log="$TEST_ROOT/run_add_glob.log"
+"$BIN" run --name "add-glob-run-${RUN_ID}" --base-image "ignore-demo:${RUN_ID}" \
+  "/bin/sh -c 'cat /tmp/zocker-add-glob-$RUN_ID/one.dat /tmp/zocker-add-glob-$RUN_ID/inner.txt'" \
+  | tee "$run_add_glob_log"
+if ! grep -q "add-plain" "$run_add_glob_log" || ! grep -q "add-unpacked" "$run_add_glob_log"; then
+  fail "Glob ADD did not add every matched source"
+fi
+
+echo "changed" > "$CTX_IGNORE/app/.git/HEAD"
+"$BIN" build --plan -f "$CTX_IGNORE/Zockerfile" | tee "$TEST_ROOT/ignore_plan.log"
+if ! grep -q "fully cached" "$TEST_ROOT/ignore_plan.log"; then
+  fail "Change to an ignored file invalidated the cache"
+fi
+
+echo "[PASS] .zockerignore, multi-source COPY and glob ADD behave as expected"
+
+log "ADD of a tarball through an absolute symlink stays in the image"
+escape_dir="/tmp/zocker-escape-$RUN_ID"
+mkdir -p "$escape_dir" "$TEST_ROOT/escape/empty"
+ln -s "$escape_dir" "$TEST_ROOT/escape/link"
+cat > "$TEST_ROOT/escape/Zockerfile" <<ZEOF
+BASEDIR $BASE_DIR
+COPY empty $escape_dir
+COPY link /tmp/zocker-link-$RUN_ID
+ADD two.dat /tmp/zocker-link-$RUN_ID/
+ZEOF
+cp "$CTX_IGNORE/pkg/two.dat" "$TEST_ROOT/escape/"
+"$BIN" build -f "$TEST_ROOT/escape/Zockerfile" -t "escape-demo:${RUN_ID}" >/dev/null
+escaped=$(ls -A "$escape_dir")
+rm -rf "$escape_dir"
+if [[ -n "$escaped" ]]; then
+  fail "ADD extracted a tarball onto the host through an image symlink"
+fi
+run_escape_log="$TEST_ROOT/run_escape.log"
+"$BIN" run --name "escape-run-${RUN_ID}" --base-image "escape-demo:${RUN_ID}" \
+  "cat $escape_dir/inner.txt" | tee "$run_escape_log"
+if ! grep -q "add-unpacked" "$run_escape_log"; then
+  fail "Tarball was not extracted through the in-image symlink"
+fi
+
+echo "[PASS] ADD extraction resolves paths inside the image"
+
+# -----------------------------
+# Test 4: ADD <url> download cache
+# -----------------------------
+if command -v python3 >/dev/null 2>&1; then
+  mkdir -p "$CTX_URL/www"
+  echo "remote-v1" > "$CTX_URL/www/remote.txt"
+  HTTP_PORT=$(( 20000 + RUN_ID % 10000 ))
+  python3 -m http.server "$HTTP_PORT" --bind 127.0.0.1 --directory "$CTX_URL/www" \
+    > "$TEST_ROOT/http.log" 2>&1 &
+  HTTP_PID=$!
+  sleep 1
+
+  cat > "$CTX_URL/Zockerfile" <<ZEOF
+BASEDIR $BASE_DIR
+ADD http://127.0.0.1:$HTTP_PORT/remote.txt /tmp/zocker-url-$RUN_ID/
+ZEOF
+
+  log "ADD <url> build #1 (downloads) and #2 (revalidates)"
+  "$BIN" build -f "$CTX_URL/Zockerfile" -t "url-demo:${RUN_ID}" | tee "$TEST_ROOT/url_build1.log"
+  "$BIN" build -f "$CTX_URL/Zockerfile" -t "url-demo:${RUN_ID}" | tee "$TEST_ROOT/url_build2.log"
+  if ! grep -q "\[CACHE HIT\]" "$TEST_ROOT/url_build2.log" || grep -q "\[FETCH\]" "$TEST_ROOT/url_build2.log"; then
+    fail "Unchanged URL was downloaded again"
+  fi
+
+  log "ADD <url> after the remote file changed"
+  echo "remote-v2" > "$CTX_URL/www/remote.txt"
+  touch -d "+1 minute" "$CTX_URL/www/remote.txt"
+  "$BIN" build -f "$CTX_URL/Zockerfile" -t "url-demo:${RUN_ID}" | tee "$TEST_ROOT/url_build3.log"
+  run_url_log="$TEST_ROOT/run_url.log"
+  "$BIN" run --name "url-run-${RUN_ID}" --base-image "url-demo:${RUN_ID}" \
+    "cat /tmp/zocker-url-$RUN_ID/download.bin" | tee "$run_url_log"
+  if ! grep -q "remote-v2" "$run_url_log"; then
+    fail "Changed URL content was served from a stale cache"
+  fi
+
+  log "Prune drops the superseded download and keeps the current one"
+  "$BIN" prune | tee "$TEST_ROOT/url_prune.log"
+  if ! grep -q "Removed [1-9][0-9]* unused downloads" "$TEST_ROOT/url_prune.log"; then
+    fail "Prune kept the body of the old URL content"
+  fi
+  "$BIN" build -f "$CTX_URL/Zockerfile" -t "url-demo:${RUN_ID}" | tee "$TEST_ROOT/url_build4.log"
+  if grep -q "\[FETCH\]" "$TEST_ROOT/url_build4.log"; then
+    fail "Prune removed the body of the current URL content"
+  fi
+
+  echo "[PASS] ADD <url> download cache revalidates"
+else
+  echo "[SKIP] python3 is not available for the ADD <url> test."
+fi
+
+# -----------------------------
+# Test 5: rebase onto a new base
+# -----------------------------
+mkdir -p "$CTX_REBASE"
+for b in a b; do
+  cat > "$CTX_REBASE/Zockerfile.$b" <<ZEOF
+BASEDIR $BASE_DIR
+RUN /bin/sh -c 'echo base-$b > /tmp/zocker-base-$b-$RUN_ID'
+ZEOF
+  "$BIN" build -f "$CTX_REBASE/Zockerfile.$b" -t "rebase-base-$b:${RUN_ID}" >/dev/null
+done
+
+cat > "$CTX_REBASE/Zockerfile" <<ZEOF
+FROM rebase-base-a:${RUN_ID}
+RUN /bin/sh -c 'echo app > /tmp/zocker-app-$RUN_ID'
+ZEOF
+"$BIN" build -f "$CTX_REBASE/Zockerfile" -t "rebase-app:${RUN_ID}" >/dev/null
+
+log "Rebase onto a new base, then back"
+rebase_log="$TEST_ROOT/rebase.log"
+"$BIN" rebase "rebase-app:${RUN_ID}" --onto "rebase-base-b:${RUN_ID}" | tee "$rebase_log"
+"$BIN" rebase "rebase-app:${RUN_ID}" --onto "rebase-base-a:${RUN_ID}" | tee -a "$rebase_log"
+if [[ $(grep -c "(1 layers" "$rebase_log") -ne 2 ]]; then
+  fail "Rebase replayed layers of the old base"
+fi
+
+run_rebase_log="$TEST_ROOT/run_rebase.log"
+"$BIN" run --name "rebase-run-${RUN_ID}" --base-image "rebase-app:${RUN_ID}" \
+  "/bin/sh -c 'for f in app base-a base-b; do test -e /tmp/zocker-\$f-$RUN_ID && echo has-\$f; done; true'" \
+  | tee "$run_rebase_log"
+if ! grep -q "has-app" "$run_rebase_log" || ! grep -q "has-base-a" "$run_rebase_log" ||
+  grep -q "has-base-b" "$run_rebase_log"; then
+  fail "Rebased image does not sit on exactly the new base"
+fi
+
+echo "[PASS] Rebase replays only the image's own layers"
+
+# -----------------------------
+# Test 6: watch mode
+# -----------------------------
+mkdir -p "$CTX_WATCH"
+echo "watch-a" > "$CTX_WATCH/a.txt"
+echo "watch-b1" > "$CTX_WATCH/b.txt"
+cat > "$CTX_WATCH/Zockerfile" <<ZEOF
+BASEDIR $BASE_DIR
+COPY a.txt /tmp/zocker-watch-$RUN_ID/
+COPY b.txt /tmp/zocker-watch-$RUN_ID/
+ZEOF
+
+log "Watch mode rebuilds only the step whose source changed"
+watch_log="$TEST_ROOT/watch.log"
+"$BIN" build --watch -f "$CTX_WATCH/Zockerfile" -t "watch-demo:${RUN_ID}" > "$watch_log" 2>&1 &
+WATCH_PID=$!
+for _ in $(seq 1 100); do
+  grep -q "^\[WATCH\] Watching" "$watch_log" && break
+  sleep 0.1
+done
+echo "watch-b2" > "$CTX_WATCH/b.txt"
+for _ in $(seq 1 100); do
+  grep -q "^\[WATCH\] Rebuilt" "$watch_log" && break
+  sleep 0.1
+done
+kill "$WATCH_PID" 2>/dev/null || true
+wait "$WATCH_PID" 2>/dev/null || true
+WATCH_PID=""
+cat "$watch_log"
+
+if ! grep -q "^\[WATCH\] Rebuilt" "$watch_log"; then
+  fail "Watch mode did not rebuild after a COPY source changed"
+fi
+rebuild_log="$TEST_ROOT/watch_rebuild.log"
+sed -n '/^\[WATCH\] Change detected/,$p' "$watch_log" > "$rebuild_log"
+if [[ $(grep -c "^\[BUILT\]" "$rebuild_log") -ne 1 ]] ||
+  ! grep -q "^\[BUILT\] COPY b.txt" "$rebuild_log" ||
+  ! grep -q "^\[CACHE HIT\] COPY a.txt" "$rebuild_log"; then
+  fail "Watch rebuild did not rebuild exactly the changed step"
+fi
+
+echo "[PASS] Watch mode rebuilds only the affected step"
+
+# -----------------------------
+# Test 7: detached containers
+# -----------------------------
+DETACH_NAME="detach-run-${RUN_ID}"
+
+log "Detached run, then ps, stop, wait and rm"
+detach_log="$TEST_ROOT/detach.log"
+"$BIN" run -d --name "$DETACH_NAME" --base-image "$IMAGE_SIMPLE_V2" \
+  "trap 'exit 7' TERM; while :; do sleep 1; done" | tee "$detach_log"
+if [[ "$(cat "$detach_log")" != "$DETACH_NAME" ]]; then
+  fail "run -d did not print the container name"
+fi
+"$BIN" ps > "$TEST_ROOT/ps.log"
+if ! grep -q "^$DETACH_NAME[[:space:]].*running" "$TEST_ROOT/ps.log"; then
+  fail "Detached container is not listed as running"
+fi
+
+log "Exec into the running container"
+exec_log="$TEST_ROOT/exec.log"
+"$BIN" exec "$DETACH_NAME" "cat /tmp/zocker-simple-$RUN_ID/out.txt /proc/1/cmdline" \
+  | tr '\0' ' ' | tee "$exec_log"
+echo
+if ! grep -q "$PAYLOAD_SIMPLE" "$exec_log" || ! grep -q "trap 'exit 7' TERM" "$exec_log"; then
+  fail "exec did not run inside the container's rootfs and PID namespace"
+fi
+exec_rc=0
+"$BIN" exec "$DETACH_NAME" "exit 3" || exec_rc=$?
+if [[ "$exec_rc" -ne 3 ]]; then
+  fail "exec did not return the command's exit code (got $exec_rc)"
+fi
+
+echo "[PASS] exec runs commands in a running container"
+
+if [[ -e /sys/fs/cgroup/cgroup.controllers ]]; then
+  log "Stats of the running container"
+  stats_log="$TEST_ROOT/stats.log"
+  "$BIN" stats --no-stream --json "$DETACH_NAME" | tee "$stats_log"
+  if [[ $(wc -l < "$stats_log") -ne 1 ]] ||
+    ! grep -q "^{\"container\":\"$DETACH_NAME\",\"time_ms\":[0-9]*,.*\"cpu_usage_us\":[0-9]" \
+      "$stats_log"; then
+    fail "stats --no-stream --json did not print one JSON row for the container"
+  fi
+  if command -v python3 >/dev/null 2>&1 &&
+    ! python3 -c 'import json,sys; json.loads(sys.stdin.read())' < "$stats_log"; then
+    fail "stats --json printed invalid JSON"
+  fi
+
+  echo "[PASS] stats reports the container's cgroup usage"
+else
+  echo "[SKIP] cgroup v2 is not mounted at /sys/fs/cgroup for the stats test."
+fi
+
+"$BIN" stop "$DETACH_NAME" >/dev/null
+if [[ "$("$BIN" wait "$DETACH_NAME")" != "7" ]]; then
+  fail "wait did not report the exit code of the stopped container"
+fi
+"$BIN" ps > "$TEST_ROOT/ps.log"
+if ! grep -q "^$DETACH_NAME[[:space:]].*exited (7)" "$TEST_ROOT/ps.log"; then
+  fail "Stopped container is not listed as exited"
+fi
+"$BIN" rm "$DETACH_NAME" >/dev/null
+"$BIN" ps > "$TEST_ROOT/ps.log"
+if grep -q "^$DETACH_NAME[[:space:]]" "$TEST_ROOT/ps.log"; then
+  fail "Removed container is still listed"
+fi
+
+echo "[PASS] Detached containers can be listed, stopped, waited for and removed"
+
+# -----------------------------
+# Test 8: CPU and NUMA placement
+# -----------------------------
+if [[ -e /sys/fs/cgroup/cgroup.controllers ]]; then
+  log "Run pinned with --cpuset-cpus"
+  cpuset_log="$TEST_ROOT/cpuset.log"
+  "$BIN" run --name "cpuset-run-${RUN_ID}" --cpuset-cpus 0 --base-image "$IMAGE_SIMPLE_V2" \
+    "cat /proc/self/status" > "$cpuset_log"
+  if ! grep -q "^Cpus_allowed_list:[[:space:]]*0$" "$cpuset_log"; then
+    fail "--cpuset-cpus 0 did not restrict the container to CPU 0"
+  fi
+
+  if [[ -r /sys/devices/system/node/node0/cpulist ]]; then
+    log "Run placed with --numa-node 0"
+    node_cpus="$(cat /sys/devices/system/node/node0/cpulist)"
+    numa_log="$TEST_ROOT/numa.log"
+    "$BIN" run --name "numa-run-${RUN_ID}" --numa-node 0 --base-image "$IMAGE_SIMPLE_V2" \
+      "cat /proc/self/status" > "$numa_log"
+    if ! grep -q "^Cpus_allowed_list:[[:space:]]*${node_cpus}$" "$numa_log"; then
+      fail "--numa-node 0 did not restrict the container to the CPUs of node 0 ($node_cpus)"
+    fi
+  else
+    echo "[SKIP] NUMA sysfs is not available for the --numa-node test."
+  fi
+
+  echo "[PASS] Containers run on the CPUs they were placed on"
+else
+  echo "[SKIP] cgroup v2 is not mounted at /sys/fs/cgroup for the placement test."
+fi
+
 log "List images"
 "$BIN" images
 
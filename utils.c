@@ -11,6 +11,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -47,7 +48,23 @@ int hash_string(const char *s, char out_hex[17]) {
   return 0;
 }
 
-static int hash_file_content(const char *path, uint64_t *hash) {
+/*
+ * Where a tree walk's bytes go: always the FNV-1a cache-key hash, and also a
+ * SHA-256 digest when sha is set.
+ */
+struct tree_hash {
+  uint64_t fnv;
+  struct sha256_ctx *sha;
+};
+
+static void tree_hash_update(struct tree_hash *h, const void *data, size_t len) {
+  h->fnv = fnv1a_update(h->fnv, data, len);
+  if (h->sha != NULL) {
+    sha256_update(h->sha, data, len);
+  }
+}
+
+static int hash_file_content(const char *path, struct tree_hash *hash) {
   int fd;
   ssize_t n;
   unsigned char buf[8192];
@@ -58,14 +75,152 @@ static int hash_file_content(const char *path, uint64_t *hash) {
   }
 
   while ((n = read(fd, buf, sizeof(buf))) > 0) {
-    *hash = fnv1a_update(*hash, buf, (size_t)n);
+    tree_hash_update(hash, buf, (size_t)n);
   }
 
   close(fd);
   return n < 0;
 }
 
-static int hash_path_internal(const char *path, const char *rel, uint64_t *hash) {
+/*
+ * Context-relative path of a walk root, or NULL when the filter does not apply
+ * to it (no filter, or the root lies outside the filter's root).
+ */
+static const char *filter_rel_of(const struct path_filter *filter, const char *path,
+                                 char *out, size_t out_size) {
+  char real[PATH_MAX];
+  size_t n;
+
+  if (filter == NULL || filter->skip == NULL || filter->root[0] == '\0') {
+    return NULL;
+  }
+
+  if (realpath(path, real) == NULL) {
+    return NULL;
+  }
+
+  n = strlen(filter->root);
+  if (strcmp(real, filter->root) == 0) {
+    snprintf(out, out_size, "%s", "");
+    return out;
+  }
+
+  if (strncmp(real, filter->root, n) != 0 || (real[n] != '/' && n != 1)) {
+    return NULL;
+  }
+
+  snprintf(out, out_size, "%s", n == 1 ? real + 1 : real + n + 1);
+  return out;
+}
+
+/* Context-relative path of a child entry, or NULL if the child is filtered out. */
+static const char *filter_child(const struct path_filter *filter, const char *parent_rel,
+                                const char *name, int is_dir, char *out,
+                                size_t out_size) {
+  if (parent_rel == NULL) {
+    return NULL;
+  }
+
+  if (parent_rel[0] == '\0') {
+    snprintf(out, out_size, "%s", name);
+  } else {
+    snprintf(out, out_size, "%s/%s", parent_rel, name);
+  }
+
+  if (filter->skip(out, is_dir, filter->ctx)) {
+    return NULL;
+  }
+
+  return out;
+}
+
+static int child_is_dir(const char *path) {
+  struct stat st;
+  return lstat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/*
+ * Adds what a layer diff carries besides names and contents: permission bits,
+ * ownership and every xattr (sorted by name, with values), so chmod, chown
+ * and overlay opacity all change the hash.
+ */
+static int hash_entry_meta(const char *path, const struct stat *st, struct tree_hash *hash) {
+  uint32_t meta[3];
+  char *list = NULL;
+  char **names = NULL;
+  size_t count = 0;
+  ssize_t len;
+  ssize_t off;
+  size_t i;
+  int rc = 0;
+
+  meta[0] = (uint32_t)(st->st_mode & 07777);
+  meta[1] = (uint32_t)st->st_uid;
+  meta[2] = (uint32_t)st->st_gid;
+  tree_hash_update(hash, meta, sizeof(meta));
+
+  len = llistxattr(path, NULL, 0);
+  if (len <= 0) {
+    return 0;
+  }
+
+  list = malloc((size_t)len);
+  if (list == NULL) {
+    return 1;
+  }
+  len = llistxattr(path, list, (size_t)len);
+  if (len < 0) {
+    free(list);
+    return 1;
+  }
+
+  for (off = 0; off < len; off += (ssize_t)strlen(list + off) + 1) {
+    char **grown = realloc(names, sizeof(char *) * (count + 1));
+
+    if (grown == NULL) {
+      free(names);
+      free(list);
+      return 1;
+    }
+    names = grown;
+    names[count++] = list + off;
+  }
+  qsort(names, count, sizeof(char *), str_cmp);
+
+  for (i = 0; i < count && rc == 0; i++) {
+    char marker = 'X';
+    ssize_t vlen = lgetxattr(path, names[i], NULL, 0);
+    char *value;
+
+    tree_hash_update(hash, &marker, 1);
+    tree_hash_update(hash, names[i], strlen(names[i]) + 1);
+    if (vlen <= 0) {
+      continue;
+    }
+
+    value = malloc((size_t)vlen);
+    if (value == NULL) {
+      rc = 1;
+      break;
+    }
+    vlen = lgetxattr(path, names[i], value, (size_t)vlen);
+    if (vlen < 0) {
+      rc = 1;
+    } else {
+      tree_hash_update(hash, &vlen, sizeof(vlen));
+      tree_hash_update(hash, value, (size_t)vlen);
+    }
+    free(value);
+  }
+
+  free(names);
+  free(list);
+  return rc;
+}
+
+static int hash_path_internal(const char *path, const char *rel,
+                              const struct path_filter *filter, const char *filter_rel,
+                              struct tree_hash *hash) {
   struct stat st;
 
   if (lstat(path, &st) != 0) {
@@ -80,8 +235,11 @@ static int hash_path_internal(const char *path, const char *rel, uint64_t *hash)
     size_t count = 0;
     size_t i;
 
-    *hash = fnv1a_update(*hash, &marker, 1);
-    *hash = fnv1a_update(*hash, rel, strlen(rel));
+    tree_hash_update(hash, &marker, 1);
+    tree_hash_update(hash, rel, strlen(rel));
+    if (hash_entry_meta(path, &st, hash) != 0) {
+      return 1;
+    }
 
     dir = opendir(path);
     if (dir == NULL) {
@@ -119,7 +277,9 @@ static int hash_path_internal(const char *path, const char *rel, uint64_t *hash)
     for (i = 0; i < count; i++) {
       char child_path[PATH_MAX];
       char child_rel[PATH_MAX];
-      int rc;
+      char child_filter_rel[PATH_MAX];
+      const char *next_filter_rel = NULL;
+      int rc = 0;
 
       if (rel[0] == '\0') {
         snprintf(child_rel, sizeof(child_rel), "%s", names[i]);
@@ -128,7 +288,17 @@ static int hash_path_internal(const char *path, const char *rel, uint64_t *hash)
       }
 
       snprintf(child_path, sizeof(child_path), "%s/%s", path, names[i]);
-      rc = hash_path_internal(child_path, child_rel, hash);
+
+      if (filter_rel != NULL) {
+        next_filter_rel = filter_child(filter, filter_rel, names[i], child_is_dir(child_path),
+                                       child_filter_rel, sizeof(child_filter_rel));
+        if (next_filter_rel == NULL) {
+          free(names[i]);
+          continue;
+        }
+      }
+
+      rc = hash_path_internal(child_path, child_rel, filter, next_filter_rel, hash);
       free(names[i]);
 
       if (rc != 0) {
@@ -147,9 +317,12 @@ static int hash_path_internal(const char *path, const char *rel, uint64_t *hash)
 
   if (S_ISREG(st.st_mode)) {
     char marker = 'F';
-    *hash = fnv1a_update(*hash, &marker, 1);
-    *hash = fnv1a_update(*hash, rel, strlen(rel));
-    *hash = fnv1a_update(*hash, &st.st_size, sizeof(st.st_size));
+    tree_hash_update(hash, &marker, 1);
+    tree_hash_update(hash, rel, strlen(rel));
+    tree_hash_update(hash, &st.st_size, sizeof(st.st_size));
+    if (hash_entry_meta(path, &st, hash) != 0) {
+      return 1;
+    }
     return hash_file_content(path, hash);
   }
 
@@ -163,34 +336,217 @@ static int hash_path_internal(const char *path, const char *rel, uint64_t *hash)
     }
 
     target[n] = '\0';
-    *hash = fnv1a_update(*hash, &marker, 1);
-    *hash = fnv1a_update(*hash, rel, strlen(rel));
-    *hash = fnv1a_update(*hash, target, (size_t)n);
-    return 0;
+    tree_hash_update(hash, &marker, 1);
+    tree_hash_update(hash, rel, strlen(rel));
+    tree_hash_update(hash, target, (size_t)n + 1);
+    return hash_entry_meta(path, &st, hash);
   }
 
   {
     char marker = 'O';
-    *hash = fnv1a_update(*hash, &marker, 1);
-    *hash = fnv1a_update(*hash, rel, strlen(rel));
-    *hash = fnv1a_update(*hash, &st.st_mode, sizeof(st.st_mode));
+    tree_hash_update(hash, &marker, 1);
+    tree_hash_update(hash, rel, strlen(rel));
+    tree_hash_update(hash, &st.st_mode, sizeof(st.st_mode));
+    tree_hash_update(hash, &st.st_rdev, sizeof(st.st_rdev));
   }
 
-  return 0;
+  return hash_entry_meta(path, &st, hash);
 }
 
 int hash_path_recursive(const char *path, char out_hex[17]) {
-  uint64_t h = fnv1a_init();
+  return hash_path_filtered(path, NULL, out_hex);
+}
+
+/* Like hash_path_recursive, but entries the filter skips are left out entirely. */
+int hash_path_filtered(const char *path, const struct path_filter *filter, char out_hex[17]) {
+  struct tree_hash h;
+  char filter_rel[PATH_MAX];
 
   if (path == NULL) {
     return 1;
   }
 
-  if (hash_path_internal(path, "", &h) != 0) {
+  h.fnv = fnv1a_init();
+  h.sha = NULL;
+  if (hash_path_internal(path, "", filter,
+                         filter_rel_of(filter, path, filter_rel, sizeof(filter_rel)),
+                         &h) != 0) {
     return 1;
   }
 
-  fnv1a_hex(h, out_hex);
+  fnv1a_hex(h.fnv, out_hex);
+  return 0;
+}
+
+/* hash_path_recursive plus a SHA-256 digest of the same records, in one walk. */
+int digest_path_recursive(const char *path, char out_hex[17], char out_digest[65]) {
+  struct sha256_ctx sha;
+  struct tree_hash h;
+
+  h.fnv = fnv1a_init();
+  h.sha = &sha;
+  sha256_init(&sha);
+  if (path == NULL || hash_path_internal(path, "", NULL, NULL, &h) != 0) {
+    return 1;
+  }
+
+  fnv1a_hex(h.fnv, out_hex);
+  sha256_final(&sha, out_digest);
+  return 0;
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t state[8], const unsigned char block[64]) {
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, h;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+           ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+  }
+  for (i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  a = state[0];
+  b = state[1];
+  c = state[2];
+  d = state[3];
+  e = state[4];
+  f = state[5];
+  g = state[6];
+  h = state[7];
+
+  for (i = 0; i < 64; i++) {
+    uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                  sha256_k[i] + w[i];
+    uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void sha256_init(struct sha256_ctx *ctx) {
+  static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+  memcpy(ctx->state, initial, sizeof(initial));
+  ctx->fill = 0;
+  ctx->total = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char *)data;
+
+  ctx->total += (uint64_t)len;
+  while (len > 0) {
+    size_t take = sizeof(ctx->block) - ctx->fill;
+
+    if (len < take) {
+      take = len;
+    }
+    memcpy(ctx->block + ctx->fill, p, take);
+    ctx->fill += take;
+    p += take;
+    len -= take;
+
+    if (ctx->fill == sizeof(ctx->block)) {
+      sha256_block(ctx->state, ctx->block);
+      ctx->fill = 0;
+    }
+  }
+}
+
+void sha256_final(struct sha256_ctx *ctx, char out_hex[65]) {
+  uint64_t bits = ctx->total * 8;
+  int i;
+
+  ctx->block[ctx->fill++] = 0x80;
+  if (ctx->fill > 56) {
+    memset(ctx->block + ctx->fill, 0, sizeof(ctx->block) - ctx->fill);
+    sha256_block(ctx->state, ctx->block);
+    ctx->fill = 0;
+  }
+  memset(ctx->block + ctx->fill, 0, 56 - ctx->fill);
+  for (i = 0; i < 8; i++) {
+    ctx->block[63 - i] = (unsigned char)(bits >> (i * 8));
+  }
+  sha256_block(ctx->state, ctx->block);
+
+  for (i = 0; i < 8; i++) {
+    snprintf(out_hex + i * 8, 9, "%08x", ctx->state[i]);
+  }
+}
+
+int sha256_string(const char *s, char out_hex[65]) {
+  struct sha256_ctx ctx;
+
+  if (s == NULL) {
+    return 1;
+  }
+  sha256_init(&ctx);
+  sha256_update(&ctx, s, strlen(s));
+  sha256_final(&ctx, out_hex);
+  return 0;
+}
+
+/* SHA-256 of a regular file's bytes, as 64 lowercase hex digits. */
+int sha256_file(const char *path, char out_hex[65]) {
+  struct sha256_ctx ctx;
+  unsigned char buf[8192];
+  ssize_t n;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 1;
+  }
+
+  sha256_init(&ctx);
+  while ((n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      close(fd);
+      return 1;
+    }
+    sha256_update(&ctx, buf, (size_t)n);
+  }
+  close(fd);
+
+  sha256_final(&ctx, out_hex);
   return 0;
 }
 
@@ -330,7 +686,8 @@ int copy_file_data(const char *src, const char *dst, mode_t mode) {
   return n < 0;
 }
 
-int copy_path_recursive(const char *src, const char *dst) {
+static int copy_path_internal(const char *src, const char *dst,
+                              const struct path_filter *filter, const char *filter_rel) {
   struct stat st;
 
   if (lstat(src, &st) != 0) {
@@ -353,6 +710,8 @@ int copy_path_recursive(const char *src, const char *dst) {
     while ((ent = readdir(dir)) != NULL) {
       char child_src[PATH_MAX];
       char child_dst[PATH_MAX];
+      char child_filter_rel[PATH_MAX];
+      const char *next_filter_rel = NULL;
 
       if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
         continue;
@@ -361,7 +720,16 @@ int copy_path_recursive(const char *src, const char *dst) {
       snprintf(child_src, sizeof(child_src), "%s/%s", src, ent->d_name);
       snprintf(child_dst, sizeof(child_dst), "%s/%s", dst, ent->d_name);
 
-      if (copy_path_recursive(child_src, child_dst) != 0) {
+      if (filter_rel != NULL) {
+        next_filter_rel = filter_child(filter, filter_rel, ent->d_name,
+                                       child_is_dir(child_src), child_filter_rel,
+                                       sizeof(child_filter_rel));
+        if (next_filter_rel == NULL) {
+          continue;
+        }
+      }
+
+      if (copy_path_internal(child_src, child_dst, filter, next_filter_rel) != 0) {
         closedir(dir);
         return 1;
       }
@@ -395,6 +763,17 @@ int copy_path_recursive(const char *src, const char *dst) {
   return 1;
 }
 
+int copy_path_recursive(const char *src, const char *dst) {
+  return copy_path_filtered(src, dst, NULL);
+}
+
+int copy_path_filtered(const char *src, const char *dst, const struct path_filter *filter) {
+  char filter_rel[PATH_MAX];
+
+  return copy_path_internal(src, dst, filter,
+                            filter_rel_of(filter, src, filter_rel, sizeof(filter_rel)));
+}
+
 static unsigned long long dir_size_internal(const char *path) {
   struct stat st;
 
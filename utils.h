@@ -10,11 +10,38 @@
 #define PATH_MAX 4096
 #endif
 
+/*
+ * Prunes entries from recursive walks. skip() gets the entry's path relative
+ * to root (the real path of the build context); a skipped directory is not
+ * descended into. Walks rooted outside root are not filtered.
+ */
+struct path_filter {
+  char root[PATH_MAX];
+  int (*skip)(const char *rel, int is_dir, void *ctx);
+  void *ctx;
+};
+
 uint64_t fnv1a_init(void);
 uint64_t fnv1a_update(uint64_t hash, const void *data, size_t len);
 void fnv1a_hex(uint64_t hash, char out[17]);
 int hash_string(const char *s, char out_hex[17]);
 int hash_path_recursive(const char *path, char out_hex[17]);
+int hash_path_filtered(const char *path, const struct path_filter *filter, char out_hex[17]);
+/* FNV-1a hash (cache-key hint) and SHA-256 digest (identity) of a tree. */
+int digest_path_recursive(const char *path, char out_hex[17], char out_digest[65]);
+
+struct sha256_ctx {
+  uint32_t state[8];
+  unsigned char block[64];
+  size_t fill;
+  uint64_t total;
+};
+
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final(struct sha256_ctx *ctx, char out_hex[65]);
+int sha256_string(const char *s, char out_hex[65]);
+int sha256_file(const char *path, char out_hex[65]);
 
 int generate_uuid(char out[64]);
 
@@ -25,6 +52,7 @@ int ensure_parent_dirs(const char *path, mode_t mode);
 
 int copy_file_data(const char *src, const char *dst, mode_t mode);
 int copy_path_recursive(const char *src, const char *dst);
+int copy_path_filtered(const char *src, const char *dst, const struct path_filter *filter);
 unsigned long long dir_size_bytes(const char *path);
 int remove_recursive(const char *path);
 
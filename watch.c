@@ -0,0 +1,282 @@
+#define _GNU_SOURCE
+
+#include "watch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCH_EVENTS                                                                     \
+  (IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM |     \
+   IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct watched_dir {
+  int wd;
+  char path[PATH_MAX];
+};
+
+struct context_watch {
+  int fd;
+  char root[PATH_MAX];
+  const struct path_filter *filter;
+  struct watched_dir *dirs;
+  size_t dir_count;
+  size_t dir_cap;
+};
+
+static const char *rel_to_root(const struct context_watch *watch, const char *path) {
+  size_t n = strlen(watch->root);
+
+  if (strncmp(path, watch->root, n) != 0) {
+    return NULL;
+  }
+  if (path[n] == '\0') {
+    return "";
+  }
+  return path[n] == '/' ? path + n + 1 : NULL;
+}
+
+static int is_filtered(const struct context_watch *watch, const char *path, int is_dir) {
+  const char *rel;
+
+  if (watch->filter == NULL || watch->filter->skip == NULL) {
+    return 0;
+  }
+
+  rel = rel_to_root(watch, path);
+  if (rel == NULL || rel[0] == '\0') {
+    return 0;
+  }
+
+  return watch->filter->skip(rel, is_dir, watch->filter->ctx);
+}
+
+static struct watched_dir *find_dir(struct context_watch *watch, int wd) {
+  size_t i;
+
+  for (i = 0; i < watch->dir_count; i++) {
+    if (watch->dirs[i].wd == wd) {
+      return &watch->dirs[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void forget_dir(struct context_watch *watch, int wd) {
+  size_t i;
+
+  for (i = 0; i < watch->dir_count; i++) {
+    if (watch->dirs[i].wd == wd) {
+      watch->dirs[i] = watch->dirs[--watch->dir_count];
+      return;
+    }
+  }
+}
+
+static int add_dir(struct context_watch *watch, const char *path) {
+  struct watched_dir *entry;
+  int wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+
+  if (wd < 0) {
+    return 1;
+  }
+
+  entry = find_dir(watch, wd);
+  if (entry == NULL) {
+    if (watch->dir_count == watch->dir_cap) {
+      size_t new_cap = watch->dir_cap == 0 ? 64 : watch->dir_cap * 2;
+      struct watched_dir *dirs = realloc(watch->dirs, sizeof(*dirs) * new_cap);
+
+      if (dirs == NULL) {
+        inotify_rm_watch(watch->fd, wd);
+        return 1;
+      }
+      watch->dirs = dirs;
+      watch->dir_cap = new_cap;
+    }
+    entry = &watch->dirs[watch->dir_count++];
+  }
+
+  entry->wd = wd;
+  snprintf(entry->path, sizeof(entry->path), "%s", path);
+  return 0;
+}
+
+/* Directories that vanish mid-walk are skipped, not treated as errors. */
+static int add_tree(struct context_watch *watch, const char *path) {
+  DIR *dir;
+  struct dirent *ent;
+
+  if (add_dir(watch, path) != 0) {
+    return errno == ENOENT || errno == ENOTDIR ? 0 : 1;
+  }
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    return 0;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    char child[PATH_MAX];
+    struct stat st;
+
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+      continue;
+    }
+
+    snprintf(child, sizeof(child), "%s/%s", path, ent->d_name);
+    if (lstat(child, &st) != 0 || !S_ISDIR(st.st_mode) || is_filtered(watch, child, 1)) {
+      continue;
+    }
+
+    if (add_tree(watch, child) != 0) {
+      closedir(dir);
+      return 1;
+    }
+  }
+
+  closedir(dir);
+  return 0;
+}
+
+struct context_watch *watch_open(const char *root, const struct path_filter *filter) {
+  struct context_watch *watch = calloc(1, sizeof(*watch));
+
+  if (watch == NULL) {
+    return NULL;
+  }
+
+  if (realpath(root, watch->root) == NULL) {
+    free(watch);
+    return NULL;
+  }
+
+  watch->filter = filter;
+  watch->fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (watch->fd < 0) {
+    free(watch);
+    return NULL;
+  }
+
+  if (add_tree(watch, watch->root) != 0) {
+    fprintf(stderr, "[ERR] Failed to watch %s: %s\n", watch->root, strerror(errno));
+    watch_close(watch);
+    return NULL;
+  }
+
+  return watch;
+}
+
+void watch_close(struct context_watch *watch) {
+  if (watch == NULL) {
+    return;
+  }
+
+  close(watch->fd);
+  free(watch->dirs);
+  free(watch);
+}
+
+/* Drains the queued events; returns the number of changes reported. */
+static int read_events(struct context_watch *watch,
+                       void (*on_change)(const char *path, void *ctx), void *ctx) {
+  char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int reported = 0;
+
+  while (1) {
+    ssize_t n = read(watch->fd, buf, sizeof(buf));
+    char *p;
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN ? reported : -1;
+    }
+
+    for (p = buf; p < buf + n;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      struct watched_dir *dir;
+      char path[PATH_MAX];
+      int is_dir = (ev->mask & IN_ISDIR) != 0;
+
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        on_change(watch->root, ctx);
+        reported++;
+        continue;
+      }
+
+      dir = find_dir(watch, ev->wd);
+      if (dir == NULL) {
+        continue;
+      }
+
+      if (ev->mask & IN_IGNORED) {
+        forget_dir(watch, ev->wd);
+        continue;
+      }
+
+      if (ev->len > 0) {
+        snprintf(path, sizeof(path), "%s/%s", dir->path, ev->name);
+      } else {
+        snprintf(path, sizeof(path), "%s", dir->path);
+      }
+
+      if (is_filtered(watch, path, is_dir)) {
+        continue;
+      }
+
+      if (is_dir && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        add_tree(watch, path);
+      }
+
+      on_change(path, ctx);
+      reported++;
+    }
+  }
+}
+
+int watch_next_batch(struct context_watch *watch, int debounce_ms,
+                     void (*on_change)(const char *path, void *ctx), void *ctx) {
+  struct pollfd pfd;
+  int reported = 0;
+
+  if (watch == NULL || on_change == NULL) {
+    return 1;
+  }
+
+  pfd.fd = watch->fd;
+  pfd.events = POLLIN;
+
+  while (1) {
+    int timeout = reported > 0 ? debounce_ms : -1;
+    int ready = poll(&pfd, 1, timeout);
+    int n;
+
+    if (ready < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 1;
+    }
+
+    if (ready == 0) {
+      return 0;
+    }
+
+    n = read_events(watch, on_change, ctx);
+    if (n < 0) {
+      return 1;
+    }
+    reported += n;
+  }
+}
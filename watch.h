@@ -0,0 +1,27 @@
+#ifndef __WATCH_H__
+#define __WATCH_H__
+
+#include "utils.h"
+
+#ifndef WATCH_DEBOUNCE_MS
+#define WATCH_DEBOUNCE_MS 150
+#endif
+
+struct context_watch;
+
+/*
+ * Recursively watches root with inotify. Directories the filter skips are not
+ * watched, and changes to skipped entries are not reported.
+ */
+struct context_watch *watch_open(const char *root, const struct path_filter *filter);
+void watch_close(struct context_watch *watch);
+
+/*
+ * Blocks until something under root changes, then keeps collecting events
+ * until debounce_ms pass without one. on_change gets the absolute path of every
+ * changed entry; after a queue overflow it gets root itself.
+ */
+int watch_next_batch(struct context_watch *watch, int debounce_ms,
+                     void (*on_change)(const char *path, void *ctx), void *ctx);
+
+#endif
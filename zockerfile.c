@@ -0,0 +1,938 @@
+#define _GNU_SOURCE
+
+#include "zockerfile.h"
+
+#include <ctype.h>
+#include <glob.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "download.h"
+#include "utils.h"
+
+#define MAX_LOCAL_ARGS 128
+
+struct arg_map {
+  struct build_arg items[MAX_LOCAL_ARGS];
+  int count;
+};
+
+static int arg_map_set(struct arg_map *map, const char *key, const char *value) {
+  int i;
+
+  if (map == NULL || key == NULL || value == NULL || key[0] == '\0') {
+    return 1;
+  }
+
+  for (i = 0; i < map->count; i++) {
+    if (strcmp(map->items[i].key, key) == 0) {
+      snprintf(map->items[i].value, sizeof(map->items[i].value), "%s", value);
+      return 0;
+    }
+  }
+
+  if (map->count >= MAX_LOCAL_ARGS) {
+    return 1;
+  }
+
+  snprintf(map->items[map->count].key, sizeof(map->items[map->count].key), "%s",
+           key);
+  snprintf(map->items[map->count].value,
+           sizeof(map->items[map->count].value), "%s", value);
+  map->count++;
+  return 0;
+}
+
+static const char *arg_map_get(const struct arg_map *map, const char *key) {
+  int i;
+
+  if (map == NULL || key == NULL) {
+    return NULL;
+  }
+
+  for (i = 0; i < map->count; i++) {
+    if (strcmp(map->items[i].key, key) == 0) {
+      return map->items[i].value;
+    }
+  }
+
+  return NULL;
+}
+
+static void arg_map_copy(struct arg_map *dst, const struct arg_map *src) {
+  if (dst == NULL || src == NULL) {
+    return;
+  }
+  memset(dst, 0, sizeof(*dst));
+  memcpy(dst, src, sizeof(*dst));
+}
+
+static int init_cli_args_map(const struct build_arg *cli_args, int cli_arg_count,
+                             struct arg_map *map) {
+  int i;
+
+  memset(map, 0, sizeof(*map));
+  for (i = 0; i < cli_arg_count; i++) {
+    if (arg_map_set(map, cli_args[i].key, cli_args[i].value) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int substitute_args(const char *input, const struct arg_map *args, char *out,
+                           size_t out_size) {
+  size_t i = 0;
+  size_t w = 0;
+
+  if (input == NULL || out == NULL || out_size == 0) {
+    return 1;
+  }
+
+  while (input[i] != '\0') {
+    if (input[i] == '$') {
+      char key[128] = {0};
+      size_t k = 0;
+      const char *value;
+      size_t value_len;
+
+      if (input[i + 1] == '$') {
+        if (w + 1 >= out_size) return 1;
+        out[w++] = '$';
+        i += 2;
+        continue;
+      }
+
+      if (input[i + 1] == '{') {
+        i += 2;
+        while (input[i] != '\0' && input[i] != '}' && k + 1 < sizeof(key)) {
+          key[k++] = input[i++];
+        }
+        if (input[i] == '}') {
+          i++;
+        }
+      } else {
+        i++;
+        while (input[i] != '\0' &&
+               (isalnum((unsigned char)input[i]) || input[i] == '_') &&
+               k + 1 < sizeof(key)) {
+          key[k++] = input[i++];
+        }
+
+        if (k == 0) {
+          if (w + 1 >= out_size) return 1;
+          out[w++] = '$';
+          continue;
+        }
+      }
+
+      key[k] = '\0';
+      value = arg_map_get(args, key);
+      if (value == NULL) {
+        value = "";
+      }
+
+      value_len = strlen(value);
+      if (w + value_len >= out_size) {
+        return 1;
+      }
+
+      memcpy(out + w, value, value_len);
+      w += value_len;
+      continue;
+    }
+
+    if (w + 1 >= out_size) {
+      return 1;
+    }
+
+    out[w++] = input[i++];
+  }
+
+  out[w] = '\0';
+  return 0;
+}
+
+static int parse_two_tokens(const char *input, char *first, size_t first_size,
+                            char *second, size_t second_size) {
+  char tmp[2048];
+  char *saveptr = NULL;
+  char *t1;
+  char *t2;
+
+  snprintf(tmp, sizeof(tmp), "%s", input);
+  t1 = strtok_r(tmp, " \t", &saveptr);
+  t2 = strtok_r(NULL, " \t", &saveptr);
+
+  if (t1 == NULL || t2 == NULL) {
+    return 1;
+  }
+
+  snprintf(first, first_size, "%s", t1);
+  snprintf(second, second_size, "%s", t2);
+  return 0;
+}
+
+/*
+ * Splits COPY arguments in place into tokens[0..*count-1]: one or more
+ * sources followed by the destination. --from= and --link may lead, in any
+ * order.
+ */
+static int parse_copy_tokens(char *input, char *from_stage, size_t from_stage_size,
+                             int *link, char **tokens, int max_tokens, int *count) {
+  char *saveptr = NULL;
+  char *tok;
+
+  from_stage[0] = '\0';
+  *link = 0;
+  *count = 0;
+
+  tok = strtok_r(input, " \t", &saveptr);
+  while (tok != NULL && starts_with(tok, "--")) {
+    if (starts_with(tok, "--from=")) {
+      snprintf(from_stage, from_stage_size, "%s", tok + 7);
+    } else if (strcmp(tok, "--link") == 0) {
+      *link = 1;
+    } else {
+      return 1;
+    }
+    tok = strtok_r(NULL, " \t", &saveptr);
+  }
+
+  for (; tok != NULL; tok = strtok_r(NULL, " \t", &saveptr)) {
+    if (*count == max_tokens) {
+      return 1;
+    }
+    tokens[(*count)++] = tok;
+  }
+
+  return *count < 2;
+}
+
+static int parse_base_and_alias(const char *input, char *base, size_t base_size,
+                                char *alias, size_t alias_size) {
+  char tmp[2048];
+  char *saveptr = NULL;
+  char *t1;
+  char *t2;
+  char *t3;
+
+  alias[0] = '\0';
+  snprintf(tmp, sizeof(tmp), "%s", input);
+  t1 = strtok_r(tmp, " \t", &saveptr);
+
+  if (t1 == NULL) {
+    return 1;
+  }
+
+  snprintf(base, base_size, "%s", t1);
+
+  t2 = strtok_r(NULL, " \t", &saveptr);
+  t3 = strtok_r(NULL, " \t", &saveptr);
+
+  if (t2 != NULL && t3 != NULL && strcasecmp(t2, "AS") == 0) {
+    snprintf(alias, alias_size, "%s", t3);
+  }
+
+  return 0;
+}
+
+static int parse_arg_kv(const char *raw, char *key, size_t key_size, char *value,
+                        size_t value_size, int *has_default) {
+  const char *eq;
+  size_t key_len;
+
+  if (raw == NULL || key == NULL || value == NULL || has_default == NULL) {
+    return 1;
+  }
+
+  eq = strchr(raw, '=');
+  if (eq == NULL) {
+    snprintf(key, key_size, "%s", raw);
+    value[0] = '\0';
+    *has_default = 0;
+    return 0;
+  }
+
+  key_len = (size_t)(eq - raw);
+  if (key_len == 0 || key_len >= key_size) {
+    return 1;
+  }
+
+  memcpy(key, raw, key_len);
+  key[key_len] = '\0';
+  snprintf(value, value_size, "%s", eq + 1);
+  *has_default = 1;
+  return 0;
+}
+
+static int get_context_dir(const char *zockerfile_path, char *out, size_t out_size) {
+  char tmp[PATH_MAX];
+  char *slash;
+
+  snprintf(tmp, sizeof(tmp), "%s", zockerfile_path);
+  slash = strrchr(tmp, '/');
+  if (slash == NULL) {
+    return snprintf(out, out_size, ".") < 0 ? 1 : 0;
+  }
+
+  if (slash == tmp) {
+    return snprintf(out, out_size, "/") < 0 ? 1 : 0;
+  }
+
+  *slash = '\0';
+  return snprintf(out, out_size, "%s", tmp) < 0 ? 1 : 0;
+}
+
+struct parse_state {
+  struct zockerfile *zf;
+  struct arg_map cli_args;
+  struct arg_map global_args;
+  struct arg_map stage_args[MAX_STAGES];
+  int current_stage;
+  char workdir[512];
+  int errors;
+};
+
+static void parse_error(struct parse_state *ps, int line_no, const char *fmt, ...) {
+  va_list ap;
+
+  fprintf(stderr, "[ERR] ");
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, " at line %d\n", line_no);
+  ps->errors++;
+}
+
+/*
+ * Reads one logical line: a trailing backslash joins the next physical line,
+ * and comment lines inside a continuation are dropped. *line_no is advanced
+ * past every physical line read and *start_line gets the first of them.
+ */
+static int read_logical_line(FILE *fp, char **buf, size_t *buf_size, int *line_no,
+                             int *start_line) {
+  char *phys = NULL;
+  size_t phys_size = 0;
+  size_t used = 0;
+  int continued = 0;
+
+  if (*buf == NULL) {
+    *buf = malloc(256);
+    if (*buf == NULL) {
+      return -1;
+    }
+    *buf_size = 256;
+  }
+  (*buf)[0] = '\0';
+
+  while (getline(&phys, &phys_size, fp) >= 0) {
+    size_t len;
+    char *text = phys;
+
+    (*line_no)++;
+    phys[strcspn(phys, "\r\n")] = '\0';
+
+    if (!continued) {
+      *start_line = *line_no;
+    } else {
+      char *peek = trim_whitespace(phys);
+      if (peek[0] == '#') {
+        continue;
+      }
+    }
+
+    len = strlen(text);
+    continued = len > 0 && text[len - 1] == '\\';
+    if (continued) {
+      text[--len] = '\0';
+    }
+
+    if (used + len + 2 > *buf_size) {
+      size_t new_size = (used + len + 2) * 2;
+      char *grown = realloc(*buf, new_size);
+      if (grown == NULL) {
+        free(phys);
+        return -1;
+      }
+      *buf = grown;
+      *buf_size = new_size;
+    }
+
+    memcpy(*buf + used, text, len);
+    used += len;
+    (*buf)[used] = '\0';
+
+    if (!continued) {
+      break;
+    }
+    (*buf)[used++] = ' ';
+    (*buf)[used] = '\0';
+  }
+
+  free(phys);
+  return (used == 0 && feof(fp)) ? -1 : 0;
+}
+
+static struct zinstr *append_instr(struct parse_state *ps, enum zinstr_kind kind,
+                                   int line_no, const char *text) {
+  struct zockerfile *zf = ps->zf;
+  struct zinstr *in;
+
+  if (zf->count == zf->cap) {
+    int new_cap = zf->cap == 0 ? 16 : zf->cap * 2;
+    struct zinstr *grown = realloc(zf->instrs, (size_t)new_cap * sizeof(*grown));
+    if (grown == NULL) {
+      return NULL;
+    }
+    zf->instrs = grown;
+    zf->cap = new_cap;
+  }
+
+  in = &zf->instrs[zf->count++];
+  memset(in, 0, sizeof(*in));
+  in->kind = kind;
+  in->line_no = line_no;
+  in->stage = ps->current_stage;
+  in->from_stage = -1;
+  snprintf(in->text, sizeof(in->text), "%s", text);
+  snprintf(in->workdir, sizeof(in->workdir), "%s", ps->workdir);
+  return in;
+}
+
+static struct arg_map *scope_args(struct parse_state *ps) {
+  return ps->current_stage >= 0 ? &ps->stage_args[ps->current_stage] : &ps->global_args;
+}
+
+static void parse_arg(struct parse_state *ps, int line_no, const char *rest) {
+  char key[64];
+  char default_val[256];
+  char resolved_default[256];
+  int has_default = 0;
+  const char *cli_val;
+  const char *current_val;
+  const char *final_val;
+  struct arg_map *scope = scope_args(ps);
+
+  if (rest[0] == '\0' || parse_arg_kv(rest, key, sizeof(key), default_val,
+                                      sizeof(default_val), &has_default) != 0) {
+    parse_error(ps, line_no, "Invalid ARG");
+    return;
+  }
+
+  resolved_default[0] = '\0';
+  if (has_default && substitute_args(default_val, scope, resolved_default,
+                                     sizeof(resolved_default)) != 0) {
+    parse_error(ps, line_no, "ARG default is too long");
+    return;
+  }
+
+  cli_val = arg_map_get(&ps->cli_args, key);
+  current_val = arg_map_get(scope, key);
+  if (cli_val != NULL) {
+    final_val = cli_val;
+  } else if (has_default) {
+    final_val = resolved_default;
+  } else if (current_val != NULL) {
+    final_val = current_val;
+  } else {
+    final_val = "";
+  }
+
+  if (arg_map_set(scope, key, final_val) != 0) {
+    parse_error(ps, line_no, "Too many ARGs");
+  }
+}
+
+static void parse_stage(struct parse_state *ps, enum zinstr_kind kind, const char *cmd,
+                        int line_no, const char *rest, const char *text) {
+  struct zockerfile *zf = ps->zf;
+  struct zstage *stage;
+  struct zinstr *in;
+  char base_raw[1024];
+  char base_value[1024];
+  char alias[64];
+  int i;
+
+  if (zf->stage_count >= MAX_STAGES) {
+    parse_error(ps, line_no, "Too many stages");
+    return;
+  }
+
+  if (parse_base_and_alias(rest, base_raw, sizeof(base_raw), alias, sizeof(alias)) != 0) {
+    parse_error(ps, line_no, "Invalid %s", cmd);
+    return;
+  }
+
+  if (substitute_args(base_raw, &ps->global_args, base_value, sizeof(base_value)) != 0) {
+    parse_error(ps, line_no, "%s value is too long", cmd);
+    return;
+  }
+
+  for (i = 0; alias[0] != '\0' && i < zf->stage_count; i++) {
+    if (strcmp(zf->stages[i].name, alias) == 0) {
+      parse_error(ps, line_no, "Duplicate stage name '%s'", alias);
+      return;
+    }
+  }
+
+  stage = &zf->stages[zf->stage_count];
+  memset(stage, 0, sizeof(*stage));
+  stage->line_no = line_no;
+  stage->is_basedir = kind == ZI_BASEDIR;
+
+  if (alias[0] != '\0') {
+    snprintf(stage->name, sizeof(stage->name), "%s", alias);
+  } else {
+    snprintf(stage->name, sizeof(stage->name), "%d", zf->stage_count);
+  }
+
+  if (kind == ZI_BASEDIR) {
+    if (base_value[0] == '/') {
+      snprintf(stage->base, sizeof(stage->base), "%s", base_value);
+    } else {
+      snprintf(stage->base, sizeof(stage->base), "%s/%s", zf->context_dir, base_value);
+    }
+
+    if (!is_directory(stage->base)) {
+      parse_error(ps, line_no, "BASEDIR path is not a directory (%s)", stage->base);
+    }
+  } else {
+    snprintf(stage->base, sizeof(stage->base), "%s", base_value);
+  }
+
+  ps->current_stage = zf->stage_count;
+  zf->stage_count++;
+  arg_map_copy(&ps->stage_args[ps->current_stage], &ps->global_args);
+  snprintf(ps->workdir, sizeof(ps->workdir), "/");
+
+  in = append_instr(ps, kind, line_no, text);
+  if (in == NULL) {
+    parse_error(ps, line_no, "Out of memory");
+    return;
+  }
+  snprintf(in->value, sizeof(in->value), "%s", stage->base);
+}
+
+static int find_earlier_stage(const struct parse_state *ps, const char *name_or_index) {
+  const struct zockerfile *zf = ps->zf;
+  int i;
+  int all_digits = name_or_index[0] != '\0';
+
+  for (i = 0; name_or_index[i] != '\0'; i++) {
+    if (!isdigit((unsigned char)name_or_index[i])) {
+      all_digits = 0;
+      break;
+    }
+  }
+
+  if (all_digits) {
+    int idx = atoi(name_or_index);
+    return (idx >= 0 && idx < ps->current_stage) ? idx : -1;
+  }
+
+  for (i = 0; i < ps->current_stage; i++) {
+    if (strcmp(zf->stages[i].name, name_or_index) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int has_glob_chars(const char *s) { return strpbrk(s, "*?[") != NULL; }
+
+static int cmp_str_ptr(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static int add_source(struct zinstr *in, const char *path, const char *host) {
+  struct zsource *grown = realloc(in->sources, sizeof(*grown) * (in->source_count + 1));
+
+  if (grown == NULL) {
+    return 1;
+  }
+
+  in->sources = grown;
+  snprintf(grown[in->source_count].path, sizeof(grown[0].path), "%s", path);
+  snprintf(grown[in->source_count].host, sizeof(grown[0].host), "%s", host);
+  in->source_count++;
+  return 0;
+}
+
+/*
+ * Resolves one build context source. Globs are expanded here, sorted with
+ * strcmp rather than the locale so the combined source hash is stable.
+ */
+static void add_context_source(struct parse_state *ps, struct zinstr *in, const char *cmd,
+                               int line_no, const char *src) {
+  char host[PATH_MAX];
+  glob_t matches;
+  size_t context_len = strlen(ps->zf->context_dir);
+  size_t i;
+
+  if (src[0] == '/') {
+    snprintf(host, sizeof(host), "%s", src);
+  } else {
+    snprintf(host, sizeof(host), "%s/%s", ps->zf->context_dir, src);
+  }
+
+  if (!has_glob_chars(src)) {
+    struct stat st;
+
+    if (lstat(host, &st) != 0) {
+      parse_error(ps, line_no, "%s source not found (%s)", cmd, host);
+      return;
+    }
+    if (add_source(in, src, host) != 0) {
+      parse_error(ps, line_no, "Out of memory");
+    }
+    return;
+  }
+
+  in->has_glob = 1;
+  if (glob(host, GLOB_NOSORT, NULL, &matches) != 0 || matches.gl_pathc == 0) {
+    parse_error(ps, line_no, "%s pattern matched no files (%s)", cmd, host);
+    return;
+  }
+
+  qsort(matches.gl_pathv, matches.gl_pathc, sizeof(char *), cmp_str_ptr);
+
+  for (i = 0; i < matches.gl_pathc; i++) {
+    const char *match = matches.gl_pathv[i];
+    const char *rel = match;
+
+    if (src[0] != '/' && strncmp(match, ps->zf->context_dir, context_len) == 0 &&
+        match[context_len] == '/') {
+      rel = match + context_len + 1;
+    }
+
+    if (add_source(in, rel, match) != 0) {
+      parse_error(ps, line_no, "Out of memory");
+      break;
+    }
+  }
+
+  globfree(&matches);
+}
+
+static void parse_copy_or_add(struct parse_state *ps, enum zinstr_kind kind,
+                              const char *cmd, int line_no, const char *rest,
+                              const char *text) {
+  struct zinstr *in;
+  char substituted[2048];
+  char from_stage[64];
+  char *tokens[256];
+  char add_src[PATH_MAX];
+  char add_dst[512];
+  char sources[PATH_MAX];
+  char checksum[80];
+  const char *dst;
+  int token_count = 0;
+  int link = 0;
+  int i;
+
+  if (substitute_args(rest, scope_args(ps), substituted, sizeof(substituted)) != 0) {
+    parse_error(ps, line_no, "%s arguments are too long", cmd);
+    return;
+  }
+
+  if (kind == ZI_COPY) {
+    if (parse_copy_tokens(substituted, from_stage, sizeof(from_stage), &link, tokens,
+                          (int)(sizeof(tokens) / sizeof(tokens[0])), &token_count) != 0) {
+      parse_error(ps, line_no, "Invalid COPY");
+      return;
+    }
+  } else {
+    const char *args = substituted;
+
+    from_stage[0] = '\0';
+    checksum[0] = '\0';
+    if (starts_with(args, "--checksum=")) {
+      size_t len = strcspn(args, " \t");
+
+      snprintf(checksum, sizeof(checksum), "%.*s", (int)(len - 11), args + 11);
+      args += len;
+    }
+
+    if (parse_two_tokens(args, add_src, sizeof(add_src), add_dst, sizeof(add_dst)) != 0) {
+      parse_error(ps, line_no, "Invalid ADD");
+      return;
+    }
+    tokens[0] = add_src;
+    tokens[1] = add_dst;
+    token_count = 2;
+  }
+
+  dst = tokens[token_count - 1];
+  sources[0] = '\0';
+  for (i = 0; i < token_count - 1; i++) {
+    size_t used = strlen(sources);
+    snprintf(sources + used, sizeof(sources) - used, "%s%s", i == 0 ? "" : " ", tokens[i]);
+  }
+
+  in = append_instr(ps, kind, line_no, text);
+  if (in == NULL) {
+    parse_error(ps, line_no, "Out of memory");
+    return;
+  }
+
+  in->link = link;
+  if (kind == ZI_ADD && checksum[0] != '\0') {
+    if (!download_checksum_valid(checksum)) {
+      parse_error(ps, line_no, "Invalid ADD --checksum '%s' (use sha256:<hex>)", checksum);
+    }
+    snprintf(in->checksum, sizeof(in->checksum), "%s", checksum);
+  }
+  snprintf(in->source, sizeof(in->source), "%s", sources);
+  snprintf(in->destination, sizeof(in->destination), "%s", dst);
+
+  if (normalize_container_path(ps->workdir, dst, in->destination_abs,
+                               sizeof(in->destination_abs)) != 0) {
+    parse_error(ps, line_no, "Invalid %s destination '%s'", cmd, dst);
+    return;
+  }
+
+  if (from_stage[0] != '\0') {
+    in->from_stage = find_earlier_stage(ps, from_stage);
+    snprintf(in->from_name, sizeof(in->from_name), "%s", from_stage);
+    if (in->from_stage < 0) {
+      parse_error(ps, line_no, "COPY --from must name an earlier stage, got '%s'",
+                  from_stage);
+    }
+
+    for (i = 0; i < token_count - 1; i++) {
+      if (has_glob_chars(tokens[i])) {
+        in->has_glob = 1;
+      }
+      if (add_source(in, tokens[i], "") != 0) {
+        parse_error(ps, line_no, "Out of memory");
+        return;
+      }
+    }
+  } else if (kind == ZI_ADD &&
+             (starts_with(tokens[0], "http://") || starts_with(tokens[0], "https://"))) {
+    in->is_url = 1;
+    if (add_source(in, tokens[0], "") != 0) {
+      parse_error(ps, line_no, "Out of memory");
+      return;
+    }
+  } else {
+    if (kind == ZI_ADD && checksum[0] != '\0') {
+      parse_error(ps, line_no, "ADD --checksum only applies to URL sources");
+    }
+    for (i = 0; i < token_count - 1; i++) {
+      add_context_source(ps, in, cmd, line_no, tokens[i]);
+    }
+  }
+
+  if ((token_count > 2 || in->source_count > 1) && dst[strlen(dst) - 1] != '/') {
+    parse_error(ps, line_no, "%s with multiple sources needs a destination ending in '/'",
+                cmd);
+  }
+}
+
+static void parse_instruction(struct parse_state *ps, int line_no, char *trimmed) {
+  char cmd[32];
+  char *rest;
+  int i;
+
+  for (i = 0; trimmed[i] != '\0' && !isspace((unsigned char)trimmed[i]) &&
+              i < (int)sizeof(cmd) - 1;
+       i++) {
+    cmd[i] = (char)toupper((unsigned char)trimmed[i]);
+  }
+  cmd[i] = '\0';
+  rest = trim_whitespace(trimmed + i);
+
+  if (strcmp(cmd, "ARG") == 0) {
+    parse_arg(ps, line_no, rest);
+    return;
+  }
+
+  if (strcmp(cmd, "FROM") == 0) {
+    parse_stage(ps, ZI_FROM, cmd, line_no, rest, trimmed);
+    return;
+  }
+
+  if (strcmp(cmd, "BASEDIR") == 0) {
+    parse_stage(ps, ZI_BASEDIR, cmd, line_no, rest, trimmed);
+    return;
+  }
+
+  if (strcmp(cmd, "RUN") != 0 && strcmp(cmd, "WORKDIR") != 0 && strcmp(cmd, "COPY") != 0 &&
+      strcmp(cmd, "ADD") != 0 && strcmp(cmd, "CMD") != 0) {
+    parse_error(ps, line_no, "Unsupported instruction %s", cmd);
+    return;
+  }
+
+  if (ps->current_stage < 0) {
+    parse_error(ps, line_no, "%s used before FROM/BASEDIR", cmd);
+    return;
+  }
+
+  if (strcmp(cmd, "COPY") == 0) {
+    parse_copy_or_add(ps, ZI_COPY, cmd, line_no, rest, trimmed);
+    return;
+  }
+
+  if (strcmp(cmd, "ADD") == 0) {
+    parse_copy_or_add(ps, ZI_ADD, cmd, line_no, rest, trimmed);
+    return;
+  }
+
+  {
+    enum zinstr_kind kind = ZI_CMD;
+    char value[1024];
+    struct zinstr *in;
+
+    if (strcmp(cmd, "RUN") == 0) {
+      kind = ZI_RUN;
+    } else if (strcmp(cmd, "WORKDIR") == 0) {
+      kind = ZI_WORKDIR;
+    }
+
+    if (rest[0] == '\0') {
+      parse_error(ps, line_no, "%s needs an argument", cmd);
+      return;
+    }
+
+    if (substitute_args(rest, scope_args(ps), value, sizeof(value)) != 0) {
+      parse_error(ps, line_no, "%s argument is too long", cmd);
+      return;
+    }
+
+    in = append_instr(ps, kind, line_no, trimmed);
+    if (in == NULL) {
+      parse_error(ps, line_no, "Out of memory");
+      return;
+    }
+
+    if (kind == ZI_WORKDIR) {
+      if (normalize_container_path(ps->workdir, value, in->value, sizeof(in->value)) != 0) {
+        parse_error(ps, line_no, "Invalid WORKDIR '%s'", value);
+        return;
+      }
+      snprintf(ps->workdir, sizeof(ps->workdir), "%s", in->value);
+    } else {
+      snprintf(in->value, sizeof(in->value), "%s", value);
+    }
+  }
+}
+
+/*
+ * Only stages the final stage depends on through COPY --from are built. As
+ * --from can only name earlier stages, one backwards pass settles it.
+ */
+static void mark_needed_stages(struct zockerfile *zf) {
+  int s;
+  int i;
+
+  if (zf->stage_count == 0) {
+    return;
+  }
+
+  zf->stages[zf->stage_count - 1].needed = 1;
+  for (s = zf->stage_count - 1; s >= 0; s--) {
+    if (!zf->stages[s].needed) {
+      continue;
+    }
+    for (i = 0; i < zf->count; i++) {
+      if (zf->instrs[i].stage == s && zf->instrs[i].from_stage >= 0) {
+        zf->stages[zf->instrs[i].from_stage].needed = 1;
+      }
+    }
+  }
+}
+
+int zockerfile_parse(const char *path, const struct build_arg *cli_args, int cli_arg_count,
+                     struct zockerfile *out) {
+  struct parse_state *ps;
+  FILE *fp;
+  char *line = NULL;
+  size_t line_size = 0;
+  int line_no = 0;
+  int start_line = 0;
+  int errors;
+
+  if (path == NULL || out == NULL) {
+    return 1;
+  }
+
+  memset(out, 0, sizeof(*out));
+  snprintf(out->path, sizeof(out->path), "%s", path);
+  if (get_context_dir(path, out->context_dir, sizeof(out->context_dir)) != 0) {
+    return 1;
+  }
+
+  ps = calloc(1, sizeof(*ps));
+  if (ps == NULL) {
+    return 1;
+  }
+  ps->zf = out;
+  ps->current_stage = -1;
+  snprintf(ps->workdir, sizeof(ps->workdir), "/");
+
+  if (init_cli_args_map(cli_args, cli_arg_count, &ps->cli_args) != 0) {
+    fprintf(stderr, "[ERR] Too many --build-arg values\n");
+    free(ps);
+    return 1;
+  }
+  arg_map_copy(&ps->global_args, &ps->cli_args);
+
+  fp = fopen(path, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "[ERR] Failed to open Zockerfile: %s\n", path);
+    free(ps);
+    return 1;
+  }
+
+  while (read_logical_line(fp, &line, &line_size, &line_no, &start_line) == 0) {
+    char *trimmed = trim_whitespace(line);
+
+    if (trimmed[0] != '\0' && trimmed[0] != '#') {
+      parse_instruction(ps, start_line, trimmed);
+    }
+  }
+
+  free(line);
+  fclose(fp);
+
+  if (out->stage_count == 0) {
+    fprintf(stderr, "[ERR] Zockerfile has no FROM/BASEDIR\n");
+    ps->errors++;
+  }
+
+  errors = ps->errors;
+  free(ps);
+
+  if (errors != 0) {
+    fprintf(stderr, "[ERR] %s has %d error(s); nothing was built\n", path, errors);
+    zockerfile_free(out);
+    return 1;
+  }
+
+  mark_needed_stages(out);
+  return 0;
+}
+
+void zockerfile_free(struct zockerfile *zf) {
+  int i;
+
+  if (zf == NULL) {
+    return;
+  }
+
+  for (i = 0; i < zf->count; i++) {
+    free(zf->instrs[i].sources);
+  }
+
+  free(zf->instrs);
+  zf->instrs = NULL;
+  zf->count = 0;
+  zf->cap = 0;
+}
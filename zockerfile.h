@@ -0,0 +1,90 @@
+#ifndef __ZOCKERFILE_H__
+#define __ZOCKERFILE_H__
+
+#include <limits.h>
+
+#include "config.h"
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+#ifndef MAX_STAGES
+#define MAX_STAGES 32
+#endif
+
+enum zinstr_kind {
+  ZI_FROM = 0,
+  ZI_BASEDIR = 1,
+  ZI_RUN = 2,
+  ZI_WORKDIR = 3,
+  ZI_COPY = 4,
+  ZI_ADD = 5,
+  ZI_CMD = 6,
+};
+
+/*
+ * One COPY/ADD source. host is the absolute path of a build context source
+ * (after glob expansion) and empty for COPY --from paths and ADD URLs.
+ */
+struct zsource {
+  char path[PATH_MAX];
+  char host[PATH_MAX];
+};
+
+/*
+ * One validated Zockerfile instruction. ARGs are resolved by the front end and
+ * do not appear in the IR; every string here is already substituted.
+ */
+struct zinstr {
+  enum zinstr_kind kind;
+  int line_no;
+  int stage;
+  char text[2048];
+  char workdir[512];
+
+  /* RUN command, CMD value, or the new absolute WORKDIR. */
+  char value[1024];
+
+  /*
+   * COPY/ADD. from_stage is -1 unless COPY --from names an earlier stage.
+   * source holds the source tokens as written; context globs are expanded
+   * into sources in strcmp order, while COPY --from globs are expanded
+   * against the stage's rootfs at build time. checksum is ADD --checksum.
+   */
+  int from_stage;
+  char from_name[64];
+  int link;
+  int is_url;
+  char checksum[80];
+  int has_glob;
+  char source[PATH_MAX];
+  struct zsource *sources;
+  int source_count;
+  char destination[512];
+  char destination_abs[512];
+};
+
+struct zstage {
+  char name[64];
+  int line_no;
+  int is_basedir;
+  int needed;
+  char base[PATH_MAX];
+};
+
+struct zockerfile {
+  char path[PATH_MAX];
+  char context_dir[PATH_MAX];
+  struct zstage stages[MAX_STAGES];
+  int stage_count;
+  struct zinstr *instrs;
+  int count;
+  int cap;
+};
+
+int zockerfile_parse(const char *path, const struct build_arg *cli_args, int cli_arg_count,
+                     struct zockerfile *out);
+void zockerfile_free(struct zockerfile *zf);
+
+#endif